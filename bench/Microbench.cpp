@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include "Config.h"
+#include "JobTable.h"
+#include "Upload.h"
+#include "URL.h"
+#include "tinyformat.h"
+#include "src/inih/ini.h"
+
+// Microbenchmarks of the CPU work done for every upload, run with
+// "make microbench && ./microbench [filter]". Results are JSON on
+// stdout so they can be diffed or compared between builds.
+
+// Every allocation made by the process, counted by the replacement
+// operator new below so benchmarks can report allocations per op.
+static std::atomic<uint64_t> allocations(0), allocated(0);
+
+void *operator new(size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	allocated.fetch_add(size, std::memory_order_relaxed);
+	void *ptr = malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+// How long one measured run has to take at least, and how many
+// runs there are. The fastest run is reported, it's the one least
+// disturbed by everything else on the machine.
+static const std::chrono::milliseconds MinRunTime(50);
+static const int Runs = 5;
+
+// Function: Keep
+//
+// Arguments:
+//  value - a result of the benchmarked code.
+//
+// Description:
+// Stops the compiler from optimizing away work whose result isn't used.
+template<typename T> static inline void Keep(const T &value)
+{
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+// Struct: Benchmark
+//
+// Description:
+// A benchmark and what it measured.
+struct Benchmark
+{
+	const char *name;
+	void (*run)(uint64_t iterations);
+};
+
+// Function: Measure
+//
+// Arguments:
+//  bench - the benchmark.
+//  first - whether it's the first result printed.
+//
+// Description:
+// Finds how many iterations make a run long enough to time, runs it
+// Runs times and prints the fastest time and the allocations per op.
+static void Measure(const Benchmark &bench, bool first)
+{
+	uint64_t iterations = 1;
+	for (;;)
+	{
+		auto start = std::chrono::steady_clock::now();
+		bench.run(iterations);
+		if (std::chrono::steady_clock::now() - start >= MinRunTime)
+			break;
+		iterations *= 2;
+	}
+
+	double best = 0;
+	uint64_t allocs = allocations.load(), bytes = allocated.load();
+	for (int i = 0; i < Runs; ++i)
+	{
+		auto start = std::chrono::steady_clock::now();
+		bench.run(iterations);
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+		best = i == 0 ? ns : std::min(best, ns);
+	}
+	double ops = double(iterations) * Runs;
+	allocs = allocations.load() - allocs;
+	bytes = allocated.load() - bytes;
+
+	tfm::printf("%s\n\t\t{\"name\": \"%s\", \"iterations\": %d, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f}",
+		first ? "" : ",", bench.name, iterations, best, allocs / ops, bytes / ops);
+	fflush(stdout);
+}
+
+// The config everything below is done with.
+static const char ConfigText[] =
+	"[default]\n"
+	"uploader=teknik\n"
+	"; IO backend: auto, io_uring or blocking\n"
+	"io=auto\n"
+	"readahead=auto\n"
+	"dropcache=yes\n"
+	"cachettl=300\n"
+	"jobs=4\n"
+	"smallfile=1048576\n"
+	"maxmemory=256M\n"
+	"\n"
+	"[teknik]\n"
+	"url=https://api.teknik.io/v1/Upload\n"
+	"hedgesize=65536\n";
+static std::string ConfigFile;
+
+static const char Response[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Server: nginx\r\n"
+	"Date: Sun, 18 Oct 2026 12:00:00 GMT\r\n"
+	"Content-Type: application/json; charset=utf-8\r\n"
+	"Content-Length: 160\r\n"
+	"Connection: keep-alive\r\n"
+	"Cache-Control: private\r\n"
+	"\r\n"
+	"{\"result\":{\"name\":\"abcd.png\",\"url\":\"https:\\/\\/u.teknik.io\\/abcd.png\",\"contentType\":\"image\\/png\",\"contentLength\":123456,\"key\":null,\"iv\":null,\"deletionKey\":null}}\n";
+
+static void BenchURLParse(uint64_t iterations)
+{
+	std::string url = "https://user@api.teknik.io:443/v1/Upload?expire=1d#top";
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		URL parsed = URL::Parse(url);
+		Keep(parsed);
+	}
+}
+
+static int IgnoreValue(void *, const char *, const char *, const char *)
+{
+	return 1;
+}
+
+static void BenchINIParse(uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		int ret = ini_parse_string(ConfigText, IgnoreValue, nullptr);
+		Keep(ret);
+	}
+}
+
+static void BenchConfigLoad(uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		Config conf(ConfigFile);
+		Keep(conf);
+	}
+}
+
+// Class: BenchUpload
+//
+// Description:
+// Gets at the request building of an Upload.
+class BenchUpload : public Upload
+{
+public:
+	using Upload::Upload;
+
+	size_t Build()
+	{
+		ArenaString header(this->arena), epilogue(this->arena);
+		this->BuildRequest(header, epilogue);
+		return header.size() + epilogue.size();
+	}
+};
+
+static void BenchMultipart(uint64_t iterations)
+{
+	static char data[64 * 1024];
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		BenchUpload upload(UploadSource::FromBuffer(data, sizeof(data), "holiday photo (1).png"));
+		size_t len = upload.Build();
+		Keep(len);
+	}
+}
+
+static void BenchPathHash(uint64_t iterations)
+{
+	static std::vector<std::string> paths;
+	if (paths.empty())
+		for (int i = 0; i < 4096; ++i)
+			paths.push_back(tfm::format("/home/user/pictures/2026/10/IMG_%05d.jpg", i));
+
+	JobTable jobs;
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		const std::string &path = paths[i % paths.size()];
+		if (i % paths.size() == 0)
+			jobs.Clear();
+		size_t job = jobs.Add(path.c_str(), path.size());
+		Keep(job);
+	}
+}
+
+static void BenchResponseParse(uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		Arena arena;
+		ArenaString response(arena);
+		response.assign(Response, sizeof(Response) - 1);
+		ResponseState state;
+		bool complete = ResponseComplete(response, state);
+		std::string link = GetLink(response, arena);
+		Keep(complete);
+		Keep(link);
+	}
+}
+
+static const Benchmark Benchmarks[] =
+{
+	{ "url_parse", BenchURLParse },
+	{ "ini_parse", BenchINIParse },
+	{ "config_load", BenchConfigLoad },
+	{ "multipart_request", BenchMultipart },
+	{ "path_hash", BenchPathHash },
+	{ "response_parse", BenchResponseParse },
+};
+
+int main(int argc, char **argv)
+{
+	const char *filter = argc > 1 ? argv[1] : "";
+
+	// Config loading reads a real file, the rest use the config it loads.
+	char path[] = "/tmp/microbench-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0 || write(fd, ConfigText, sizeof(ConfigText) - 1) != ssize_t(sizeof(ConfigText) - 1))
+	{
+		tfm::printf("Cannot write %s: %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	ConfigFile = path;
+	config = new Config(ConfigFile);
+
+	tfm::printf("{\n\t\"benchmarks\": [");
+	bool first = true;
+	for (auto const &bench : Benchmarks)
+	{
+		if (!strstr(bench.name, filter))
+			continue;
+		Measure(bench, first);
+		first = false;
+	}
+	tfm::printf("\n\t]\n}\n");
+
+	unlink(path);
+	delete config;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,800 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Config.h"
+#include "Exceptions.h"
+#include "Kittehuplodah.h"
+#include "Socket.h"
+#include "Upload.h"
+#include "Util.h"
+#include "tinyformat.h"
+
+// The training workload for profile-guided builds ("make pgo", see
+// cmake/PGO.cmake), also runnable on it's own with
+// "make pgotrain && ./pgotrain [rounds]". It uploads a mix of small,
+// medium and large files to a TLS server on the loopback interface,
+// in every way the uploader can (IO backends, encryption, S3 and the
+// coroutine uploads), so the profile covers the paths the fleet spends
+// it's time in.
+
+// Files uploaded each round: how many of them and their size range.
+struct FileClass
+{
+	int count;
+	size_t minsize, maxsize;
+};
+
+static const FileClass FileClasses[] =
+{
+	{ 48, 1024, 64 * 1024 },
+	{ 12, 256 * 1024, 1024 * 1024 },
+	{ 4, 4 * 1024 * 1024, 16 * 1024 * 1024 },
+};
+
+// How every round is uploaded, one pass each.
+struct Pass
+{
+	const char *io;
+	const char *encrypt;
+	const char *type;
+};
+
+static const Pass Passes[] =
+{
+	{ "auto", "none", "form" },
+	{ "blocking", "none", "form" },
+	{ "auto", "gcm", "form" },
+	{ "auto", "ctr", "form" },
+	{ "auto", "none", "s3" },
+#ifdef HAVE_COROUTINE
+	// Upload::RunAsync() on one event loop instead of UploadMany().
+	{ "auto", "none", "async" },
+#endif
+};
+
+// Credentials the server checks S3 requests were signed with. Parts
+// are small enough that the large files go up in several of them.
+static const char AccessKey[] = "pgotrain";
+static const char SecretKey[] = "pgotrain-secret";
+static const char Region[] = "us-east-1";
+static const char PartSize[] = "5M";
+
+// How long before it arrives S3 still accepts a request signed.
+static const time_t MaxSkew = 15 * 60;
+
+static const char StreamingPayload[] = "STREAMING-AWS4-HMAC-SHA256-PAYLOAD";
+static const char EmptyHash[] = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+
+// Small uploads that come from memory instead of a file.
+static const int BufferCount = 16;
+static const size_t BufferSize = 16 * 1024;
+
+// Class: TrainingServer
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// A minimal uploader on 127.0.0.1: it accepts TLS connections with a
+// self-signed certificate for localhost, throws away each request's
+// body and responds with a link, keeping the connection alive. Signed
+// requests are answered as an S3 store would, after checking their
+// signature and their body's chunk signatures the way S3 does, so
+// the S3 pass fails if the uploader gets either wrong.
+class TrainingServer
+{
+	SSL_CTX *ctx;
+	int listener;
+	unsigned short port;
+
+	std::thread acceptor;
+	std::vector<std::thread> connections;
+	std::set<int> fds;
+	std::mutex lock;
+	std::atomic<uint64_t> served;
+
+	bool MakeCertificate(const std::string &certfile);
+	void Accept();
+	void Serve(int fd);
+	std::string AnswerS3(const std::string &method, const std::string &target,
+		const std::map<std::string, std::string> &headers, const std::string &body);
+public:
+	TrainingServer() : ctx(nullptr), listener(-1), port(0), served(0) { }
+	~TrainingServer();
+
+	bool Start(const std::string &certfile);
+	void Stop();
+
+	// Getters/setters.
+	inline unsigned short GetPort() const { return this->port; }
+	inline uint64_t GetServed() const { return this->served.load(); }
+};
+
+TrainingServer::~TrainingServer()
+{
+	this->Stop();
+	if (this->ctx)
+		SSL_CTX_free(this->ctx);
+}
+
+// Function: MakeCertificate
+//
+// Arguments:
+//  certfile - where the certificate is written for the client to trust.
+//
+// Description:
+// Makes a P-256 key and a self-signed certificate for localhost
+// and loads both into the server's TLS context.
+bool TrainingServer::MakeCertificate(const std::string &certfile)
+{
+	EVP_PKEY *key = nullptr;
+	EVP_PKEY_CTX *keyctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+	if (!keyctx || EVP_PKEY_keygen_init(keyctx) <= 0 || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyctx, NID_X9_62_prime256v1) <= 0 ||
+		EVP_PKEY_keygen(keyctx, &key) <= 0)
+	{
+		EVP_PKEY_CTX_free(keyctx);
+		return false;
+	}
+	EVP_PKEY_CTX_free(keyctx);
+
+	X509 *cert = X509_new();
+	X509_set_version(cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+	X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 60 * 60);
+	X509_set_pubkey(cert, key);
+
+	X509_NAME *name = X509_get_subject_name(cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+	X509_set_issuer_name(cert, name);
+
+	X509V3_CTX extctx;
+	X509V3_set_ctx_nodb(&extctx);
+	X509V3_set_ctx(&extctx, cert, cert, nullptr, nullptr, 0);
+	X509_EXTENSION *ext = X509V3_EXT_conf_nid(nullptr, &extctx, NID_subject_alt_name, const_cast<char *>("DNS:localhost"));
+	bool ok = ext && X509_add_ext(cert, ext, -1) && X509_sign(cert, key, EVP_sha256());
+	X509_EXTENSION_free(ext);
+
+	FILE *f = ok ? fopen(certfile.c_str(), "w") : nullptr;
+	ok = f && PEM_write_X509(f, cert);
+	if (f)
+		fclose(f);
+
+	ok = ok && SSL_CTX_use_certificate(this->ctx, cert) == 1 && SSL_CTX_use_PrivateKey(this->ctx, key) == 1;
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return ok;
+}
+
+// Function: Start
+//
+// Arguments:
+//  certfile - where the certificate is written for the client to trust.
+//
+// Description:
+// Listens on a free port on 127.0.0.1 and starts accepting
+// connections, returns false if it couldn't.
+bool TrainingServer::Start(const std::string &certfile)
+{
+	this->ctx = SSL_CTX_new(TLS_server_method());
+	if (!this->ctx || !this->MakeCertificate(certfile))
+	{
+		tfm::printf("Cannot set up TLS: %s\n", GetSSLErrors());
+		return false;
+	}
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+
+	this->listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (this->listener < 0 || bind(this->listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+		listen(this->listener, 64) < 0 || getsockname(this->listener, reinterpret_cast<sockaddr *>(&addr), &len) < 0)
+	{
+		tfm::printf("Cannot listen on 127.0.0.1: %s\n", strerror(errno));
+		return false;
+	}
+	this->port = ntohs(addr.sin_port);
+
+	this->acceptor = std::thread(&TrainingServer::Accept, this);
+	return true;
+}
+
+// Function: Stop
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Stops accepting, shuts down the connections still open
+// and waits for all of them to finish.
+void TrainingServer::Stop()
+{
+	if (this->listener < 0)
+		return;
+
+	shutdown(this->listener, SHUT_RDWR);
+	if (this->acceptor.joinable())
+		this->acceptor.join();
+	close(this->listener);
+	this->listener = -1;
+
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		for (int fd : this->fds)
+			shutdown(fd, SHUT_RDWR);
+	}
+	for (auto &connection : this->connections)
+		connection.join();
+	this->connections.clear();
+}
+
+// Function: Accept
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Gives every connection a thread of it's own until the
+// listening socket is shut down.
+void TrainingServer::Accept()
+{
+	for (;;)
+	{
+		int fd = accept4(this->listener, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->fds.insert(fd);
+		this->connections.emplace_back(&TrainingServer::Serve, this, fd);
+	}
+}
+
+// Function: Serve
+//
+// Arguments:
+//  fd - the accepted connection.
+//
+// Description:
+// Answers requests on a connection until the client closes it. Only
+// Content-Length bodies are understood, which is all the uploader sends.
+// Bodies are thrown away as they come in, except those of S3 requests
+// which are checked once they're all there.
+void TrainingServer::Serve(int fd)
+{
+	SSL *ssl = SSL_new(this->ctx);
+	SSL_set_fd(ssl, fd);
+
+	std::string buffer;
+	char data[64 * 1024];
+	auto fill = [&]()
+	{
+		int len = SSL_read(ssl, data, sizeof(data));
+		if (len <= 0)
+			return false;
+		buffer.append(data, len);
+		return true;
+	};
+
+	bool open = SSL_accept(ssl) == 1;
+	while (open)
+	{
+		size_t end;
+		while (open && (end = buffer.find("\r\n\r\n")) == std::string::npos)
+			open = fill();
+		if (!open)
+			break;
+
+		// The request line, then headers by their lower case names.
+		std::string method, target;
+		std::map<std::string, std::string> headers;
+		for (size_t pos = 0, line = 0; pos < end; ++line)
+		{
+			size_t next = std::min(buffer.find("\r\n", pos), end);
+			size_t colon = buffer.find(':', pos);
+			if (line == 0)
+			{
+				size_t space = buffer.find(' ', pos);
+				method = buffer.substr(pos, space - pos);
+				target = buffer.substr(space + 1, buffer.find(' ', space + 1) - space - 1);
+			}
+			else if (colon < next)
+			{
+				std::string name = buffer.substr(pos, colon - pos);
+				std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+				size_t value = buffer.find_first_not_of(' ', colon + 1);
+				headers[name] = value < next ? buffer.substr(value, next - value) : "";
+			}
+			pos = next + 2;
+		}
+		uint64_t left = strtoull(headers["content-length"].c_str(), nullptr, 10);
+		bool s3 = headers.count("x-amz-date") != 0;
+		buffer.erase(0, end + 4);
+
+		std::string body;
+		while (open && buffer.size() < left)
+		{
+			if (s3)
+				body += buffer;
+			left -= buffer.size();
+			buffer.clear();
+			open = fill();
+		}
+		if (!open)
+			break;
+		if (s3)
+			body.append(buffer, 0, left);
+		buffer.erase(0, left);
+
+		std::string response;
+		if (s3)
+			response = this->AnswerS3(method, target, headers, body);
+		else
+		{
+			uint64_t id = ++this->served;
+			std::string reply = tfm::format("{\"result\":{\"url\":\"https:\\/\\/localhost\\/%016x\"}}", id);
+			response = tfm::format("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n%s", reply.size(), reply);
+		}
+		open = SSL_write(ssl, response.data(), response.size()) == int(response.size());
+	}
+
+	SSL_free(ssl);
+	std::lock_guard<std::mutex> guard(this->lock);
+	this->fds.erase(fd);
+	close(fd);
+}
+
+// Function: SHA256Hex
+//
+// Arguments:
+//  data - what to hash.
+//  len  - how much of it there is.
+//
+// Description:
+// Returns the SHA-256 of the data in hex.
+static std::string SHA256Hex(const void *data, size_t len)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen = 0;
+	EVP_Digest(data, len, md, &mdlen, EVP_sha256(), nullptr);
+	return ToHex(md, mdlen);
+}
+
+// Function: HMACSHA256
+//
+// Arguments:
+//  key    - the key.
+//  keylen - length of the key.
+//  msg    - what to sign.
+//  out    - 32 bytes where the MAC goes.
+//
+// Description:
+// The HMAC-SHA256 that every step of a signature is made with.
+static void HMACSHA256(const void *key, size_t keylen, const std::string &msg, unsigned char *out)
+{
+	unsigned int len;
+	HMAC(EVP_sha256(), key, keylen, reinterpret_cast<const unsigned char*>(msg.data()), msg.size(), out, &len);
+}
+
+// Function: CheckSigned
+//
+// Arguments:
+//  method  - the request's method.
+//  target  - it's path and query, as they were sent.
+//  headers - it's headers, by lower case name.
+//  body    - it's body.
+//
+// Description:
+// Checks an S3 request the way S3 would: that it's signed with SigV4
+// for the training credentials no more than MaxSkew from now, and that
+// a streamed body is aws-chunked with every chunk signed in turn and
+// adds up to the decoded length it claims. Returns what's wrong with
+// it, or nothing if it's fine.
+static std::string CheckSigned(const std::string &method, const std::string &target,
+	const std::map<std::string, std::string> &headers, const std::string &body)
+{
+	auto get = [&](const std::string &name)
+	{
+		auto it = headers.find(name);
+		return it == headers.end() ? std::string() : it->second;
+	};
+
+	// AWS4-HMAC-SHA256 Credential=<key>/<scope>, SignedHeaders=<names>, Signature=<hex>
+	std::string auth = get("authorization"), credential = tfm::format("AWS4-HMAC-SHA256 Credential=%s/", AccessKey);
+	size_t names = auth.find(", SignedHeaders="), sig = auth.find(", Signature=");
+	if (auth.compare(0, credential.size(), credential) != 0 || names == std::string::npos || sig == std::string::npos || sig < names)
+		return "Malformed authorization: " + auth;
+	std::string scope = auth.substr(credential.size(), names - credential.size());
+	std::string signedheaders = auth.substr(names + 16, sig - names - 16);
+	std::string signature = auth.substr(sig + 12);
+
+	std::string amzdate = get("x-amz-date");
+	struct tm tm = { };
+	const char *end = strptime(amzdate.c_str(), "%Y%m%dT%H%M%SZ", &tm);
+	if (!end || *end)
+		return "Malformed x-amz-date: " + amzdate;
+	time_t skew = time(nullptr) - timegm(&tm);
+	if (skew > MaxSkew || skew < -MaxSkew)
+		return "RequestTimeTooSkewed: signed for " + amzdate;
+	std::string day = amzdate.substr(0, 8);
+	if (scope != day + "/" + Region + "/s3/aws4_request")
+		return "Wrong credential scope: " + scope;
+
+	std::string payloadhash = get("x-amz-content-sha256");
+	for (const char *required : { "host", "x-amz-content-sha256", "x-amz-date" })
+	{
+		if ((";" + signedheaders + ";").find(std::string(";") + required + ";") == std::string::npos)
+			return tfm::format("%s isn't signed", required);
+	}
+
+	size_t query = target.find('?');
+	std::string canonical = method + "\n" + target.substr(0, query) + "\n" +
+		(query == std::string::npos ? "" : target.substr(query + 1)) + "\n";
+	for (size_t pos = 0; pos < signedheaders.size(); )
+	{
+		size_t next = std::min(signedheaders.find(';', pos), signedheaders.size());
+		std::string name = signedheaders.substr(pos, next - pos);
+		if (!headers.count(name))
+			return "Signed header " + name + " is missing";
+		canonical += name + ":" + get(name) + "\n";
+		pos = next + 1;
+	}
+	canonical += "\n" + signedheaders + "\n" + payloadhash;
+
+	std::string secret = std::string("AWS4") + SecretKey;
+	unsigned char key[32], mac[32];
+	HMACSHA256(secret.data(), secret.size(), day, key);
+	HMACSHA256(key, sizeof(key), Region, key);
+	HMACSHA256(key, sizeof(key), "s3", key);
+	HMACSHA256(key, sizeof(key), "aws4_request", key);
+	HMACSHA256(key, sizeof(key), "AWS4-HMAC-SHA256\n" + amzdate + "\n" + scope + "\n" + SHA256Hex(canonical.data(), canonical.size()), mac);
+	std::string previous = ToHex(mac, sizeof(mac));
+	if (previous != signature)
+		return "SignatureDoesNotMatch";
+
+	if (payloadhash != StreamingPayload)
+		return SHA256Hex(body.data(), body.size()) == payloadhash ? "" : "XAmzContentSHA256Mismatch";
+	if (get("content-encoding") != "aws-chunked")
+		return "Streamed body isn't aws-chunked";
+
+	// <hex length>;chunk-signature=<hex>\r\n<data>\r\n until an empty
+	// chunk, every chunk but the last being at least 8 KiB.
+	uint64_t decoded = 0;
+	size_t last = SIZE_MAX;
+	for (size_t pos = 0; ; )
+	{
+		size_t eol = body.find("\r\n", pos), mark = body.find(";chunk-signature=", pos);
+		if (eol == std::string::npos || mark == std::string::npos || mark > eol)
+			return "Malformed chunk header";
+		char *hexend;
+		size_t len = strtoull(body.c_str() + pos, &hexend, 16);
+		if (mark == pos || hexend != body.c_str() + mark)
+			return "Malformed chunk length";
+		if (len && last < 8192)
+			return "A chunk before the last is under 8 KiB";
+		std::string chunksig = body.substr(mark + 17, eol - mark - 17);
+		pos = eol + 2;
+		if (body.size() - pos < len + 2 || body.compare(pos + len, 2, "\r\n") != 0)
+			return "Chunk is truncated";
+
+		HMACSHA256(key, sizeof(key), "AWS4-HMAC-SHA256-PAYLOAD\n" + amzdate + "\n" + scope + "\n" + previous + "\n" +
+			EmptyHash + "\n" + SHA256Hex(body.data() + pos, len), mac);
+		previous = ToHex(mac, sizeof(mac));
+		if (chunksig != previous)
+			return "Chunk signature doesn't match";
+		pos += len + 2;
+		decoded += len;
+		last = len;
+
+		if (len == 0)
+		{
+			if (pos != body.size())
+				return "Data after the last chunk";
+			break;
+		}
+	}
+	if (get("x-amz-decoded-content-length") != std::to_string(decoded))
+		return tfm::format("Decoded %d bytes, not x-amz-decoded-content-length", decoded);
+	return "";
+}
+
+// Function: AnswerS3
+//
+// Arguments:
+//  method  - the request's method.
+//  target  - it's path and query.
+//  headers - it's headers, by lower case name.
+//  body    - it's body.
+//
+// Description:
+// Responds to an S3 request the way a store would, just enough for
+// the uploader to get through a (multipart) upload, or with a 403 if
+// CheckSigned() finds anything wrong with it.
+std::string TrainingServer::AnswerS3(const std::string &method, const std::string &target,
+	const std::map<std::string, std::string> &headers, const std::string &body)
+{
+	std::string error = CheckSigned(method, target, headers, body);
+	if (!error.empty())
+	{
+		std::string reply = tfm::format("<Error><Code>AccessDenied</Code><Message>%s</Message></Error>", error);
+		return tfm::format("HTTP/1.1 403 Forbidden\r\nContent-Type: application/xml\r\nContent-Length: %d\r\n\r\n%s", reply.size(), reply);
+	}
+
+	uint64_t id = ++this->served;
+	std::string query = target.substr(std::min(target.find('?'), target.size())), reply, etag;
+	if (method == "POST" && query == "?uploads=")
+		reply = tfm::format("<InitiateMultipartUploadResult><UploadId>%016x</UploadId></InitiateMultipartUploadResult>", id);
+	else if (method == "POST")
+		reply = "<CompleteMultipartUploadResult></CompleteMultipartUploadResult>";
+	else if (method == "PUT")
+		etag = tfm::format("ETag: \"%016x\"\r\n", id);
+	return tfm::format("HTTP/1.1 200 OK\r\n%sContent-Type: application/xml\r\nContent-Length: %d\r\n\r\n%s", etag, reply.size(), reply);
+}
+
+// Function: MakeFiles
+//
+// Arguments:
+//  dir   - where to make them.
+//  paths - gets the files' paths.
+//
+// Description:
+// Writes the files of every FileClass, filled with random bytes so
+// they don't compress, and returns how many bytes they add up to
+// (or -1 if one couldn't be written). The same seed is used every
+// time so profiles from different runs are comparable.
+static int64_t MakeFiles(const std::string &dir, std::vector<std::string> &paths)
+{
+	std::mt19937_64 random(0x6b697474656875);
+	std::vector<uint64_t> data;
+	int64_t total = 0;
+
+	for (auto const &fileclass : FileClasses)
+	{
+		for (int i = 0; i < fileclass.count; ++i)
+		{
+			size_t size = fileclass.minsize + random() % (fileclass.maxsize - fileclass.minsize + 1);
+			data.resize(size / sizeof(uint64_t) + 1);
+			for (auto &word : data)
+				word = random();
+
+			std::string path = tfm::format("%s/file%d.bin", dir, paths.size());
+			FILE *f = fopen(path.c_str(), "w");
+			bool ok = f && fwrite(data.data(), 1, size, f) == size;
+			if (f && fclose(f) != 0)
+				ok = false;
+			if (!ok)
+			{
+				tfm::printf("Cannot write %s: %s\n", path, strerror(errno));
+				return -1;
+			}
+
+			paths.push_back(path);
+			total += size;
+		}
+	}
+
+	return total;
+}
+
+#ifdef HAVE_COROUTINE
+// How many tasks share the event loop in the async pass.
+static const size_t AsyncTasks = 8;
+
+// Function: IsTrainingLink
+//
+// Arguments:
+//  link - a link an upload returned.
+//
+// Description:
+// Returns true if it's the whole of a link TrainingServer gives out,
+// not one cut short by a response that was.
+static bool IsTrainingLink(const std::string &link)
+{
+	static const std::string prefix = "https://localhost/";
+	if (link.size() != prefix.size() + 16 || link.compare(0, prefix.size(), prefix) != 0)
+		return false;
+	return std::all_of(link.begin() + prefix.size(), link.end(), [](unsigned char c) { return isxdigit(c); });
+}
+
+// Function: RunAsyncUploads
+//
+// Arguments:
+//  loop    - event loop the task runs on.
+//  sources - what the async pass uploads.
+//  first   - the first source this task uploads, after which it
+//            takes every AsyncTasks'th one.
+//  failed  - counts the uploads that failed.
+//
+// Description:
+// One of the async pass's tasks, uploading it's share of the sources
+// one after the other with Upload::RunAsync() and checking the links.
+static Task<void> RunAsyncUploads(EventLoop &loop, const std::vector<UploadSource> &sources, size_t first, std::atomic<int> &failed)
+{
+	for (size_t i = first; i < sources.size(); i += AsyncTasks)
+	{
+		try
+		{
+			Upload upload(sources[i]);
+			std::string link = co_await upload.RunAsync(loop);
+			if (!IsTrainingLink(link))
+				throw UploadException("Got a link that isn't the server's: %s", link);
+		}
+		catch (const std::exception &e)
+		{
+			if (failed++ == 0)
+				tfm::printf("Uploading %s failed: %s\n", sources[i].name, e.what());
+		}
+	}
+}
+
+// Function: UploadAsync
+//
+// Arguments:
+//  sources - what to upload.
+//  failed  - counts the uploads that failed.
+//
+// Description:
+// The async pass: uploads the sources with AsyncTasks tasks
+// running at once on a single EventLoop.
+static void UploadAsync(const std::vector<UploadSource> &sources, std::atomic<int> &failed)
+{
+	EventLoop loop;
+	for (size_t i = 0; i < AsyncTasks; ++i)
+		loop.Spawn(RunAsyncUploads(loop, sources, i, failed));
+	loop.Run();
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	int rounds = argc > 1 ? std::max(atoi(argv[1]), 1) : 3;
+
+	char dir[] = "/tmp/pgotrain-XXXXXX";
+	if (!mkdtemp(dir))
+	{
+		tfm::printf("Cannot make a directory for the training files: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	std::vector<std::string> paths;
+	int64_t bytes = MakeFiles(dir, paths);
+	std::string certfile = tfm::format("%s/cert.pem", dir);
+	std::string configfile = tfm::format("%s/pgotrain.ini", dir);
+
+	TrainingServer server;
+	int ret = EXIT_FAILURE;
+	if (bytes >= 0 && server.Start(certfile))
+	{
+		FILE *f = fopen(configfile.c_str(), "w");
+		if (f)
+		{
+			fputs(tfm::format("[default]\nuploader=train\njobs=4\nmaxmemory=256M\n\n[train]\nurl=https://localhost:%d/Upload\ncafile=%s\n"
+				"bucket=pgotrain\naccesskey=%s\nsecretkey=%s\nregion=%s\npartsize=%s\nconnections=4\n",
+				server.GetPort(), certfile, AccessKey, SecretKey, Region, PartSize).c_str(), f);
+			fclose(f);
+		}
+
+		static char buffer[BufferSize];
+		std::vector<std::string> names;
+		for (int i = 0; i < BufferCount; ++i)
+			names.push_back(tfm::format("buffer%d.bin", i));
+
+		std::vector<UploadSource> sources;
+		for (auto const &path : paths)
+			sources.push_back(UploadSource::FromPath(path));
+		for (auto const &name : names)
+			sources.push_back(UploadSource::FromBuffer(buffer, sizeof(buffer), name));
+
+		try
+		{
+			config = new Config(configfile);
+			InitUploader(config);
+
+			std::atomic<int> failed(0);
+			auto start = std::chrono::steady_clock::now();
+			for (int round = 0; round < rounds; ++round)
+			{
+				for (auto const &pass : Passes)
+				{
+					config->iobackend = pass.io;
+					config->encrypt = pass.encrypt;
+					config->type = pass.type;
+#ifdef HAVE_COROUTINE
+					if (strcmp(pass.type, "async") == 0)
+					{
+						config->type = "form";
+						UploadAsync(sources, failed);
+						continue;
+					}
+#endif
+					UploadMany(sources, [&](size_t index, const std::string &link, std::exception_ptr error)
+					{
+						if (!error)
+							return;
+						try
+						{
+							std::rethrow_exception(error);
+						}
+						catch (const std::exception &e)
+						{
+							if (failed++ == 0)
+								tfm::printf("Uploading %s failed: %s\n", sources[index].name, e.what());
+						}
+					});
+				}
+			}
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			ShutdownUploader();
+
+			int uploads = rounds * (sizeof(Passes) / sizeof(Passes[0])) * sources.size();
+			tfm::printf("Uploaded %d files (%.1f MB) in %.2fs, %d failed\n", uploads,
+				rounds * (sizeof(Passes) / sizeof(Passes[0])) * (bytes + BufferCount * BufferSize) / 1e6, seconds, failed.load());
+			if (failed == 0)
+				ret = EXIT_SUCCESS;
+		}
+		catch (const std::exception &e)
+		{
+			tfm::printf("%s\n", e.what());
+		}
+		delete config;
+	}
+	server.Stop();
+
+	for (auto const &path : paths)
+		unlink(path.c_str());
+	unlink(certfile.c_str());
+	unlink(configfile.c_str());
+	rmdir(dir);
+	return ret;
+}
@@ -0,0 +1,74 @@
+# Copyright (c) 2017 Justin Crawford and NamedKitten
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy of
+# this software and associated documentation files (the "Software"), to deal in
+# the Software without restriction, including without limitation the rights to
+# use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+# of the Software, and to permit persons to whom the Software is furnished to do
+# so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included
+# in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+
+# Builds kittehuplodah with profile-guided and link-time optimization, run by
+# "make pgo" as
+#   cmake -DSOURCE_DIR=<source> -DBINARY_DIR=<build> -DTARGET=kittehuplodah
+#         [-DNO_CLANG=ON] [-DCOMPILER_ID=<id>] [-DLLVM_PROFDATA=<path>] -P PGO.cmake
+# The build in BINARY_DIR goes through three stages:
+#  1. configured with PGO_STAGE=generate, only the instrumented pgotrain is built,
+#  2. pgotrain is run to write the profile (merged with llvm-profdata for clang),
+#  3. reconfigured with PGO_STAGE=use, which rebuilds everything with the profile
+#     and LTO, and TARGET is built.
+# Both stages build in the same directory since GCC finds each object's profile
+# by the object's path.
+
+if (NOT SOURCE_DIR OR NOT BINARY_DIR OR NOT TARGET)
+	message(FATAL_ERROR "SOURCE_DIR, BINARY_DIR and TARGET must be set")
+endif (NOT SOURCE_DIR OR NOT BINARY_DIR OR NOT TARGET)
+
+# Run a command in the build directory, stopping if it fails.
+macro(Run)
+	execute_process(COMMAND ${ARGN} WORKING_DIRECTORY ${BINARY_DIR} RESULT_VARIABLE RESULT)
+	if (NOT RESULT EQUAL 0)
+		message(FATAL_ERROR "${ARGN} failed: ${RESULT}")
+	endif (NOT RESULT EQUAL 0)
+endmacro(Run)
+
+# Profiles of an earlier run would be added to, start over.
+set(PROFILE_DIR ${BINARY_DIR}/profile)
+file(REMOVE_RECURSE ${PROFILE_DIR})
+file(MAKE_DIRECTORY ${BINARY_DIR} ${PROFILE_DIR})
+
+set(CONFIGURE ${CMAKE_COMMAND} ${SOURCE_DIR} -DCMAKE_BUILD_TYPE=Release -DPGO_PROFILE=${PROFILE_DIR})
+if (NO_CLANG)
+	set(CONFIGURE ${CONFIGURE} -DNO_CLANG=ON)
+endif (NO_CLANG)
+
+message(STATUS "PGO: building the instrumented training workload")
+Run(${CONFIGURE} -DPGO_STAGE=generate)
+Run(${CMAKE_COMMAND} --build . --target pgotrain)
+
+message(STATUS "PGO: running the training workload")
+Run(${BINARY_DIR}/pgotrain)
+
+if (COMPILER_ID MATCHES "Clang")
+	if (NOT LLVM_PROFDATA)
+		message(FATAL_ERROR "llvm-profdata is needed to merge clang's profiles")
+	endif (NOT LLVM_PROFDATA)
+	file(GLOB PROFILES ${PROFILE_DIR}/*.profraw)
+	Run(${LLVM_PROFDATA} merge -output=${PROFILE_DIR}/merged.profdata ${PROFILES})
+endif (COMPILER_ID MATCHES "Clang")
+
+message(STATUS "PGO: building the optimized ${TARGET}")
+Run(${CONFIGURE} -DPGO_STAGE=use)
+Run(${CMAKE_COMMAND} --build . --target ${TARGET})
+
+message(STATUS "PGO: done, the optimized binary is ${BINARY_DIR}/${TARGET}")
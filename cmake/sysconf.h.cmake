@@ -27,6 +27,8 @@
 #cmakedefine HAVE_SELECT 1
 #cmakedefine CLANG_CXXABI 1
 #cmakedefine HAS_CXXABI_H 1
+#cmakedefine HAVE_LINUX_IO_URING_H 1
+#cmakedefine HAVE_COROUTINE 1
 
 #define VERSION_MAJOR        @PROJECT_MAJOR_VERSION@
 #define VERSION_MINOR        @PROJECT_MINOR_VERSION@
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <cstddef>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Class: Arena
+//
+// Arguments:
+//  blocksize - size of the blocks allocations are carved out of.
+//
+// Description:
+// A bump allocator for short lived objects that all die together, such
+// as everything belonging to a single upload (resolved addresses, URL
+// pieces, request headers and the response). Memory is only given back
+// when the arena is destroyed or reset, and standard sized blocks are
+// kept on a per-thread free list so a steady stream of uploads doesn't
+// touch the heap at all. Objects in an arena never have their
+// destructors called.
+class Arena
+{
+protected:
+	struct Block
+	{
+		Block *next;
+		size_t size;
+		size_t used;
+	};
+
+	Block *head;
+	size_t blocksize;
+
+	Block *NewBlock(size_t minsize);
+	void ReleaseBlock(Block *block);
+public:
+	static const size_t DefaultBlockSize = 16 * 1024;
+
+	Arena(size_t blocksize = DefaultBlockSize);
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+	~Arena();
+
+	void *Allocate(size_t len, size_t align = alignof(std::max_align_t));
+	void Deallocate(void *ptr, size_t len);
+	void Reset();
+
+	// Allocates a string copy with a terminating null.
+	char *Strdup(const char *str, size_t len);
+
+	// Constructs an object in the arena.
+	template<typename T, typename... Args> T *New(Args&&... args)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "Objects in an arena are never destructed");
+		return new (this->Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+};
+
+// Class: ArenaAllocator
+//
+// Arguments:
+//  arena - the arena to allocate from.
+//
+// Description:
+// Standard library allocator so containers can live in an Arena.
+template<typename T> class ArenaAllocator
+{
+public:
+	typedef T value_type;
+	Arena *arena;
+
+	ArenaAllocator(Arena &arena) noexcept : arena(&arena) { }
+	template<typename U> ArenaAllocator(const ArenaAllocator<U> &other) noexcept : arena(other.arena) { }
+
+	inline T *allocate(size_t n) { return static_cast<T*>(this->arena->Allocate(n * sizeof(T), alignof(T))); }
+	inline void deallocate(T *ptr, size_t n) noexcept { this->arena->Deallocate(ptr, n * sizeof(T)); }
+
+	template<typename U> inline bool operator==(const ArenaAllocator<U> &other) const noexcept { return this->arena == other.arena; }
+	template<typename U> inline bool operator!=(const ArenaAllocator<U> &other) const noexcept { return this->arena != other.arena; }
+};
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>> ArenaString;
+template<typename T> using ArenaVector = std::vector<T, ArenaAllocator<T>>;
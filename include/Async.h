@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include "sysconf.h"
+#ifdef HAVE_COROUTINE
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "Socket.h"
+#include "MemoryBudget.h"
+
+template<typename T> class Task;
+
+// Struct: TaskPromiseBase
+//
+// Description:
+// What every Task's promise has in common: the coroutine awaiting
+// it (resumed when it finishes) and the exception it threw.
+template<typename T> struct TaskPromiseBase
+{
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	struct FinalAwaiter
+	{
+		bool await_ready() noexcept { return false; }
+		template<typename P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			auto next = h.promise().continuation;
+			return next ? next : std::noop_coroutine();
+		}
+		void await_resume() noexcept { }
+	};
+
+	Task<T> get_return_object();
+	// Tasks only start once they're awaited (or spawned)
+	std::suspend_always initial_suspend() noexcept { return { }; }
+	FinalAwaiter final_suspend() noexcept { return { }; }
+	void unhandled_exception() { this->error = std::current_exception(); }
+};
+
+template<typename T> struct TaskPromise : TaskPromiseBase<T>
+{
+	std::optional<T> value;
+	void return_value(T value) { this->value = std::move(value); }
+};
+
+template<> struct TaskPromise<void> : TaskPromiseBase<void>
+{
+	void return_void() { }
+};
+
+// Class: Task
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// A coroutine returning a T. Awaiting a task runs it until it
+// finishes, resuming the awaiting coroutine with it's result or
+// rethrowing it's exception there.
+template<typename T> class Task
+{
+public:
+	typedef TaskPromise<T> promise_type;
+	typedef std::coroutine_handle<promise_type> handle_type;
+protected:
+	handle_type handle;
+public:
+	Task(handle_type handle) : handle(handle) { }
+	Task(Task &&other) : handle(std::exchange(other.handle, nullptr)) { }
+	Task(const Task &) = delete;
+	~Task()
+	{
+		if (this->handle)
+			this->handle.destroy();
+	}
+
+	bool await_ready() const { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+	{
+		this->handle.promise().continuation = awaiting;
+		return this->handle;
+	}
+	T await_resume()
+	{
+		if (this->handle.promise().error)
+			std::rethrow_exception(this->handle.promise().error);
+		if constexpr (!std::is_void<T>::value)
+			return std::move(*this->handle.promise().value);
+	}
+
+	// Gives up ownership of the coroutine (see EventLoop::Spawn)
+	handle_type Release() { return std::exchange(this->handle, nullptr); }
+};
+
+template<typename T> Task<T> TaskPromiseBase<T>::get_return_object()
+{
+	return Task<T>(Task<T>::handle_type::from_promise(static_cast<TaskPromise<T>&>(*this)));
+}
+
+// Class: EventLoop
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// A small single threaded scheduler for tasks. Tasks wait for their
+// sockets with co_await loop.Wait(fd, events) and the loop polls all
+// of them at once, resuming each task once it's socket is ready, so
+// any number of uploads run on one thread.
+class EventLoop
+{
+protected:
+	struct Waiter
+	{
+		int fd;
+		short events;
+		std::coroutine_handle<> handle;
+	};
+
+	struct MemoryWaiter
+	{
+		size_t bytes;
+		std::coroutine_handle<> handle;
+	};
+
+	// Spawned tasks, ready coroutines and those waiting
+	// for a socket or for room in the memory budget.
+	std::vector<Task<void>::handle_type> tasks;
+	std::deque<std::coroutine_handle<>> ready;
+	std::vector<Waiter> waiters;
+	std::vector<MemoryWaiter> memorywaiters;
+public:
+	struct WaitAwaiter
+	{
+		EventLoop &loop;
+		int fd;
+		short events;
+
+		bool await_ready() const { return false; }
+		void await_suspend(std::coroutine_handle<> handle) { this->loop.waiters.push_back(Waiter{ this->fd, this->events, handle }); }
+		void await_resume() const { }
+	};
+
+	struct MemoryAwaiter
+	{
+		EventLoop &loop;
+		size_t bytes;
+
+		bool await_ready() const { return memorybudget.TryAcquire(this->bytes); }
+		void await_suspend(std::coroutine_handle<> handle) { this->loop.memorywaiters.push_back(MemoryWaiter{ this->bytes, handle }); }
+		void await_resume() const { }
+	};
+
+	EventLoop() = default;
+	EventLoop(const EventLoop &) = delete;
+	~EventLoop();
+
+	void Spawn(Task<void> &&task);
+	void Run();
+
+	// Suspends the awaiting task until the fd has one of the poll() events.
+	inline WaitAwaiter Wait(int fd, short events) { return WaitAwaiter{ *this, fd, events }; }
+	// Suspends the awaiting task until the bytes are acquired from the memory
+	// budget, blocking in MemoryBudget::Acquire() would stop every task.
+	inline MemoryAwaiter AcquireMemory(size_t bytes) { return MemoryAwaiter{ *this, bytes }; }
+};
+
+// Class: AsyncSocket
+//
+// Arguments:
+//  loop    - event loop the socket's tasks run on.
+//  address - host to connect to.
+//  port    - port to connect to.
+//
+// Description:
+// A SecureConnectionSocket with a non-blocking socket whose operations
+// are tasks, waiting on the event loop whenever OpenSSL would block.
+class AsyncSocket : public SecureConnectionSocket
+{
+protected:
+	EventLoop &loop;
+
+	EventLoop::WaitAwaiter WaitFor(int ret);
+public:
+	AsyncSocket(EventLoop &loop, const std::string &address, const std::string &port);
+
+	Task<void> Connect();
+	Task<void> Write(const void *data, size_t len);
+	Task<size_t> Read(void *data, size_t len);
+};
+#endif
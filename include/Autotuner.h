@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// Class: Autotuner
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Adjusts how many uploads run at once and the size of the chunks
+// files are read and written to the connection in, instead of the fixed
+// jobs count and chunk size, by measuring goodput (bytes sent a second)
+// continuously. Every window it probes one of the two: additive
+// increase while it pays off (one more upload, or doubling the chunk),
+// multiplicative decrease when the last step made things worse or the
+// server said to slow down with a 429 or 503. The number of uploads
+// the server pushed back at is remembered so it isn't walked into
+// again. On a plateau it holds, and probes again every so often in
+// case the link got faster.
+class Autotuner
+{
+protected:
+	// Current settings, read by every upload.
+	std::atomic<int> limit;
+	std::atomic<size_t> chunksize;
+	int maxlimit;
+
+	// Uploads running, and whoever's waiting for one to finish.
+	int active;
+	std::mutex lock;
+	std::condition_variable cv;
+
+	// The tuning thread.
+	std::thread tuner;
+	std::condition_variable tunecv;
+	bool stopping;
+	std::atomic<bool> congested;
+
+	void Tune();
+public:
+	Autotuner();
+	~Autotuner();
+
+	void Start(int initial, int max);
+	void Stop();
+
+	void Acquire();
+	void Release();
+	inline void Congested() { this->congested = true; }
+
+	// Getters/setters.
+	inline int GetLimit() const { return this->limit.load(std::memory_order_relaxed); }
+	inline size_t GetChunkSize() const { return this->chunksize.load(std::memory_order_relaxed); }
+};
+
+extern Autotuner autotuner;
+
+// Class: AutotuneSlot
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Holds one of the autotuner's upload slots for as long as it's
+// in scope, when autotuning is on.
+class AutotuneSlot
+{
+	bool held;
+public:
+	AutotuneSlot(bool autotune) : held(autotune) { if (held) autotuner.Acquire(); }
+	AutotuneSlot(const AutotuneSlot &) = delete;
+	~AutotuneSlot() { if (held) autotuner.Release(); }
+};
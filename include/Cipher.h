@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <string>
+
+// Which AEAD is offered first when connecting.
+enum class CipherPreference
+{
+	AESGCM,
+	CHACHA20
+};
+
+// Struct: CPUFeatures
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// The instructions that decide how fast AES-GCM runs. aes is AES-NI
+// (or the ARMv8 AES instructions), pclmul is carry-less multiply
+// (PMULL on ARM) which GHASH needs, vaes is the AVX-512/AVX2 wide
+// version of both that OpenSSL uses on newer x86.
+struct CPUFeatures
+{
+	bool aes = false;
+	bool pclmul = false;
+	bool vaes = false;
+
+	CipherPreference Suggested() const;
+	std::string ToString() const;
+};
+
+// Struct: CipherBenchmark
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// How many MB/s each AEAD encrypted at in BenchmarkCiphers().
+struct CipherBenchmark
+{
+	double aesgcm;
+	double chacha20;
+
+	CipherPreference Fastest() const;
+};
+
+extern CPUFeatures DetectCPUFeatures();
+extern CipherBenchmark BenchmarkCiphers();
+extern CipherPreference PreferredCipher();
+extern const char *CipherName(CipherPreference pref);
+extern void SaveCipherPreference(CipherPreference pref);
@@ -24,4 +24,4 @@
 #include <string>
 #include <map>
 
-extern std::map<std::string, std::string> ProcessArgs(int argc, char **argv);
+extern std::map<std::string, std::string> ProcessArgs(int argc, char **argv, std::vector<std::string> &files);
@@ -21,6 +21,7 @@
  */
 #pragma once
 #include <string>
+#include "URL.h"
 
 // Class: Config
 //
@@ -34,12 +35,150 @@
 // class members to be access freely.
 class Config
 {
+	friend class Snapshot;
+
+	// Used by Snapshot to fill a config in without reading the file.
+	struct Unparsed { };
+	Config(const std::string &ConfigFile, Unparsed) : ConfigFile(ConfigFile) { }
+
+	void Validate();
 public:
 	Config(const std::string &ConfigFile);
+	// url points into our own strings.
+	Config(const Config &) = delete;
 	~Config();
 
 	const std::string ConfigFile;
 
 	std::string uploader;
 	std::string uploadurl;
+	// uploadurl parsed, this is a view of uploadurl.
+	URL url;
+	// Multipart form field the file is sent as.
+	std::string field;
+
+	// IO backend to use ("auto", "io_uring" or "blocking") and whether
+	// it should register it's buffers and files with the kernel.
+	std::string iobackend;
+	bool iofixed;
+
+	// Read the file ahead on a thread (-1 means only when the IO backend
+	// doesn't batch reads), open it with O_DIRECT, and drop sent chunks
+	// from the page cache.
+	int readahead;
+	bool directio;
+	bool dropcache;
+
+	// How long resolved addresses are cached for (in seconds)
+	long cachettl;
+
+	// How many files are uploaded at once, and the size (in bytes)
+	// under which files are packed together when scheduling them.
+	int jobs;
+	long smallfile;
+
+	// Whether the number of uploads at once and their chunk size are
+	// tuned as they go (see Autotuner.h), starting from jobs and going
+	// up to maxjobs at most.
+	bool autotune;
+	int maxjobs;
+
+	// Most bytes all the uploads' buffers can hold at once, 0 for no limit.
+	long maxmemory;
+
+	// Uploads smaller than this (in bytes) are sent again over a second
+	// connection when they take longer than most do, 0 turns that off.
+	// Read from the uploader's section.
+	long hedgesize;
+
+	// Where metrics are written for Prometheus (nowhere if empty)
+	// and how often, in seconds.
+	std::string metricsfile;
+	long metricsinterval;
+
+	// Whether uploads of the same contents running at once are
+	// coalesced into one (see SingleFlight.h).
+	bool coalesce;
+
+	// Which AEAD is offered first: "auto" (by the CPU's features),
+	// "aes", "chacha" or "bench" (measure it once and cache the result).
+	std::string cipher;
+
+	// Encrypt uploads before sending them: "none", "ctr" or "gcm" (AES-256).
+	// Read from the uploader's section.
+	std::string encrypt;
+
+	// Whether the server's certificate is checked, and the CA certificates
+	// (file and/or directory) it's checked against, the system's if empty.
+	// Read from the uploader's section.
+	bool verify;
+	std::string cafile;
+	std::string capath;
+
+	// What the uploader is: "form" (a multipart/form-data POST to the
+	// url) or "s3" (an S3 compatible object store at the url).
+	// Read from the uploader's section, as is everything below.
+	std::string type;
+
+	// The bucket, it's region and the credentials requests are signed
+	// with, what object names are prefixed with, and where objects can
+	// be seen from (links point at the store itself when empty).
+	std::string bucket;
+	std::string region;
+	std::string accesskey;
+	std::string secretkey;
+	std::string prefix;
+	std::string publicurl;
+
+	// Files bigger than this (in bytes) are uploaded in parts of this
+	// size, over at most this many connections at once.
+	long partsize;
+	int connections;
+
+	// Function: Fields
+	//
+	// Arguments:
+	//  f - called with the name and a reference of each value.
+	//
+	// Description:
+	// Lists every value read from the config file so they can be saved
+	// and restored without parsing it again (see Snapshot.cpp). Values
+	// added to the config must be added here too.
+	template<typename F> void Fields(F &&f)
+	{
+		f("uploader", this->uploader);
+		f("url", this->uploadurl);
+		f("field", this->field);
+		f("io", this->iobackend);
+		f("iofixed", this->iofixed);
+		f("readahead", this->readahead);
+		f("directio", this->directio);
+		f("dropcache", this->dropcache);
+		f("cachettl", this->cachettl);
+		f("jobs", this->jobs);
+		f("smallfile", this->smallfile);
+		f("autotune", this->autotune);
+		f("maxjobs", this->maxjobs);
+		f("maxmemory", this->maxmemory);
+		f("hedgesize", this->hedgesize);
+		f("metricsfile", this->metricsfile);
+		f("metricsinterval", this->metricsinterval);
+		f("coalesce", this->coalesce);
+		f("cipher", this->cipher);
+		f("encrypt", this->encrypt);
+		f("verify", this->verify);
+		f("cafile", this->cafile);
+		f("capath", this->capath);
+		f("type", this->type);
+		f("bucket", this->bucket);
+		f("region", this->region);
+		f("accesskey", this->accesskey);
+		f("secretkey", this->secretkey);
+		f("prefix", this->prefix);
+		f("publicurl", this->publicurl);
+		f("partsize", this->partsize);
+		f("connections", this->connections);
+	}
 };
+
+extern Config *config;
@@ -54,3 +54,17 @@ public:
 	template<typename... Args> SocketException(const std::string &message, const Args&... args) : BasicException(message, args...) { }
 
 };
+
+class IOException : public BasicException
+{
+public:
+	IOException(const std::string &err) : BasicException(err) { }
+	template<typename... Args> IOException(const std::string &message, const Args&... args) : BasicException(message, args...) { }
+};
+
+class UploadException : public BasicException
+{
+public:
+	UploadException(const std::string &err) : BasicException(err) { }
+	template<typename... Args> UploadException(const std::string &message, const Args&... args) : BasicException(message, args...) { }
+};
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <sys/types.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "IO.h"
+
+// Class: FileReader
+//
+// Arguments:
+//  fd     - file to read (not owned).
+//  size   - size of the file.
+//  io     - IO backend used when not reading ahead on a thread.
+//  shared - fd shares it's file flags with someone else's descriptor.
+//
+// Description:
+// Reads a file in chunks for uploading. Two buffers are used so the
+// next chunk is read while the current one is being encrypted and
+// sent, either by a readahead thread or by batching the read with the
+// send through the IO backend. The kernel is told we read sequentially
+// and chunks are dropped from the page cache once they're sent so
+// bulk uploads don't evict everything else on the host.
+class FileReader
+{
+protected:
+	struct Slot
+	{
+		char *data;
+		off_t offset;
+		ssize_t len;
+		bool filled;
+	};
+
+	int fd;
+	off_t size;
+	IOBackend *io;
+	bool threaded, dropcache, fixed;
+	size_t chunksize;
+
+	Slot slots[2];
+	// Slot last returned by Next(), -1 before the first call.
+	int cur;
+	// Offset of the chunk after the current one.
+	off_t nextoffset;
+
+	// Readahead thread state.
+	std::thread thread;
+	std::mutex mtx;
+	std::condition_variable cv;
+	bool stop;
+	int error;
+
+	void ReadAhead();
+	void FillSlot(int idx, off_t offset);
+	IORequest MakeRead(int idx, off_t offset);
+public:
+	FileReader() = delete;
+	FileReader(int fd, off_t size, IOBackend *io, bool shared = false);
+	~FileReader();
+
+	// Returns the next chunk of the file, false at the end of the file.
+	// It's the reader's buffer, which can be changed in place (eg. to
+	// encrypt it) until the chunk after it is asked for.
+	bool Next(char **data, size_t *len);
+	// Called once the chunk returned by Next() is sent.
+	void Done();
+
+	// Without a readahead thread the read of the next chunk can be batched
+	// with other requests, pass the completed request to Completed()
+	bool GetPendingRead(IORequest &req);
+	void Completed(const IORequest &req);
+};
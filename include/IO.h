@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+
+// Struct: IORequest
+//
+// Description:
+// A single read or send operation handed to an IOBackend. A batch of
+// these is submitted at once and each one has it's result filled in
+// when the batch completes.
+struct IORequest
+{
+	enum Type
+	{
+		READ, // pread() style read from a file at an offset.
+		SEND  // send() on a connected socket.
+	} type;
+
+	// File descriptor, or the index into the registered file table when
+	// fixedfile is set.
+	int fd;
+	bool fixedfile;
+	// Index into the registered buffer table, or -1 if buf was not registered.
+	int bufindex;
+
+	void *buf;
+	size_t len;
+	// Only used for reads.
+	off_t offset;
+
+	// Bytes transferred, or -errno on failure.
+	ssize_t result;
+
+	// Helpers to build requests.
+	static inline IORequest Read(int fd, void *buf, size_t len, off_t offset)
+	{
+		return IORequest{READ, fd, false, -1, buf, len, offset, 0};
+	}
+	static inline IORequest Send(int fd, const void *buf, size_t len)
+	{
+		return IORequest{SEND, fd, false, -1, const_cast<void*>(buf), len, 0, 0};
+	}
+};
+
+// Class: IOBackend
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Performs batches of file reads and socket sends. The blocking backend
+// issues one syscall per request while the io_uring backend submits an
+// entire batch with a single io_uring_enter() call. Use CreateIOBackend
+// to get one by name so the io_uring backend can fall back to the
+// blocking one on systems which don't support it.
+class IOBackend
+{
+public:
+	virtual ~IOBackend() { }
+
+	// Submits every request in the batch and waits for all of them to
+	// complete. Results are stored in each request's result member.
+	virtual void Submit(IORequest *reqs, size_t count) = 0;
+
+	// Buffers and files registered with the kernel (if the backend supports
+	// it) so they don't need to be looked up on every request. Registering
+	// pins memory, so it's done once for the life of the backend:
+	// GetFixedBuffers() returns the backend's registered buffers (IORequest
+	// bufindex is the index into them) and SetFixedFile() swaps the
+	// descriptor in one entry of the registered file table (IORequest fd is
+	// the index when fixedfile is set), -1 clears it. Both return false if
+	// the backend can't, in which case requests must use plain descriptors
+	// and buffers.
+	virtual bool GetFixedBuffers(char **bufs, size_t count, size_t len) { return false; }
+	virtual bool SetFixedFile(unsigned index, int fd) { return false; }
+
+	virtual const char *GetName() const = 0;
+
+	// Whether or not sends should be batched with reads through Submit()
+	// instead of being written directly to the socket.
+	virtual bool BatchesSends() const { return false; }
+};
+
+// Class: BlockingIO
+//
+// Description:
+// The plain pread()/send() backend available everywhere.
+class BlockingIO : public IOBackend
+{
+public:
+	void Submit(IORequest *reqs, size_t count) override;
+	const char *GetName() const override { return "blocking"; }
+};
+
+extern IOBackend *CreateIOBackend(const std::string &name);
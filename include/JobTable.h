@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "Arena.h"
+
+// Class: JobTable
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// The files waiting to be uploaded, stored as a struct of arrays so
+// millions of jobs stay compact. Paths are interned in an arena: each
+// distinct path is stored once (with a terminating null so it can be
+// handed to open() directly) and adding it again returns the existing
+// job. Clear() keeps the memory around for the next batch of jobs.
+class JobTable
+{
+public:
+	enum State : uint8_t
+	{
+		PENDING,
+		DONE,
+		FAILED
+	};
+protected:
+	Arena arena;
+
+	// One entry per job in each column.
+	std::vector<const char*> paths;
+	std::vector<uint32_t> lengths;
+	std::vector<uint32_t> hashes;
+	std::vector<State> states;
+
+	// Open addressing table of job index + 1 (0 is empty) keyed by path hash.
+	std::vector<uint32_t> buckets;
+
+	void Rehash(size_t count);
+public:
+	size_t Add(const char *path, size_t len);
+	void Clear();
+
+	inline size_t Size() const { return this->paths.size(); }
+	inline bool Empty() const { return this->paths.empty(); }
+
+	// Getters/setters.
+	inline const char *GetPath(size_t job) const { return this->paths[job]; }
+	inline size_t GetPathLength(size_t job) const { return this->lengths[job]; }
+	inline State GetState(size_t job) const { return this->states[job]; }
+	inline void SetState(size_t job, State state) { this->states[job] = state; }
+};
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <cstdint>
+#include <condition_variable>
+#include <mutex>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Class: Journal
+//
+// Arguments:
+//  file - where the journal is kept, made if it doesn't exist.
+//
+// Description:
+// A write-ahead log of the files queued for upload and the ones that
+// were acknowledged (uploaded, with their links), so a batch killed
+// half way through can be resumed without uploading everything again.
+// Records are appended to a buffer and made durable with group commit:
+// whoever commits first writes and fsyncs everything appended so far
+// while the others wait for it, so many uploads finishing at once cost
+// one fsync instead of one each.
+class Journal
+{
+	// Lets paths be looked up by view without copying them into a string.
+	struct PathHash
+	{
+		using is_transparent = void;
+		size_t operator()(std::string_view path) const { return std::hash<std::string_view>()(path); }
+	};
+public:
+	enum Type : uint8_t
+	{
+		QUEUED = 1,
+		DONE = 2
+	};
+protected:
+	std::string file;
+	int fd;
+
+	std::mutex lock;
+	std::condition_variable cv;
+	// Records appended but not written yet.
+	std::vector<char> pending;
+	// Records appended and made durable so far, and whether
+	// someone is writing them out.
+	uint64_t appended, durable;
+	bool syncing;
+	// Set once writing the journal failed, nothing is written after that.
+	int error;
+
+	// Links of the acknowledged files, and the queued files that
+	// weren't acknowledged in the order they were queued.
+	std::unordered_map<std::string, std::string, PathHash, std::equal_to<>> done;
+	std::vector<std::string> queued;
+
+	void Replay();
+public:
+	Journal() = delete;
+	Journal(const std::string &file);
+	Journal(const Journal &) = delete;
+	~Journal();
+
+	uint64_t Append(Type type, std::string_view path, std::string_view link = std::string_view());
+	void Commit(uint64_t record);
+	const std::string *Acknowledged(std::string_view path) const;
+	std::vector<std::string> Unfinished() const;
+};
+
+// The journal uploads are recorded in, null if there isn't one.
+extern Journal *journal;
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <sys/types.h>
+#include <exception>
+#include <functional>
+#include <future>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Config.h"
+
+class IOBackend;
+class SecureConnectionSocket;
+
+// Struct: UploadSource
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Something to upload: a file by path, an open file descriptor
+// (which the caller keeps owning) or a buffer in memory. The name is
+// a view, so like the buffer it must stay valid until it's upload
+// finishes, and a path has to be null terminated as it's handed to
+// open() directly (paths in a JobTable are both). Files given by
+// path are uploaded under their base name.
+struct UploadSource
+{
+	enum Type
+	{
+		PATH,
+		FD,
+		BUFFER
+	};
+
+	Type type;
+	// The path for PATH sources, the name to upload as for the others.
+	std::string_view name;
+	int fd;
+	const void *data;
+	size_t len;
+
+	static UploadSource FromPath(std::string_view path) { return UploadSource{ PATH, path, -1, nullptr, 0 }; }
+	static UploadSource FromFD(int fd, std::string_view name) { return UploadSource{ FD, name, fd, nullptr, 0 }; }
+	static UploadSource FromBuffer(const void *data, size_t len, std::string_view name) { return UploadSource{ BUFFER, name, -1, data, len }; }
+};
+
+// Called once for every source with it's index, the link it was
+// uploaded to and, if it failed, the exception describing why.
+typedef std::function<void(size_t index, const std::string &link, std::exception_ptr error)> UploadCallback;
+
+extern void InitUploader(Config *conf);
+extern void ShutdownUploader();
+extern int GetWorkerCount();
+extern std::string UploadOne(IOBackend *io, SecureConnectionSocket *&conn, const UploadSource &source, std::exception_ptr &error);
+extern void UploadMany(const std::vector<UploadSource> &sources, const UploadCallback &callback);
+extern std::vector<std::future<std::string>> UploadMany(const std::vector<UploadSource> &sources);
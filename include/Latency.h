@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <cstddef>
+#include <mutex>
+
+// Class: LatencyTracker
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Keeps the most recent latencies (in microseconds) of something in a
+// ring so percentiles of them follow the network as it changes. Safe
+// to use from any number of threads.
+class LatencyTracker
+{
+public:
+	// How many of the most recent samples are kept, and how many
+	// there have to be before percentiles are worth anything.
+	static const size_t Window = 256;
+	static const size_t MinSamples = 20;
+protected:
+	std::mutex lock;
+	long samples[Window];
+	size_t count, next;
+public:
+	LatencyTracker();
+
+	void Add(long usec);
+	long Percentile(int percent);
+};
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Class: MPMCQueue
+//
+// Arguments:
+//  capacity - most items it holds, rounded up to a power of two.
+//
+// Description:
+// A bounded queue any number of threads can push to and pop from at
+// once without a lock (Dmitry Vyukov's ring): every slot has a sequence
+// number saying whether it's waiting to be filled or emptied on this
+// lap of the ring, so producers and consumers each only contend on
+// their own end's position. Consumers can take a run of items with a
+// single compare and swap. Only waiting on a full or empty queue takes
+// a lock, and then only once spinning didn't help.
+template<typename T> class MPMCQueue
+{
+	// Struct: Slot
+	//
+	// Description:
+	// An item and it's sequence, on it's own cache line so neighbouring
+	// slots being filled and emptied don't bounce each other.
+	struct alignas(64) Slot
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<Slot[]> slots;
+	size_t mask;
+	// Next position to pop and to push, on lines of their own.
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+
+	// Only used by threads that have to wait.
+	alignas(64) std::mutex lock;
+	std::condition_variable notempty, notfull;
+	std::atomic<size_t> consumers, producers;
+	std::atomic<bool> closed;
+
+	// How many times a full or empty queue is retried before sleeping.
+	static const int Spins = 64;
+
+	// Function: Wake
+	//
+	// Arguments:
+	//  waiting - how many are waiting on cv.
+	//  cv      - who to wake.
+	//
+	// Description:
+	// Wakes whoever waits on the other end, if anyone does. Taking the
+	// lock means they've either not checked the queue yet or are asleep.
+	void Wake(std::atomic<size_t> &waiting, std::condition_variable &cv)
+	{
+		// Orders the push or pop before the load, or we could miss a
+		// waiter that checked the queue just before it.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting.load() == 0)
+			return;
+		std::lock_guard<std::mutex> guard(this->lock);
+		cv.notify_all();
+	}
+public:
+	MPMCQueue() = delete;
+	MPMCQueue(const MPMCQueue &) = delete;
+
+	MPMCQueue(size_t capacity) : head(0), tail(0), consumers(0), producers(0), closed(false)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		this->slots.reset(new Slot[size]);
+		this->mask = size - 1;
+		for (size_t i = 0; i < size; ++i)
+			this->slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	// Function: TryPush
+	//
+	// Arguments:
+	//  value - the item, moved from if it's pushed.
+	//
+	// Description:
+	// Pushes an item, returns false if the queue's full.
+	bool TryPush(T &value)
+	{
+		size_t pos = this->tail.load(std::memory_order_relaxed);
+		Slot *slot;
+		for (;;)
+		{
+			slot = &this->slots[pos & this->mask];
+			intptr_t diff = intptr_t(slot->sequence.load(std::memory_order_acquire)) - intptr_t(pos);
+			if (diff == 0)
+			{
+				if (this->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			// It hasn't been emptied since the last lap.
+			else if (diff < 0)
+				return false;
+			else
+				pos = this->tail.load(std::memory_order_relaxed);
+		}
+
+		slot->value = std::move(value);
+		slot->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Function: TryPop
+	//
+	// Arguments:
+	//  out - where the items go.
+	//  max - most items to take.
+	//
+	// Description:
+	// Takes up to max items that are ready in one go, returns how
+	// many it took (0 if the queue's empty).
+	size_t TryPop(T *out, size_t max)
+	{
+		size_t pos = this->head.load(std::memory_order_relaxed), count;
+		for (;;)
+		{
+			// Count the filled slots from the head.
+			for (count = 0; count < max; ++count)
+			{
+				if (this->slots[(pos + count) & this->mask].sequence.load(std::memory_order_acquire) != pos + count + 1)
+					break;
+			}
+
+			if (count == 0)
+			{
+				intptr_t diff = intptr_t(this->slots[pos & this->mask].sequence.load(std::memory_order_acquire)) - intptr_t(pos + 1);
+				// Not filled yet.
+				if (diff < 0)
+					return 0;
+				// Someone else took it.
+				pos = this->head.load(std::memory_order_relaxed);
+				continue;
+			}
+
+			if (this->head.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+				break;
+		}
+
+		// The slots are ours now, hand each back for the next lap.
+		for (size_t i = 0; i < count; ++i)
+		{
+			Slot &slot = this->slots[(pos + i) & this->mask];
+			out[i] = std::move(slot.value);
+			slot.sequence.store(pos + i + this->mask + 1, std::memory_order_release);
+		}
+		return count;
+	}
+
+	// Function: Push
+	//
+	// Arguments:
+	//  value - the item.
+	//
+	// Description:
+	// Pushes an item, waiting while the queue's full. Returns
+	// false (without pushing it) if the queue was closed.
+	bool Push(T value)
+	{
+		for (int spin = 0; !this->closed.load(); ++spin)
+		{
+			if (this->TryPush(value))
+			{
+				this->Wake(this->consumers, this->notempty);
+				return true;
+			}
+			if (spin < Spins)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> guard(this->lock);
+			this->producers++;
+			// Tried again now that consumers know to wake us.
+			bool pushed = !this->closed.load() && this->TryPush(value);
+			if (!pushed && !this->closed.load())
+				this->notfull.wait(guard);
+			this->producers--;
+			if (pushed)
+			{
+				guard.unlock();
+				this->Wake(this->consumers, this->notempty);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Function: Pop
+	//
+	// Arguments:
+	//  out - where the items go.
+	//  max - most items to take.
+	//
+	// Description:
+	// Takes up to max items, waiting until there are any. Returns 0
+	// once the queue's been closed and everything in it taken.
+	size_t Pop(T *out, size_t max)
+	{
+		for (int spin = 0; ; ++spin)
+		{
+			size_t count = this->TryPop(out, max);
+			if (count)
+			{
+				this->Wake(this->producers, this->notfull);
+				return count;
+			}
+			if (this->closed.load())
+				return 0;
+			if (spin < Spins)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> guard(this->lock);
+			this->consumers++;
+			count = this->TryPop(out, max);
+			if (!count && !this->closed.load())
+				this->notempty.wait(guard);
+			this->consumers--;
+			if (count)
+			{
+				guard.unlock();
+				this->Wake(this->producers, this->notfull);
+				return count;
+			}
+		}
+	}
+
+	// Function: Size
+	//
+	// Arguments:
+	//  <None>
+	//
+	// Description:
+	// Roughly how many items are queued, it can be out
+	// of date by the time it's returned.
+	size_t Size() const
+	{
+		size_t tail = this->tail.load(std::memory_order_relaxed), head = this->head.load(std::memory_order_relaxed);
+		return tail > head ? tail - head : 0;
+	}
+
+	// Function: Close
+	//
+	// Arguments:
+	//  <None>
+	//
+	// Description:
+	// Stops any more items from being pushed and wakes everyone up,
+	// what's already queued can still be popped.
+	void Close()
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->closed = true;
+		this->notempty.notify_all();
+		this->notfull.notify_all();
+	}
+};
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include "JobTable.h"
+
+// Class: Manifest
+//
+// Arguments:
+//  file - manifest to read, "-" for standard input.
+//
+// Description:
+// Streams the list of files to upload from a manifest with one path
+// per line, or separated by null bytes (as made by find -print0) if
+// there are any in it. Only a block of the manifest is in memory at
+// a time so it can list any number of files.
+class Manifest
+{
+protected:
+	std::string file;
+	int fd;
+	std::vector<char> buffer;
+	// Unparsed data in the buffer.
+	size_t start, end;
+	bool eof;
+	// Separator, only meaningful once detected is set ('\0' is
+	// a separator too, for find -print0).
+	char separator;
+	bool detected;
+
+	bool ReadMore();
+public:
+	Manifest() = delete;
+	Manifest(const std::string &file);
+	~Manifest();
+
+	bool Fill(JobTable &jobs, size_t max);
+};
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <cstddef>
+#include <condition_variable>
+#include <mutex>
+
+// Class: MemoryBudget
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// A process wide limit on the bytes held in upload buffers. Every
+// pipeline buffer is acquired from the budget before it's allocated
+// and released after it's freed; once the budget is spent whoever
+// wants more blocks until someone else releases theirs, so adding
+// jobs slows uploads down instead of growing the process.
+class MemoryBudget
+{
+protected:
+	std::mutex lock;
+	std::condition_variable cv;
+	// 0 means there's no limit.
+	size_t limit;
+	size_t used;
+public:
+	MemoryBudget();
+
+	void SetLimit(size_t limit);
+	void Acquire(size_t bytes);
+	bool TryAcquire(size_t bytes);
+	void Release(size_t bytes);
+
+	// Getters/setters.
+	inline size_t GetLimit() const { return this->limit; }
+};
+
+extern MemoryBudget memorybudget;
+
+// Class: MemoryReservation
+//
+// Arguments:
+//  bytes - how much of the budget was acquired.
+//
+// Description:
+// Releases bytes acquired from the memory budget when it goes out of scope.
+class MemoryReservation
+{
+	size_t bytes;
+public:
+	MemoryReservation(size_t bytes) : bytes(bytes) { }
+	MemoryReservation(const MemoryReservation &) = delete;
+	~MemoryReservation() { memorybudget.Release(this->bytes); }
+};
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Class: Histogram
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// A high dynamic range histogram of microseconds: values under 128 get
+// a bucket each and every power of two above that is split into 64, so
+// anything from a microsecond to a day and a half is kept to within 1.6%
+// in a fixed 16 KiB. Recording is a couple of relaxed atomic adds.
+class Histogram
+{
+public:
+	static const int SubBits = 7;
+	static const size_t SubBuckets = size_t(1) << SubBits;
+	static const size_t HalfBuckets = SubBuckets / 2;
+	static const size_t Buckets = SubBuckets + HalfBuckets * 30;
+protected:
+	std::atomic<uint64_t> counts[Buckets];
+	std::atomic<uint64_t> count, sum;
+
+	static size_t BucketIndex(uint64_t usec);
+	static uint64_t BucketEnd(size_t index);
+public:
+	Histogram();
+
+	void Record(uint64_t usec);
+	uint64_t CountBelow(uint64_t usec) const;
+	uint64_t Percentile(double percent) const;
+
+	// Getters/setters.
+	inline uint64_t GetCount() const { return this->count.load(std::memory_order_relaxed); }
+	inline uint64_t GetSum() const { return this->sum.load(std::memory_order_relaxed); }
+};
+
+// Class: Metrics
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Counters and latency histograms of everything the uploader does,
+// written out in Prometheus' text format for node_exporter's textfile
+// collector. The file is replaced atomically every metricsinterval
+// seconds and once more when the uploader shuts down.
+class Metrics
+{
+public:
+	// What uploads failed with, by exception class.
+	enum Failure
+	{
+		SOCKET,
+		IO,
+		UPLOAD,
+		CONFIG,
+		OTHER,
+		FAILURES
+	};
+
+	std::atomic<uint64_t> bytessent;
+	std::atomic<uint64_t> uploads;
+	std::atomic<uint64_t> failures[FAILURES];
+	std::atomic<uint64_t> fullhandshakes;
+	std::atomic<uint64_t> resumedhandshakes;
+	std::atomic<uint64_t> retries;
+	std::atomic<uint64_t> hedges;
+	std::atomic<uint64_t> coalesced;
+
+	// TLS handshakes, from the request being sent to the first byte of
+	// the response, and whole uploads including connecting.
+	Histogram handshake;
+	Histogram ttfb;
+	Histogram total;
+protected:
+	std::string file;
+	std::chrono::seconds interval;
+	std::thread writer;
+	std::mutex lock;
+	std::condition_variable cv;
+	bool stopping;
+public:
+	Metrics();
+	~Metrics();
+
+	void CountFailure(std::exception_ptr error);
+	void CountHandshake(std::chrono::steady_clock::time_point start, bool resumed);
+
+	std::string Format();
+	void Write();
+	void Start(const std::string &file, long interval);
+	void Stop();
+};
+
+extern Metrics metrics;
+
+// Function: SinceMicroseconds
+//
+// Arguments:
+//  start - when what's being timed started.
+//
+// Description:
+// Returns how many microseconds have passed since start.
+inline uint64_t SinceMicroseconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <functional>
+#include <string>
+#include <vector>
+#include "Upload.h"
+
+// Struct: S3Signing
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// What a request is signed with: the moment it's signed for, the
+// credential scope and the key derived for that day. S3 refuses
+// requests signed more than 15 minutes before they arrive, so each
+// request gets it's own when it's made rather than the upload having
+// one for all of them.
+struct S3Signing
+{
+	std::string amzdate, scope;
+	unsigned char key[32];
+
+	S3Signing();
+};
+
+// Class: S3Upload
+//
+// Arguments:
+//  source - what to upload.
+//
+// Description:
+// Uploads to an S3 compatible object store (an uploader section with
+// type=s3) instead of posting a form. Files bigger than a part are
+// uploaded with a multipart upload whose parts go up at the same time
+// over several connections. Every request is signed with AWS Signature
+// Version 4, bodies are streamed with each chunk signed as it's sent
+// so nothing has to be hashed up front.
+class S3Upload : public Upload
+{
+protected:
+	// Path of the object (with the bucket) as it goes in requests.
+	std::string path;
+
+	std::string Sign(const S3Signing &signing, const char *method, const std::string &query,
+		std::vector<std::pair<std::string, std::string>> &headers, const std::string &payloadhash);
+	void Exchange(SecureConnectionSocket *&conn, IOBackend *io, const std::function<void(SecureConnectionSocket&)> &send,
+		ArenaString &response);
+	std::string Request(SecureConnectionSocket *&conn, IOBackend *io, const char *method, const std::string &query,
+		const std::string &body);
+	std::string PutObject(SecureConnectionSocket *&conn, IOBackend *io, const std::string &query, off_t offset, off_t len);
+	void SendChunked(SecureConnectionSocket &sock, const S3Signing &signing, const std::string &seed, off_t offset, off_t len);
+	std::string RunMultipart(IOBackend *io, SecureConnectionSocket *&conn);
+public:
+	S3Upload(const UploadSource &source);
+
+	std::string Run(IOBackend *io, SecureConnectionSocket *&conn);
+};
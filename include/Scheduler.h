@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <sys/types.h>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Class: Scheduler
+//
+// Arguments:
+//  sizes - size of each job's file, -1 if it isn't known.
+//
+// Description:
+// Works out the order a batch of jobs is uploaded in so the whole batch
+// finishes as early as possible. With every file's size known up front
+// the largest files are handed out first (so the batch doesn't end with
+// one worker stuck on a huge file) and small files are packed together
+// into units of roughly the same cost as a large one, which a worker
+// sends back to back over it's already warm connection. Workers call
+// Next() concurrently to take the next unit of work.
+class Scheduler
+{
+protected:
+	const std::vector<off_t> &sizes;
+
+	// Job indexes in the order they're handed out, the i'th unit
+	// of work is order[units[i]] up to order[units[i + 1]].
+	std::vector<uint32_t> order;
+	std::vector<uint32_t> units;
+	std::atomic<size_t> next;
+
+	off_t GetCost(size_t job) const;
+public:
+	Scheduler(const std::vector<off_t> &sizes);
+
+	void Plan();
+	bool Next(const uint32_t **begin, const uint32_t **end);
+};
@@ -19,35 +19,32 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#pragma once
+#include <functional>
+#include <future>
+#include <mutex>
 #include <string>
-#include <map>
+#include <unordered_map>
+#include "Kittehuplodah.h"
 
-// Function: DecodeURL
+// Class: SingleFlight
 //
 // Arguments:
-//  url - A standard protocol url.
+//  N/A
 //
 // Description:
-// takes in a URL (eg. https://api.teknik.io/v1/Upload) and
-// converts it into an associative map that is easier to use
-// in code elsewhere.
-std::map<std::string, std::string> DecodeURL(const std::string &url)
+// Coalesces identical uploads running at the same time: the first one
+// for a key does the upload and everyone who asks for the same key
+// while it's in flight waits for it and gets the same link (or the
+// same error). Once it's finished the key is forgotten, so this only
+// saves the work of uploads that overlap, it isn't a cache.
+class SingleFlight
 {
-	std::map<std::string, std::string> parts;
+protected:
+	std::mutex lock;
+	std::unordered_map<std::string, std::shared_future<std::string>> flights;
+public:
+	std::string Do(const std::string &key, const std::function<std::string()> &fn, bool *shared = nullptr);
+};
 
-	// First, find the :// part of the URL (eg http://)
-	size_t protppos = url.find("://");
-	if (protppos == std::string::npos)
-		return parts;
-	// Next find the next slash after ://.
-	size_t hostpos  = url.substr(protppos+3).find("/");
-	if (protppos == std::string::npos)
-		return parts;
-
-
-	parts["protocol"] = url.substr(0, protppos);
-	parts["hostname"] = url.substr(protppos+3, hostpos);
-	parts["path"]     = url.substr(hostpos+1);
-
-	return parts;
-}
+extern std::string ContentKey(const UploadSource &source);
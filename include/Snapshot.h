@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include "Config.h"
+
+// Class: Snapshot
+//
+// Arguments:
+//  file       - location of the snapshot.
+//  configfile - config file the snapshot is for.
+//
+// Description:
+// A compact binary cache of everything the application works out on
+// startup: the validated config values, the uploader's resolved
+// addresses and the last TLS session with it. The snapshot is mapped
+// into memory and used instead of parsing the config and resolving the
+// uploader as long as the config file hasn't been modified and the
+// addresses haven't outlived the config's cachettl. Scripts that run
+// the application thousands of times then spend their time uploading
+// instead of starting up.
+class Snapshot
+{
+protected:
+	std::string file, configfile;
+	const char *data;
+	size_t size;
+
+	// Whether the snapshot was made from the current config file,
+	// and whether the addresses in it are still good.
+	bool current, unexpired;
+
+	// Serialized config values for Save(), see Record()
+	std::vector<char> fields;
+	std::string host, port;
+
+	bool Check();
+public:
+	Snapshot() = delete;
+	Snapshot(const std::string &file, const std::string &configfile);
+	~Snapshot();
+
+	Config *LoadConfig();
+	void Record(Config *conf);
+	void Prime();
+	void Save();
+};
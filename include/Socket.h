@@ -26,9 +26,13 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
+#include <ctime>
 #include <vector>
 #include <string>
+#include "IO.h"
+#include "Arena.h"
 
 typedef union {
 	struct sockaddr_in ipv4;
@@ -36,6 +40,16 @@ typedef union {
 	struct sockaddr sa;
 } sockaddr_t;
 
+extern socklen_t GetSockLen(const sockaddr_t &s);
+extern ArenaVector<sockaddr_t> ResolveDNS(Arena &arena, const std::string &address, const std::string &port);
+extern std::string GetSSLErrors();
+
+// Process wide caches of resolved addresses and TLS sessions (see Socket.cpp)
+extern void CacheAddresses(const std::string &host, const std::string &port, const sockaddr_t *addrs, size_t count, time_t expires);
+extern bool GetCachedAddresses(const std::string &host, const std::string &port, ArenaVector<sockaddr_t> &addrs, time_t *expires = nullptr);
+extern void CacheSession(const std::string &host, const std::string &port, SSL_SESSION *session);
+extern SSL_SESSION *GetCachedSession(const std::string &host, const std::string &port);
+
 class SecureConnectionSocket
 {
 protected:
@@ -45,24 +59,52 @@ protected:
 	std::string address;
 	// Port we're using.
 	std::string port;
-	// OpenSSL contexts
+	// Which of the resolved addresses we connected to.
+	size_t addrindex;
+	// Number of the connection in this process, for traces.
+	uint64_t id;
+	// Where temporary allocations go, if we were given one.
+	Arena *arena;
+	// OpenSSL contexts, the SSL_CTX is shared (see TLS.cpp)
 	SSL_CTX *ctx;
 	SSL *ssl;
+	// IO backend used to send ciphertext when it batches sends, in which
+	// case OpenSSL writes into a memory BIO instead of the socket.
+	IOBackend *io;
+	BIO *wbio;
+	// Ciphertext waiting to be sent through the IO backend.
+	std::vector<unsigned char> pending;
+
+	void DrainWriteBIO();
+	void StartTLS();
+	std::string GetTLSError();
 public:
 	// Constructors/destructors
 	SecureConnectionSocket() = delete; // We delete this constructor to prevent opject copies.
-	SecureConnectionSocket(const std::string &address, const std::string &port);
+	SecureConnectionSocket(const std::string &address, const std::string &port, Arena *arena = nullptr);
 	~SecureConnectionSocket();
 
 	// Control functions.
-	void Connect();
+	void Connect(size_t first = 0);
+	bool Readable(bool *closed = nullptr);
+
+	void SetIOBackend(IOBackend *io);
 
 	// Read and write functions.
 	size_t Write(const void *data, size_t len);
 	void Read(void *data, size_t *len);
 
+	// Batched send support, see Socket.cpp
+	bool GetPendingSend(IORequest &req);
+	void Sent(const IORequest &req);
+	void Flush();
+
 	// Getters/setters.
-	inline std::string GetAddress() const { return this->address; }
-	inline std::string GetPort() const { return this->port; }
+	inline const std::string &GetAddress() const { return this->address; }
+	inline const std::string &GetPort() const { return this->port; }
 	inline int GetFD() const { return this->fd; }
+	inline size_t GetAddressIndex() const { return this->addrindex; }
+	inline uint64_t GetID() const { return this->id; }
 };
+
+extern int WaitReadable(SecureConnectionSocket *const *socks, size_t count, int timeout, bool *closed = nullptr);
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Class: ThreadPool
+//
+// Arguments:
+//  size - how many worker threads to start.
+//
+// Description:
+// The executor CPU bound work (encrypting, hashing, ...) is split up
+// on, shared by every upload so stages don't each start threads of
+// their own. Every worker has it's own deque: tasks a worker submits
+// go on the back of it's own and it takes from the back (the freshest
+// and most likely in cache) while idle workers steal from the front
+// of the others'. Threads waiting on a ParallelFor() run tasks too, so
+// a pool with no workers at all just runs everything inline.
+class ThreadPool
+{
+	// Struct: Worker
+	//
+	// Description:
+	// A worker's tasks, locked only for as long as it takes to push or
+	// pop one so the owner and thieves rarely meet.
+	struct Worker
+	{
+		std::mutex lock;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+	// Where tasks submitted from outside the pool go next.
+	std::atomic<size_t> next;
+
+	// Idle workers sleep until there's something queued.
+	std::mutex sleeplock;
+	std::condition_variable sleepcv;
+	std::atomic<size_t> queued;
+	bool stopping;
+
+	bool RunOne();
+	void RunWorker(size_t index);
+public:
+	ThreadPool() = delete;
+	ThreadPool(size_t size);
+	ThreadPool(const ThreadPool &) = delete;
+	~ThreadPool();
+
+	void Submit(std::function<void()> task);
+	void ParallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+	// Getters/setters.
+	inline size_t GetSize() const { return this->threads.size(); }
+};
+
+extern size_t CPUQuota();
+extern ThreadPool &GetThreadPool();
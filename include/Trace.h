@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Whether spans are being recorded, set by StartTrace().
+extern std::atomic<bool> tracing;
+
+extern void StartTrace(const std::string &file);
+extern void WriteTrace();
+extern void RecordSpan(const char *name, std::chrono::steady_clock::time_point start, int64_t conn, int64_t bytes);
+
+// Class: TraceSpan
+//
+// Arguments:
+//  name  - what's being done, must be a string literal.
+//  conn  - the connection it's done on, -1 for none.
+//  bytes - how many bytes it's done to, -1 for none.
+//
+// Description:
+// Records how long the scope it's in took when tracing (see Trace.cpp),
+// and costs no more than checking the tracing flag when not.
+class TraceSpan
+{
+	const char *name;
+	std::chrono::steady_clock::time_point start;
+	int64_t conn, bytes;
+	bool on;
+public:
+	TraceSpan(const char *name, int64_t conn = -1, int64_t bytes = -1) : name(name), conn(conn), bytes(bytes),
+		on(tracing.load(std::memory_order_relaxed))
+	{
+		if (this->on)
+			this->start = std::chrono::steady_clock::now();
+	}
+	TraceSpan(const TraceSpan &) = delete;
+	~TraceSpan()
+	{
+		if (this->on)
+			RecordSpan(this->name, this->start, this->conn, this->bytes);
+	}
+
+	// Getters/setters.
+	inline int64_t GetConnection() const { return this->conn; }
+	inline void SetConnection(int64_t conn) { this->conn = conn; }
+	inline void SetBytes(int64_t bytes) { this->bytes = bytes; }
+};
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <string_view>
+
+// Struct: URL
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// A URL split into it's RFC 3986 components (see URL::Parse). Every
+// member is a view into the string that was parsed so parsing never
+// allocates, but the string has to outlive the URL. It's all constexpr
+// so constant URLs can be parsed at compile time, eg.
+//  constexpr URL teknik = URL::Parse("https://api.teknik.io/v1/Upload");
+struct URL
+{
+	std::string_view scheme;
+	std::string_view userinfo;
+	// Host without the brackets of an IPv6 literal.
+	std::string_view host;
+	std::string_view port;
+	// Path including the leading slash, may be empty.
+	std::string_view path;
+	std::string_view query;
+	std::string_view fragment;
+
+	// Host and port as they appear in the URL, for the Host header.
+	std::string_view authority;
+	// Path and query, for the request line.
+	std::string_view target;
+
+	bool ipv6 = false;
+	bool valid = false;
+
+	// Function: IsScheme
+	//
+	// Arguments:
+	//  name - lower case scheme name.
+	//
+	// Description:
+	// Case insensitive comparison of the URL's scheme.
+	constexpr bool IsScheme(std::string_view name) const
+	{
+		if (this->scheme.size() != name.size())
+			return false;
+		for (size_t i = 0; i < name.size(); ++i)
+		{
+			char c = this->scheme[i];
+			if (c >= 'A' && c <= 'Z')
+				c += 'a' - 'A';
+			if (c != name[i])
+				return false;
+		}
+		return true;
+	}
+
+	// Function: GetPort
+	//
+	// Arguments:
+	//  <None>
+	//
+	// Description:
+	// Returns the port from the URL, or the default port
+	// for http and https if it didn't have one.
+	constexpr std::string_view GetPort() const
+	{
+		if (!this->port.empty())
+			return this->port;
+		if (this->IsScheme("https"))
+			return "443";
+		if (this->IsScheme("http"))
+			return "80";
+		return "";
+	}
+
+	// Function: Parse
+	//
+	// Arguments:
+	//  url - the URL to parse (eg. https://user@[::1]:8443/v1/Upload?a=b#top)
+	//
+	// Description:
+	// Splits the URL up in a single pass. Only URLs with an authority
+	// (scheme://host) are accepted, anything else has valid set to false.
+	static constexpr URL Parse(std::string_view url)
+	{
+		URL u;
+		size_t i = 0, len = url.size();
+
+		// scheme = ALPHA *( ALPHA / DIGIT / "+" / "-" / "." )
+		for (; i < len; ++i)
+		{
+			char c = url[i];
+			bool alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+			if (alpha || (i > 0 && ((c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.')))
+				continue;
+			break;
+		}
+		if (i == 0 || i + 2 >= len || url[i] != ':' || url[i+1] != '/' || url[i+2] != '/')
+			return u;
+		u.scheme = url.substr(0, i);
+		i += 3;
+
+		// The authority runs up to the path, query or fragment. The userinfo
+		// ends at the last '@' in it and the port starts at the last ':'
+		// outside of an IPv6 literal.
+		size_t start = i, at = std::string_view::npos, colon = std::string_view::npos;
+		bool bracket = false;
+		for (; i < len && url[i] != '/' && url[i] != '?' && url[i] != '#'; ++i)
+		{
+			char c = url[i];
+			if (c == '@')
+			{
+				at = i;
+				colon = std::string_view::npos;
+				bracket = false;
+			}
+			else if (c == '[')
+				bracket = true;
+			else if (c == ']')
+				bracket = false;
+			else if (c == ':' && !bracket)
+				colon = i;
+		}
+		size_t end = i;
+
+		size_t hoststart = start;
+		if (at != std::string_view::npos)
+		{
+			u.userinfo = url.substr(start, at - start);
+			hoststart = at + 1;
+		}
+		u.authority = url.substr(hoststart, end - hoststart);
+
+		size_t hostend = colon == std::string_view::npos ? end : colon;
+		if (colon != std::string_view::npos)
+		{
+			u.port = url.substr(colon + 1, end - colon - 1);
+			for (char c : u.port)
+				if (c < '0' || c > '9')
+					return URL();
+		}
+
+		if (hoststart < hostend && url[hoststart] == '[')
+		{
+			if (url[hostend - 1] != ']')
+				return URL();
+			u.ipv6 = true;
+			u.host = url.substr(hoststart + 1, hostend - hoststart - 2);
+		}
+		else
+			u.host = url.substr(hoststart, hostend - hoststart);
+
+		if (u.host.empty())
+			return URL();
+
+		// path-abempty, then the query and fragment.
+		size_t pathstart = i;
+		for (; i < len && url[i] != '?' && url[i] != '#'; ++i)
+			;
+		u.path = url.substr(pathstart, i - pathstart);
+
+		if (i < len && url[i] == '?')
+		{
+			size_t qstart = ++i;
+			for (; i < len && url[i] != '#'; ++i)
+				;
+			u.query = url.substr(qstart, i - qstart);
+		}
+		u.target = url.substr(pathstart, i - pathstart);
+
+		if (i < len && url[i] == '#')
+			u.fragment = url.substr(i + 1);
+
+		u.valid = true;
+		return u;
+	}
+};
+
+// Parsing is meant to work at compile time, keep it that way.
+static_assert(URL::Parse("https://user@[::1]:8443/v1/Upload?a=b#top").valid, "URL::Parse must be constexpr");
+static_assert(URL::Parse("https://user@[::1]:8443/v1/Upload?a=b#top").host == "::1", "URL::Parse must be constexpr");
+static_assert(URL::Parse("https://user@[::1]:8443/v1/Upload?a=b#top").target == "/v1/Upload?a=b", "URL::Parse must be constexpr");
+static_assert(URL::Parse("https://host?key=abc").target == "?key=abc", "URL::Parse must be constexpr");
+static_assert(URL::Parse("https://api.teknik.io/v1/Upload").GetPort() == "443", "URL::Parse must be constexpr");
+static_assert(!URL::Parse("api.teknik.io/v1/Upload").valid, "URL::Parse must be constexpr");
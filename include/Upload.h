@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <sys/types.h>
+#include <chrono>
+#include <string>
+#include "IO.h"
+#include "Arena.h"
+#include "Socket.h"
+#include "Async.h"
+#include "Kittehuplodah.h"
+
+class UploadCipher;
+
+// Struct: ResponseState
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// How far ResponseComplete() got through a response being read.
+struct ResponseState
+{
+	size_t hdrend = ArenaString::npos;
+	// Where the body ends, npos if it ends when the connection does.
+	size_t bodyend = ArenaString::npos;
+	bool keepalive = false, chunked = false;
+};
+
+extern size_t FindHeader(const ArenaString &response, size_t hdrend, const char *name);
+extern bool ResponseComplete(ArenaString &response, ResponseState &state);
+extern void ResponseClosed(const ResponseState &state);
+extern bool ReadResponse(SecureConnectionSocket &sock, ArenaString &response, std::chrono::steady_clock::time_point sent);
+extern int ParseResponse(const ArenaString &response, ArenaString &body);
+extern std::string GetLink(const ArenaString &response, Arena &arena);
+
+// Class: Upload
+//
+// Arguments:
+//  source - what to upload.
+//
+// Description:
+// Uploads a single file (or buffer) to the configured uploader as a
+// multipart/form-data POST request and returns the link
+// the server gave back for it, over a connection that can be
+// kept for the next upload.
+class Upload
+{
+protected:
+	// Path of the file (or what it's called) and the name it's uploaded as.
+	std::string file, name;
+	// The file, or the buffer being uploaded instead of one.
+	int fd;
+	// Whether fd is a dup of the caller's descriptor, sharing it's file
+	// flags, so they mustn't be changed.
+	bool shared;
+	const char *data;
+	off_t size;
+	// Everything temporary belonging to the upload, freed all at once.
+	Arena arena;
+	// Encrypts the contents when the uploader wants them encrypted.
+	UploadCipher *cipher;
+
+	void BuildRequest(ArenaString &header, ArenaString &epilogue);
+	std::string AddKey(const std::string &link);
+	void Send(SecureConnectionSocket &sock, IOBackend *io, const ArenaString &header, const ArenaString &epilogue);
+	void SendEnd(SecureConnectionSocket &sock, const ArenaString &epilogue);
+	void Hedge(IOBackend *io, SecureConnectionSocket *&conn, const ArenaString &header, const ArenaString &epilogue,
+		std::chrono::steady_clock::time_point start);
+public:
+	Upload() = delete;
+	Upload(const UploadSource &source);
+	~Upload();
+
+	std::string Run(IOBackend *io, SecureConnectionSocket *&conn);
+#ifdef HAVE_COROUTINE
+	Task<std::string> RunAsync(EventLoop &loop);
+#endif
+
+	// Getters/setters.
+	inline std::string GetFile() const { return this->file; }
+	inline off_t GetSize() const { return this->size; }
+};
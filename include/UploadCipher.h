@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+#include <sys/types.h>
+#include <openssl/evp.h>
+#include <string>
+#include <vector>
+
+// Class: UploadCipher
+//
+// Arguments:
+//  mode - "ctr" or "gcm".
+//
+// Description:
+// Encrypts an upload with AES-256 as it's streamed to the uploader,
+// under a random key and IV of it's own. CTR mode has no chaining, so
+// large chunks are split up and encrypted on the thread pool at once;
+// GCM's authentication runs through the whole stream so it's encrypted
+// on one, and adds a 16 byte tag after the last chunk.
+class UploadCipher
+{
+public:
+	static const size_t KeySize = 32;
+	static const size_t IVSize = 16;
+	static const size_t TagSize = 16;
+protected:
+	bool gcm;
+	unsigned char key[KeySize];
+	unsigned char iv[IVSize];
+	// GCM's context, which carries the tag along the stream.
+	EVP_CIPHER_CTX *ctx;
+	// How far into the stream we are.
+	off_t offset;
+	// Ciphertext of the last chunk, and how much of the budget it holds.
+	std::vector<char> out;
+	size_t reserved;
+
+	void EncryptCTR(const char *data, size_t len, char *dest, off_t at);
+public:
+	UploadCipher() = delete;
+	UploadCipher(const std::string &mode);
+	UploadCipher(const UploadCipher &) = delete;
+	~UploadCipher();
+
+	void Restart();
+	void EncryptTo(const char *data, size_t len, char *dest);
+	const char *Encrypt(const char *data, size_t len);
+	size_t Finish(unsigned char *tag);
+
+	// Getters/setters.
+	inline size_t GetOverhead() const { return this->gcm ? TagSize : 0; }
+	std::string GetKey() const;
+	std::string GetIV() const;
+};
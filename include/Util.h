@@ -19,10 +19,10 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
-
+#pragma once
 #include <cstring>
 #include <cstdlib>
-#include <map>
+#include <string>
 #include "tinyformat.h"
 
 // Function: memdup
@@ -46,4 +46,49 @@ template<typename Y, typename T> T *quickmemdup(Y *data)
  return memdup<T*>(data, sizeof(Y));
 }
 
-extern std::map<std::string, std::string> DecodeURL(const std::string &url);
+// Function: ParseSize
+//
+// Arguments:
+//  str - size in bytes, optionally followed by K, M or G.
+//
+// Description:
+// Parses a human friendly size (eg. "512M") and returns
+// it in bytes, or -1 if it isn't a valid size.
+inline long ParseSize(const char *str)
+{
+	char *end;
+	long size = strtol(str, &end, 10);
+	if (end == str || size < 0)
+		return -1;
+
+	switch (*end)
+	{
+		case 'g': case 'G': size *= 1024; // Fall through
+		case 'm': case 'M': size *= 1024; // Fall through
+		case 'k': case 'K': size *= 1024; ++end; break;
+		default: break;
+	}
+
+	return *end ? -1 : size;
+}
+
+// Function: ToHex
+//
+// Arguments:
+//  data - bytes to convert.
+//  len  - how many there are.
+//
+// Description:
+// Returns the bytes in lower case hex.
+inline std::string ToHex(const unsigned char *data, size_t len)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex;
+	hex.reserve(len * 2);
+	for (size_t i = 0; i < len; ++i)
+	{
+		hex += digits[data[i] >> 4];
+		hex += digits[data[i] & 0xf];
+	}
+	return hex;
+}
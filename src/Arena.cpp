@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "Arena.h"
+
+// Blocks of the default size kept around per thread for the next arena.
+static const size_t MaxCachedBlocks = 32;
+
+// Struct: BlockCache
+//
+// Description:
+// Free list of default sized blocks, the blocks are
+// freed when the thread exits.
+struct BlockCache
+{
+	void *blocks[MaxCachedBlocks];
+	size_t count = 0;
+
+	~BlockCache()
+	{
+		for (size_t i = 0; i < this->count; ++i)
+			free(this->blocks[i]);
+	}
+};
+static thread_local BlockCache cache;
+
+// Block headers are padded so the data after them stays aligned.
+static const size_t HeaderSize = (sizeof(void*) * 3 + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+// Constructor: Arena
+//
+// Arguments:
+//  blocksize - size of the blocks allocations are carved out of.
+//
+// Description:
+// Creates an empty arena, nothing is allocated until it's first used.
+Arena::Arena(size_t blocksize) : head(nullptr), blocksize(blocksize)
+{
+}
+
+// Destructor: Arena
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Releases every block the arena allocated.
+Arena::~Arena()
+{
+	while (this->head)
+	{
+		Block *next = this->head->next;
+		this->ReleaseBlock(this->head);
+		this->head = next;
+	}
+}
+
+// Function: NewBlock
+//
+// Arguments:
+//  minsize - smallest amount of space the block must hold.
+//
+// Description:
+// Gets a block from the thread's cache or the heap and makes it
+// the current block. Oversized requests get a block of their own.
+Arena::Block *Arena::NewBlock(size_t minsize)
+{
+	size_t size = std::max(this->blocksize, minsize);
+	void *mem = nullptr;
+
+	if (size == DefaultBlockSize && cache.count > 0)
+		mem = cache.blocks[--cache.count];
+	else
+		mem = malloc(HeaderSize + size);
+
+	if (!mem)
+		throw std::bad_alloc();
+
+	Block *block = static_cast<Block*>(mem);
+	block->next = this->head;
+	block->size = size;
+	block->used = 0;
+	this->head = block;
+	return block;
+}
+
+// Function: ReleaseBlock
+//
+// Arguments:
+//  block - block to release.
+//
+// Description:
+// Returns a block to the thread's cache, or the heap if it's full.
+void Arena::ReleaseBlock(Block *block)
+{
+	if (block->size == DefaultBlockSize && cache.count < MaxCachedBlocks)
+		cache.blocks[cache.count++] = block;
+	else
+		free(block);
+}
+
+// Function: Allocate
+//
+// Arguments:
+//  len   - number of bytes needed.
+//  align - alignment of the allocation (a power of 2)
+//
+// Description:
+// Carves len bytes out of the current block, starting a new block
+// if it doesn't fit.
+void *Arena::Allocate(size_t len, size_t align)
+{
+	Block *block = this->head;
+	if (block)
+	{
+		char *base = reinterpret_cast<char*>(block) + HeaderSize;
+		uintptr_t ptr = (reinterpret_cast<uintptr_t>(base + block->used) + align - 1) & ~(align - 1);
+		size_t offset = ptr - reinterpret_cast<uintptr_t>(base);
+
+		if (offset + len <= block->size)
+		{
+			block->used = offset + len;
+			return reinterpret_cast<void*>(ptr);
+		}
+	}
+
+	block = this->NewBlock(len + align);
+	char *base = reinterpret_cast<char*>(block) + HeaderSize;
+	uintptr_t ptr = (reinterpret_cast<uintptr_t>(base) + align - 1) & ~(align - 1);
+	block->used = (ptr - reinterpret_cast<uintptr_t>(base)) + len;
+	return reinterpret_cast<void*>(ptr);
+}
+
+// Function: Deallocate
+//
+// Arguments:
+//  ptr - pointer returned by Allocate()
+//  len - size given to Allocate()
+//
+// Description:
+// Arenas only free memory all at once, but if this was the most
+// recent allocation it's space is reused. This makes growing a
+// container in the arena much cheaper.
+void Arena::Deallocate(void *ptr, size_t len)
+{
+	Block *block = this->head;
+	if (!block)
+		return;
+
+	char *base = reinterpret_cast<char*>(block) + HeaderSize;
+	if (static_cast<char*>(ptr) + len == base + block->used)
+		block->used -= len;
+}
+
+// Function: Reset
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Frees everything in the arena but keeps the current block
+// around for the next round of allocations.
+void Arena::Reset()
+{
+	if (!this->head)
+		return;
+
+	Block *keep = this->head;
+	this->head = keep->next;
+	while (this->head)
+	{
+		Block *next = this->head->next;
+		this->ReleaseBlock(this->head);
+		this->head = next;
+	}
+
+	keep->next = nullptr;
+	keep->used = 0;
+	this->head = keep;
+}
+
+// Function: Strdup
+//
+// Arguments:
+//  str - string to copy.
+//  len - length of the string.
+//
+// Description:
+// Copies a string into the arena.
+char *Arena::Strdup(const char *str, size_t len)
+{
+	char *copy = static_cast<char*>(this->Allocate(len + 1, 1));
+	memcpy(copy, str, len);
+	copy[len] = 0;
+	return copy;
+}
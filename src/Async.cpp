@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "Async.h"
+#ifdef HAVE_COROUTINE
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include "Exceptions.h"
+#include "Metrics.h"
+#include "Trace.h"
+
+// How often tasks waiting for the memory budget check for room
+// while it's held by other threads (in milliseconds)
+static const int MemoryRetryInterval = 10;
+
+// Destructor: EventLoop
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Destroys any tasks that never finished.
+EventLoop::~EventLoop()
+{
+	for (auto &task : this->tasks)
+		task.destroy();
+}
+
+// Function: Spawn
+//
+// Arguments:
+//  task - task to run.
+//
+// Description:
+// Takes over a task and runs it (once Run() is called) alongside
+// the others, nothing awaits it so it should handle it's own errors.
+void EventLoop::Spawn(Task<void> &&task)
+{
+	auto handle = task.Release();
+	this->tasks.push_back(handle);
+	this->ready.push_back(handle);
+}
+
+// Function: Run
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Runs the spawned tasks until they've all finished, resuming tasks
+// as the sockets they wait on become ready. Rethrows the first
+// exception a spawned task didn't handle once everything is done.
+void EventLoop::Run()
+{
+	std::exception_ptr error;
+	std::vector<pollfd> fds;
+
+	while (!this->tasks.empty())
+	{
+		while (!this->ready.empty())
+		{
+			auto handle = this->ready.front();
+			this->ready.pop_front();
+			handle.resume();
+		}
+
+		for (size_t i = 0; i < this->tasks.size();)
+		{
+			if (!this->tasks[i].done())
+			{
+				++i;
+				continue;
+			}
+
+			if (this->tasks[i].promise().error && !error)
+				error = this->tasks[i].promise().error;
+			this->tasks[i].destroy();
+			this->tasks.erase(this->tasks.begin() + i);
+		}
+
+		// Memory released by the tasks we just ran may be enough for others.
+		for (size_t i = 0; i < this->memorywaiters.size();)
+		{
+			if (!memorybudget.TryAcquire(this->memorywaiters[i].bytes))
+			{
+				++i;
+				continue;
+			}
+			this->ready.push_back(this->memorywaiters[i].handle);
+			this->memorywaiters.erase(this->memorywaiters.begin() + i);
+		}
+
+		if (!this->ready.empty())
+			continue;
+		// Nothing could ever wake the tasks that are left.
+		if (this->waiters.empty() && this->memorywaiters.empty())
+			break;
+
+		fds.resize(this->waiters.size());
+		for (size_t i = 0; i < this->waiters.size(); ++i)
+			fds[i] = pollfd{ this->waiters[i].fd, this->waiters[i].events, 0 };
+
+		if (::poll(fds.data(), fds.size(), this->memorywaiters.empty() ? -1 : MemoryRetryInterval) < 0 && errno != EINTR)
+			throw SocketException("Cannot poll sockets: %s", strerror(errno));
+
+		// Errors and hangups wake the task too, it's next call reports them.
+		size_t kept = 0;
+		for (size_t i = 0; i < this->waiters.size(); ++i)
+		{
+			if (fds[i].revents)
+				this->ready.push_back(this->waiters[i].handle);
+			else
+				this->waiters[kept++] = this->waiters[i];
+		}
+		this->waiters.resize(kept);
+	}
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+// Constructor: AsyncSocket
+//
+// Arguments:
+//  loop    - event loop the socket's tasks run on.
+//  address - host to connect to.
+//  port    - port to connect to.
+//
+// Description:
+// Nothing happens until Connect() is awaited.
+AsyncSocket::AsyncSocket(EventLoop &loop, const std::string &address, const std::string &port) : SecureConnectionSocket(address, port), loop(loop)
+{
+}
+
+// Function: WaitFor
+//
+// Arguments:
+//  ret - what the OpenSSL call returned.
+//
+// Description:
+// Waits for whatever the OpenSSL call wants from the socket
+// before it's retried, throws if the call failed outright.
+EventLoop::WaitAwaiter AsyncSocket::WaitFor(int ret)
+{
+	switch (SSL_get_error(this->ssl, ret))
+	{
+		case SSL_ERROR_WANT_READ:
+			return this->loop.Wait(this->fd, POLLIN);
+		case SSL_ERROR_WANT_WRITE:
+			return this->loop.Wait(this->fd, POLLOUT);
+		default:
+			throw SocketException("Connection to %s failed: %s", this->address, this->GetTLSError());
+	}
+}
+
+// Function: Connect
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Connects to the first of the host's addresses that accepts the
+// connection and does the TLS handshake. Addresses almost always
+// come from the cache (see ResolveDNS) but resolving them blocks.
+Task<void> AsyncSocket::Connect()
+{
+	Arena local;
+	auto addresses = ResolveDNS(local, this->address, this->port);
+
+	{
+		TraceSpan span("connect", this->id);
+		for (size_t i = 0; i < addresses.size() && this->fd == -1; ++i)
+		{
+			auto const &cur = addresses[i];
+			this->fd = ::socket(cur.sa.sa_family, SOCK_STREAM, 0);
+			if (this->fd < 0)
+			{
+				this->fd = -1;
+				continue;
+			}
+			fcntl(this->fd, F_SETFL, fcntl(this->fd, F_GETFL) | O_NONBLOCK);
+
+			int err = 0;
+			if (::connect(this->fd, &cur.sa, GetSockLen(cur)) != 0)
+			{
+				err = errno;
+				if (err == EINPROGRESS)
+				{
+					co_await this->loop.Wait(this->fd, POLLOUT);
+					socklen_t len = sizeof(err);
+					getsockopt(this->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				}
+			}
+
+			if (err != 0)
+			{
+				::close(this->fd);
+				this->fd = -1;
+				continue;
+			}
+			this->addrindex = i;
+		}
+	}
+
+	if (this->fd == -1)
+		throw SocketException("Failed to connect to a host");
+
+	auto start = std::chrono::steady_clock::now();
+	TraceSpan tlsspan("handshake", this->id);
+	this->StartTLS();
+	int ret;
+	while ((ret = SSL_connect(this->ssl)) != 1)
+		co_await this->WaitFor(ret);
+	metrics.CountHandshake(start, SSL_session_reused(this->ssl));
+}
+
+// Function: Write
+//
+// Arguments:
+//  data - data to send.
+//  len  - length of the data.
+//
+// Description:
+// Encrypts and sends all of the data.
+Task<void> AsyncSocket::Write(const void *data, size_t len)
+{
+	const char *ptr = static_cast<const char*>(data);
+	while (len > 0)
+	{
+		// A retried SSL_write() must be given the same arguments.
+		int ret = SSL_write(this->ssl, ptr, len > INT_MAX ? INT_MAX : len);
+		if (ret > 0)
+		{
+			metrics.bytessent.fetch_add(ret, std::memory_order_relaxed);
+			ptr += ret;
+			len -= ret;
+			continue;
+		}
+		co_await this->WaitFor(ret);
+	}
+}
+
+// Function: Read
+//
+// Arguments:
+//  data - buffer to read into.
+//  len  - size of the buffer.
+//
+// Description:
+// Reads what's available (waiting for something to be) and
+// returns how much was read, 0 once the connection is closed.
+// Throws a SocketException if it was reset or TLS failed, which
+// mustn't be mistaken for the end of the response.
+Task<size_t> AsyncSocket::Read(void *data, size_t len)
+{
+	for (;;)
+	{
+		int ret = SSL_read(this->ssl, data, len > INT_MAX ? INT_MAX : len);
+		if (ret > 0)
+			co_return ret;
+
+		if (SSL_get_error(this->ssl, ret) == SSL_ERROR_ZERO_RETURN)
+			co_return 0;
+		co_await this->WaitFor(ret);
+	}
+}
+#endif
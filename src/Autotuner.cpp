@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <algorithm>
+#include "Autotuner.h"
+#include "Metrics.h"
+
+// Global: autotuner
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Tunes every upload in the process, when autotune is on.
+Autotuner autotuner;
+
+// How often goodput is measured and one of the settings adjusted.
+static const std::chrono::milliseconds Window(1000);
+
+// Range the chunk size is tuned in, it starts out at the
+// size used when it isn't tuned.
+static const size_t MinChunkSize = 16 * 1024;
+static const size_t MaxChunkSize = 1024 * 1024;
+static const size_t StartChunkSize = 64 * 1024;
+
+// A step pays off if goodput went up by this much, and made
+// things worse if it went down by this much.
+static const double Gain = 1.05;
+static const double Loss = 0.85;
+
+// Weight a window's goodput gets against the ones before it, so one
+// window with every upload waiting on a response doesn't undo a step.
+static const double Smoothing = 0.5;
+
+// Windows spent on a plateau before probing again.
+static const int ProbeEvery = 10;
+
+Autotuner::Autotuner() : limit(1), chunksize(StartChunkSize), maxlimit(1), active(0), stopping(false), congested(false)
+{
+}
+
+Autotuner::~Autotuner()
+{
+	this->Stop();
+}
+
+// Function: Start
+//
+// Arguments:
+//  initial - how many uploads to start out running at once.
+//  max     - the most that will ever run at once.
+//
+// Description:
+// Starts tuning on a thread of it's own.
+void Autotuner::Start(int initial, int max)
+{
+	this->Stop();
+	this->maxlimit = std::max(max, 1);
+	this->limit = std::min(std::max(initial, 1), this->maxlimit);
+	this->chunksize = StartChunkSize;
+	this->stopping = false;
+	this->tuner = std::thread(&Autotuner::Tune, this);
+}
+
+// Function: Stop
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Stops tuning, the settings stay where they are.
+void Autotuner::Stop()
+{
+	if (!this->tuner.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->stopping = true;
+	}
+	this->tunecv.notify_all();
+	this->tuner.join();
+}
+
+// Function: Acquire
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Waits until fewer uploads than the current limit are
+// running and counts this one as running.
+void Autotuner::Acquire()
+{
+	std::unique_lock<std::mutex> guard(this->lock);
+	this->cv.wait(guard, [this]() { return this->active < this->limit.load(); });
+	this->active++;
+}
+
+// Function: Release
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Counts an upload as finished, letting the next one start.
+void Autotuner::Release()
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+	this->active--;
+	this->cv.notify_one();
+}
+
+// Function: Tune
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// The tuning thread: measures goodput from the bytes sent each window
+// and takes the next AIMD step (see the class description). Steps
+// alternate between the two settings so a change in goodput can be
+// put down to the one that was changed. Windows with nothing being
+// uploaded are skipped.
+void Autotuner::Tune()
+{
+	enum Knob { NONE, LIMIT, CHUNK };
+	Knob changed = NONE;
+	bool probelimit = true;
+	bool cut = false;
+	int plateau = 0;
+	// Most uploads at once before the server pushed back.
+	int ceiling = this->maxlimit;
+	double lastrate = 0;
+	uint64_t lastbytes = metrics.bytessent.load();
+	auto lasttime = std::chrono::steady_clock::now();
+
+	std::unique_lock<std::mutex> guard(this->lock);
+	while (!this->tunecv.wait_for(guard, Window, [this]() { return this->stopping; }))
+	{
+		bool busy = this->active > 0;
+		guard.unlock();
+
+		auto now = std::chrono::steady_clock::now();
+		uint64_t bytes = metrics.bytessent.load();
+		double sample = (bytes - lastbytes) / std::chrono::duration<double>(now - lasttime).count();
+		double rate = lastrate > 0 ? lastrate * (1 - Smoothing) + sample * Smoothing : sample;
+		lastbytes = bytes;
+		lasttime = now;
+
+		int limit = this->limit.load();
+		size_t chunk = this->chunksize.load();
+		bool congested = this->congested.exchange(false);
+		if (congested && !cut)
+		{
+			// The server wants less of us, remember where so the
+			// additive increase stops short of it next time.
+			ceiling = std::max(limit - 1, 1);
+			limit = std::max(limit / 2, 1);
+			changed = NONE;
+			plateau = 0;
+			rate = 0;
+		}
+		else if (congested)
+		{
+			// Uploads that started before the cut, don't cut again.
+			rate = 0;
+		}
+		else if (!busy && sample == 0)
+		{
+			guard.lock();
+			continue;
+		}
+		else if (changed != NONE && rate < lastrate * Loss)
+		{
+			// The last step made it worse, back off.
+			if (changed == LIMIT)
+				limit = std::max(std::min(limit * 3 / 4, limit - 1), 1);
+			else
+				chunk = std::max(chunk / 2, MinChunkSize);
+			changed = NONE;
+			plateau = 0;
+		}
+		else if (rate > lastrate * Gain || ++plateau >= ProbeEvery)
+		{
+			// Sat below the ceiling long enough, see if the server
+			// takes more now.
+			if (plateau >= ProbeEvery && limit >= ceiling)
+				ceiling = std::min(ceiling + 1, this->maxlimit);
+			plateau = 0;
+			changed = NONE;
+			// Take turns, unless one of them is as high as it goes.
+			bool uselimit = limit < ceiling && (probelimit || chunk >= MaxChunkSize);
+			if (uselimit)
+			{
+				limit++;
+				changed = LIMIT;
+			}
+			else if (chunk < MaxChunkSize)
+			{
+				chunk *= 2;
+				changed = CHUNK;
+			}
+			probelimit = !probelimit;
+		}
+		else
+			changed = NONE;
+		lastrate = rate;
+		cut = congested && !cut;
+
+		guard.lock();
+		this->limit = limit;
+		this->chunksize = chunk;
+		// There may be room for more now.
+		this->cv.notify_all();
+	}
+}
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <openssl/evp.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+#if defined(__linux__) && (defined(__aarch64__) || defined(__arm__))
+# include <sys/auxv.h>
+# include <asm/hwcap.h>
+#endif
+#include "Cipher.h"
+#include "Config.h"
+
+// How long each AEAD is run for when benchmarking them, and how
+// big the records are (the largest a TLS record can hold).
+static const std::chrono::milliseconds BenchTime(100);
+static const size_t BenchRecord = 16384;
+
+// Function: Suggested
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// AES-GCM is only fast with both AES and carry-less multiply
+// instructions, without them ChaCha20-Poly1305 is several times faster.
+CipherPreference CPUFeatures::Suggested() const
+{
+	return this->aes && this->pclmul ? CipherPreference::AESGCM : CipherPreference::CHACHA20;
+}
+
+// Function: ToString
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Lists the features the CPU has, used to tell if a cached benchmark
+// result was made on this kind of CPU.
+std::string CPUFeatures::ToString() const
+{
+	std::string str;
+	if (this->aes)
+		str += "aes,";
+	if (this->pclmul)
+		str += "pclmul,";
+	if (this->vaes)
+		str += "vaes,";
+	if (str.empty())
+		return "none";
+	str.pop_back();
+	return str;
+}
+
+// Function: DetectCPUFeatures
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Finds out which of the instructions that speed up AES-GCM this CPU has.
+CPUFeatures DetectCPUFeatures()
+{
+	CPUFeatures features;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	features.aes = __builtin_cpu_supports("aes");
+	features.pclmul = __builtin_cpu_supports("pclmul");
+	features.vaes = __builtin_cpu_supports("vaes") && __builtin_cpu_supports("vpclmulqdq");
+#elif defined(__linux__) && defined(__aarch64__)
+	unsigned long hwcap = getauxval(AT_HWCAP);
+	features.aes = hwcap & HWCAP_AES;
+	features.pclmul = hwcap & HWCAP_PMULL;
+#elif defined(__linux__) && defined(__arm__)
+	unsigned long hwcap2 = getauxval(AT_HWCAP2);
+	features.aes = hwcap2 & HWCAP2_AES;
+	features.pclmul = hwcap2 & HWCAP2_PMULL;
+#endif
+	return features;
+}
+
+// Function: BenchmarkAEAD
+//
+// Arguments:
+//  cipher - the AEAD to encrypt with.
+//
+// Description:
+// Encrypts TLS record sized buffers for a while the way a connection
+// does, and returns how many MB/s it managed.
+static double BenchmarkAEAD(const EVP_CIPHER *cipher)
+{
+	unsigned char key[32] = { 0 }, iv[12] = { 0 }, tag[16];
+	std::vector<unsigned char> in(BenchRecord, 'k'), out(BenchRecord + 16);
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (!ctx)
+		return 0;
+
+	size_t bytes = 0;
+	auto start = std::chrono::steady_clock::now();
+	auto elapsed = std::chrono::steady_clock::duration::zero();
+	while (elapsed < BenchTime)
+	{
+		// A batch between clock reads keeps them out of the measurement.
+		for (int i = 0; i < 16; ++i)
+		{
+			int len;
+			if (EVP_EncryptInit_ex(ctx, cipher, nullptr, key, iv) != 1 ||
+				EVP_EncryptUpdate(ctx, out.data(), &len, in.data(), in.size()) != 1 ||
+				EVP_EncryptFinal_ex(ctx, out.data() + len, &len) != 1 ||
+				EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, sizeof(tag), tag) != 1)
+			{
+				EVP_CIPHER_CTX_free(ctx);
+				return 0;
+			}
+			bytes += in.size();
+			++iv[0];
+		}
+		elapsed = std::chrono::steady_clock::now() - start;
+	}
+
+	EVP_CIPHER_CTX_free(ctx);
+	return bytes / std::chrono::duration<double>(elapsed).count() / (1024 * 1024);
+}
+
+// Function: BenchmarkCiphers
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Measures how fast this machine encrypts with AES-128-GCM and
+// ChaCha20-Poly1305, the AEADs TLS connections end up using.
+CipherBenchmark BenchmarkCiphers()
+{
+	CipherBenchmark bench;
+	bench.aesgcm = BenchmarkAEAD(EVP_aes_128_gcm());
+	bench.chacha20 = BenchmarkAEAD(EVP_chacha20_poly1305());
+	return bench;
+}
+
+// Function: Fastest
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Returns the AEAD that came out fastest.
+CipherPreference CipherBenchmark::Fastest() const
+{
+	return this->aesgcm >= this->chacha20 ? CipherPreference::AESGCM : CipherPreference::CHACHA20;
+}
+
+// Function: CipherName
+//
+// Arguments:
+//  pref - the cipher.
+//
+// Description:
+// Returns the name of the cipher as used in the config.
+const char *CipherName(CipherPreference pref)
+{
+	return pref == CipherPreference::AESGCM ? "aes" : "chacha";
+}
+
+// Function: GetCachePath
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Returns where the benchmark's result is kept between runs.
+static std::string GetCachePath()
+{
+	const char *dir = getenv("XDG_CACHE_HOME");
+	if (dir && *dir)
+		return std::string(dir) + "/kittehuplodah-cipher";
+	dir = getenv("HOME");
+	if (dir && *dir)
+		return std::string(dir) + "/.cache/kittehuplodah-cipher";
+	return "";
+}
+
+// Function: SaveCipherPreference
+//
+// Arguments:
+//  pref - the cipher that came out fastest.
+//
+// Description:
+// Caches the benchmark's result along with the features of the CPU it
+// ran on. Failing to write it only means benchmarking again next time.
+void SaveCipherPreference(CipherPreference pref)
+{
+	std::string path = GetCachePath();
+	if (path.empty())
+		return;
+
+	std::string tmp = path + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (!f)
+		return;
+	bool ok = fprintf(f, "%s %s\n", DetectCPUFeatures().ToString().c_str(), CipherName(pref)) > 0;
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+		remove(tmp.c_str());
+}
+
+// Function: LoadCipherPreference
+//
+// Arguments:
+//  pref - set to the cached cipher.
+//
+// Description:
+// Reads the cached benchmark result, returns false if there isn't
+// one or it was made on a CPU with different features.
+static bool LoadCipherPreference(CipherPreference &pref)
+{
+	std::string path = GetCachePath();
+	if (path.empty())
+		return false;
+
+	std::ifstream in(path);
+	std::string features, name;
+	if (!(in >> features >> name) || features != DetectCPUFeatures().ToString())
+		return false;
+
+	if (name == CipherName(CipherPreference::AESGCM))
+		pref = CipherPreference::AESGCM;
+	else if (name == CipherName(CipherPreference::CHACHA20))
+		pref = CipherPreference::CHACHA20;
+	else
+		return false;
+	return true;
+}
+
+// Function: PreferredCipher
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Decides which AEAD connections offer first, by the CPU's features
+// unless the config says otherwise. With "cipher=bench" the choice is
+// measured instead, once per CPU since it's cached.
+CipherPreference PreferredCipher()
+{
+	static CipherPreference pref = []()
+	{
+		std::string setting = config ? config->cipher : "auto";
+		if (setting == "aes")
+			return CipherPreference::AESGCM;
+		if (setting == "chacha")
+			return CipherPreference::CHACHA20;
+
+		CipherPreference cached;
+		if (setting == "bench")
+		{
+			if (LoadCipherPreference(cached))
+				return cached;
+			cached = BenchmarkCiphers().Fastest();
+			SaveCipherPreference(cached);
+			return cached;
+		}
+
+		return DetectCPUFeatures().Suggested();
+	}();
+	return pref;
+}
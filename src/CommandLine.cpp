@@ -130,25 +130,42 @@ static inline void PrintLicense()
 // Arguments:
 //  argc - argc from int main.
 //  argv - argv from int main.
+//  files - filled with the files to upload.
 //
 // Description:
 // Reads the command line options given from int main and processes
 // their values. It will set global application options as well as
 // print information such as help or licenses.
-std::map<std::string, std::string> ProcessArgs(int argc, char **argv)
+std::map<std::string, std::string> ProcessArgs(int argc, char **argv, std::vector<std::string> &files)
 {
 	std::map<std::string, std::string> parsed;
 	// TODO: add options to handle different upload providers
 	std::map<std::string, docopt::value> args = docopt::docopt(
 	R"(
 	Usage:
-		kittehuplodah [--config=<file>] <files>...
+		kittehuplodah [options] <files>...
+		kittehuplodah [options] --from-file=<manifest> [<files>...]
+		kittehuplodah [options] --journal=<journal> [<files>...]
+		kittehuplodah [options] --daemon=<socket>
+		kittehuplodah --connect=<socket> <files>...
 		kittehuplodah (-h | --help)
 		kittehuplodah --version | --license
+		kittehuplodah --bench-ciphers
 
 	Options:
 		-h --help                            Show Help (this screen)
 		--config=<file>                      Config file location [default: kittehuplodah.ini]
+		--snapshot=<file>                    Cache the parsed config, addresses and TLS session in this file
+		--io=<backend>                       IO backend to use: auto, io_uring or blocking
+		-j <n> --jobs=<n>                    Number of files to upload at once
+		--autotune                           Tune how many files are uploaded at once and their chunk size as it goes
+		--max-memory=<size>                  Most memory upload buffers can use at once (eg. 256M)
+		--trace=<file>                       Write a timeline of every upload to a file for chrome://tracing or Perfetto
+		--bench-ciphers                      Measure which cipher is fastest here and remember it for cipher=bench
+		--from-file=<manifest>               Upload the files listed in a file ("-" for stdin), one per line or null separated
+		--journal=<journal>                  Record uploads in a journal, files it has links for are skipped and the ones a killed run left are resumed
+		--daemon=<socket>                    Stay running and upload the files clients pass over a Unix socket
+		--connect=<socket>                   Pass the files to a daemon to upload instead of uploading them here
 		--version                            Show the version
 		--license                            Print the application's license info
 	)",
@@ -158,11 +175,33 @@ std::map<std::string, std::string> ProcessArgs(int argc, char **argv)
 	{
 		if (arg.first == "--license" && arg.second.asBool())
 			PrintLicense();
+		if (arg.first == "--bench-ciphers" && arg.second.asBool())
+			parsed["bench-ciphers"] = "yes";
 		if (arg.first == "--config")
 			parsed["config"] = std::string(arg.second.asString());
+		if (arg.first == "--snapshot" && arg.second)
+			parsed["snapshot"] = std::string(arg.second.asString());
+		if (arg.first == "--from-file" && arg.second)
+			parsed["from-file"] = std::string(arg.second.asString());
+		if (arg.first == "--journal" && arg.second)
+			parsed["journal"] = std::string(arg.second.asString());
+		if (arg.first == "--daemon" && arg.second)
+			parsed["daemon"] = std::string(arg.second.asString());
+		if (arg.first == "--connect" && arg.second)
+			parsed["connect"] = std::string(arg.second.asString());
+		if (arg.first == "--io" && arg.second)
+			parsed["io"] = std::string(arg.second.asString());
+		if (arg.first == "--jobs" && arg.second)
+			parsed["jobs"] = std::string(arg.second.asString());
+		if (arg.first == "--autotune" && arg.second.asBool())
+			parsed["autotune"] = "yes";
+		if (arg.first == "--trace" && arg.second)
+			parsed["trace"] = std::string(arg.second.asString());
+		if (arg.first == "--max-memory" && arg.second)
+			parsed["max-memory"] = std::string(arg.second.asString());
+		if (arg.first == "<files>" && arg.second)
+			files = arg.second.asStringList();
 	}
 
-	// TODO: get file(s)
-
 	return parsed;
 }
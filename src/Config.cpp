@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include "Config.h"
 #include "Exceptions.h"
+#include "Util.h"
 #include "inih/INIReader.h"
 
 // Constructor: Config class
@@ -50,6 +51,102 @@ Config::Config(const std::string &cf) : ConfigFile(cf)
 
 	if (this->uploadurl == "\007UNKNOWN\007")
 		throw ConfigException("Cannot have unknown value for 'url' config option\n");
+
+	this->field = reader.Get(this->uploader, "field", "file");
+	this->hedgesize = reader.GetInteger(this->uploader, "hedgesize", 0);
+	this->encrypt = reader.Get(this->uploader, "encrypt", "none");
+	this->verify = reader.GetBoolean(this->uploader, "verify", true);
+	this->cafile = reader.Get(this->uploader, "cafile", "");
+	this->capath = reader.Get(this->uploader, "capath", "");
+
+	this->type = reader.Get(this->uploader, "type", "form");
+	this->bucket = reader.Get(this->uploader, "bucket", "");
+	this->region = reader.Get(this->uploader, "region", "us-east-1");
+	this->accesskey = reader.Get(this->uploader, "accesskey", "");
+	this->secretkey = reader.Get(this->uploader, "secretkey", "");
+	this->prefix = reader.Get(this->uploader, "prefix", "");
+	this->publicurl = reader.Get(this->uploader, "publicurl", "");
+	this->connections = reader.GetInteger(this->uploader, "connections", 8);
+
+	this->partsize = ParseSize(reader.Get(this->uploader, "partsize", "16M").c_str());
+	if (this->partsize < 0)
+		throw ConfigException("'partsize' must be a size in bytes (optionally K, M or G), not '%s'\n", reader.Get(this->uploader, "partsize", "16M"));
+
+	this->iobackend = reader.Get("default", "io", "auto");
+	this->iofixed = reader.GetBoolean("default", "iofixed", false);
+
+	if (reader.Get("default", "readahead", "auto") == "auto")
+		this->readahead = -1;
+	else
+		this->readahead = reader.GetBoolean("default", "readahead", true);
+	this->directio = reader.GetBoolean("default", "directio", false);
+	this->dropcache = reader.GetBoolean("default", "dropcache", true);
+
+	this->cachettl = reader.GetInteger("default", "cachettl", 300);
+
+	this->jobs = reader.GetInteger("default", "jobs", 1);
+	this->smallfile = reader.GetInteger("default", "smallfile", 1024 * 1024);
+	this->autotune = reader.GetBoolean("default", "autotune", false);
+	this->maxjobs = reader.GetInteger("default", "maxjobs", 32);
+
+	this->coalesce = reader.GetBoolean("default", "coalesce", false);
+	this->cipher = reader.Get("default", "cipher", "auto");
+
+	this->metricsfile = reader.Get("default", "metricsfile", "");
+	this->metricsinterval = reader.GetInteger("default", "metricsinterval", 15);
+
+	this->maxmemory = ParseSize(reader.Get("default", "maxmemory", "0").c_str());
+	if (this->maxmemory < 0)
+		throw ConfigException("'maxmemory' must be a size in bytes (optionally K, M or G), not '%s'\n", reader.Get("default", "maxmemory", "0"));
+
+	this->Validate();
+}
+
+// Function: Validate
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Checks the values that were read and works out the ones
+// derived from them, regardless of where they were read from.
+void Config::Validate()
+{
+	this->url = URL::Parse(this->uploadurl);
+	if (!this->url.valid)
+		throw ConfigException("'%s' is not a valid URL\n", this->uploadurl);
+
+	if (this->jobs < 1)
+		throw ConfigException("'jobs' must be at least 1, not %d\n", this->jobs);
+
+	if (this->maxjobs < 1)
+		throw ConfigException("'maxjobs' must be at least 1, not %d\n", this->maxjobs);
+
+	if (this->metricsinterval < 1)
+		throw ConfigException("'metricsinterval' must be at least 1 second, not %d\n", this->metricsinterval);
+
+	if (this->encrypt != "none" && this->encrypt != "ctr" && this->encrypt != "gcm")
+		throw ConfigException("'encrypt' must be none, ctr or gcm, not '%s'\n", this->encrypt);
+
+	if (this->type != "form" && this->type != "s3")
+		throw ConfigException("'type' must be form or s3, not '%s'\n", this->type);
+
+	if (this->type == "s3")
+	{
+		if (this->bucket.empty() || this->accesskey.empty() || this->secretkey.empty())
+			throw ConfigException("S3 uploaders need a 'bucket', 'accesskey' and 'secretkey'\n");
+		// The store has nowhere to put the key and IV.
+		if (this->encrypt != "none")
+			throw ConfigException("S3 uploaders cannot be encrypted\n");
+		// S3 won't take parts under 5 MiB (except the last one).
+		if (this->partsize < 5 * 1024 * 1024)
+			throw ConfigException("'partsize' must be at least 5M, not %d\n", this->partsize);
+		if (this->connections < 1)
+			throw ConfigException("'connections' must be at least 1, not %d\n", this->connections);
+	}
+
+	if (this->cipher != "auto" && this->cipher != "aes" && this->cipher != "chacha" && this->cipher != "bench")
+		throw ConfigException("'cipher' must be auto, aes, chacha or bench, not '%s'\n", this->cipher);
 }
 
 Config::~Config()
@@ -0,0 +1,542 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+#include "Daemon.h"
+#include "Exceptions.h"
+#include "IO.h"
+#include "Kittehuplodah.h"
+#include "MPMCQueue.h"
+#include "Socket.h"
+#include "tinyformat.h"
+
+// The daemon and it's clients talk over a Unix seqpacket socket, one
+// message at a time, each starting with it's type:
+//  F<name>         - upload the file whose descriptor comes with the message.
+//  E               - that's all the files of the batch.
+// And back:
+//  +<index> <link> - the index'th file of the batch was uploaded.
+//  -<index> <err>  - it failed.
+//  E               - every file of the batch is done.
+// The files are sent as descriptors so the daemon reads what the
+// client opened, even files the daemon itself couldn't open.
+static const size_t MaxMessage = 8192;
+
+// SIGINT and SIGTERM write to the pipe to stop the daemon, whichever
+// thread they land on.
+static int stoppipe[2] = { -1, -1 };
+
+// Clients being served, the daemon waits for them before it exits.
+// Their sockets are kept so stopping can wake the ones waiting on
+// their client for more files.
+static std::mutex clientlock;
+static std::condition_variable clientcv;
+static size_t clients = 0;
+static std::set<int> clientsocks;
+
+// Struct: DaemonClient
+//
+// Description:
+// A client being served and how many of it's files are still queued
+// or being uploaded, which it waits on to finish a batch.
+struct DaemonClient
+{
+	int sock;
+	std::mutex lock;
+	std::condition_variable cv;
+	size_t outstanding = 0;
+};
+
+// Struct: DaemonJob
+//
+// Description:
+// A file passed by a client, and where it was in the client's batch.
+// The job owns the name, which the upload's UploadSource only views.
+struct DaemonJob
+{
+	DaemonClient *client;
+	size_t index;
+	int fd;
+	std::string name;
+};
+
+// Every client's jobs go through one queue to the upload workers,
+// pushed from the client threads and popped by the workers.
+static const size_t DispatchCapacity = 4096;
+static const size_t DispatchBatch = 8;
+static MPMCQueue<DaemonJob> *dispatch = nullptr;
+
+// Function: FinishJob
+//
+// Arguments:
+//  client - whose job it was.
+//
+// Description:
+// Counts one of the client's jobs as done.
+static void FinishJob(DaemonClient &client)
+{
+	std::lock_guard<std::mutex> guard(client.lock);
+	if (--client.outstanding == 0)
+		client.cv.notify_all();
+}
+
+// Function: MakeAddress
+//
+// Arguments:
+//  path - the socket's path.
+//  addr - filled with it's address.
+//
+// Description:
+// Throws a SocketException if the path is too long for a Unix socket.
+static void MakeAddress(const std::string &path, sockaddr_un &addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw SocketException("Socket path %s is too long", path);
+	memcpy(addr.sun_path, path.c_str(), path.size());
+}
+
+// Function: SendMessage
+//
+// Arguments:
+//  sock - socket to send over.
+//  msg  - the message.
+//  fd   - descriptor to pass along with it, or -1.
+//
+// Description:
+// Sends a message, throws a SocketException if it can't be.
+static void SendMessage(int sock, const std::string &msg, int fd = -1)
+{
+	iovec iov = { const_cast<char*>(msg.data()), msg.size() };
+	msghdr hdr = { };
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	if (fd >= 0)
+	{
+		hdr.msg_control = control;
+		hdr.msg_controllen = sizeof(control);
+		cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	ssize_t len;
+	while ((len = ::sendmsg(sock, &hdr, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+		;
+	if (len < 0)
+		throw SocketException("Cannot send to the daemon socket: %s", strerror(errno));
+}
+
+// Function: ReceiveMessage
+//
+// Arguments:
+//  sock - socket to read from.
+//  msg  - set to the message.
+//  fd   - set to the descriptor passed with it, or -1.
+//
+// Description:
+// Reads a message, returns false once the other end closed the
+// connection. Throws a SocketException if it can't be read.
+static bool ReceiveMessage(int sock, std::string &msg, int &fd)
+{
+	char buf[MaxMessage];
+	iovec iov = { buf, sizeof(buf) };
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	msghdr hdr = { };
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
+
+	ssize_t len;
+	while ((len = ::recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+		;
+	if (len < 0)
+		throw SocketException("Cannot read from the daemon socket: %s", strerror(errno));
+
+	fd = -1;
+	for (cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	if (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+	{
+		if (fd >= 0)
+			::close(fd);
+		throw SocketException("Message on the daemon socket was too long");
+	}
+
+	msg.assign(buf, len);
+	return len > 0;
+}
+
+// Function: StopDaemon
+//
+// Arguments:
+//  sig - the signal.
+//
+// Description:
+// Signal handler waking RunDaemon() up to exit.
+static void StopDaemon(int sig)
+{
+	int err = errno;
+	// If the pipe is full it's been woken up already.
+	ssize_t ret = ::write(stoppipe[1], "", 1);
+	static_cast<void>(ret);
+	errno = err;
+}
+
+// Function: ServeClient
+//
+// Arguments:
+//  sock - the client's connection, closed when it's done.
+//
+// Description:
+// Queues the descriptors the client sends for the upload workers as
+// they arrive, and once it's sent all of a batch waits for the workers
+// to finish it (they reply to the client themselves) before saying so.
+static void ServeClient(int sock)
+{
+	DaemonClient client;
+	client.sock = sock;
+	try
+	{
+		std::string msg;
+		int fd;
+		size_t index = 0;
+		while (ReceiveMessage(sock, msg, fd))
+		{
+			if (msg[0] == 'F' && fd >= 0)
+			{
+				{
+					std::lock_guard<std::mutex> guard(client.lock);
+					client.outstanding++;
+				}
+				DaemonJob job{ &client, index++, fd, msg.substr(1) };
+				if (!dispatch->Push(std::move(job)))
+				{
+					// The daemon's stopping.
+					::close(fd);
+					FinishJob(client);
+					throw SocketException("The daemon is stopping");
+				}
+				continue;
+			}
+			if (fd >= 0)
+				::close(fd);
+			if (msg[0] != 'E')
+				throw SocketException("Unknown message on the daemon socket");
+
+			std::unique_lock<std::mutex> guard(client.lock);
+			client.cv.wait(guard, [&]() { return client.outstanding == 0; });
+			guard.unlock();
+			SendMessage(sock, "E");
+			index = 0;
+		}
+	}
+	catch (const BasicException &e)
+	{
+		tfm::printf("Daemon client failed: %s\n", e.what());
+	}
+
+	// The workers still have our jobs.
+	std::unique_lock<std::mutex> guard(client.lock);
+	client.cv.wait(guard, [&]() { return client.outstanding == 0; });
+	guard.unlock();
+
+	// Closed under the lock so stopping can't shut down a descriptor
+	// that's been reused.
+	std::lock_guard<std::mutex> clientguard(clientlock);
+	clientsocks.erase(sock);
+	::close(sock);
+	if (--clients == 0)
+		clientcv.notify_all();
+}
+
+// Function: RunUploads
+//
+// Arguments:
+//  io - IO backend to upload with, deleted when it's done.
+//
+// Description:
+// An upload worker: takes jobs from every client off the dispatch
+// queue and replies to whichever client sent each one, until the
+// queue's closed. Jobs are taken a few at a time when there's a
+// backlog of them, and one at a time otherwise so a few large files
+// don't end up queued behind each other while other workers sit idle.
+static void RunUploads(IOBackend *io)
+{
+	SecureConnectionSocket *conn = nullptr;
+	DaemonJob jobs[DispatchBatch];
+	size_t workers = GetWorkerCount();
+	for (;;)
+	{
+		size_t want = std::min(std::max<size_t>(dispatch->Size() / workers, 1), DispatchBatch);
+		size_t count = dispatch->Pop(jobs, want);
+		if (count == 0)
+			break;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			DaemonJob &job = jobs[i];
+			std::exception_ptr error;
+			std::string link = UploadOne(io, conn, UploadSource::FromFD(job.fd, job.name), error);
+			::close(job.fd);
+
+			std::string reply = tfm::format("+%d %s", job.index, link);
+			try
+			{
+				if (error)
+					std::rethrow_exception(error);
+			}
+			catch (const std::exception &e)
+			{
+				reply = tfm::format("-%d %s", job.index, e.what());
+			}
+			// A client that went away just doesn't hear about it.
+			try
+			{
+				SendMessage(job.client->sock, reply.substr(0, MaxMessage));
+			}
+			catch (const SocketException &)
+			{
+			}
+			FinishJob(*job.client);
+		}
+	}
+
+	delete conn;
+	delete io;
+}
+
+// Function: RunDaemon
+//
+// Arguments:
+//  path - where the socket is made.
+//
+// Description:
+// Listens on a Unix socket and uploads whatever clients pass to it
+// (see RunClient) until it's interrupted or terminated. Each client is
+// read on it's own thread, their files all go through one queue to
+// the upload workers (see GetWorkerCount). The uploader has to be
+// set up already.
+int RunDaemon(const std::string &path)
+{
+	sockaddr_un addr;
+	int sock = -1;
+	try
+	{
+		MakeAddress(path, addr);
+		sock = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (sock < 0)
+			throw SocketException("Cannot create the daemon socket: %s", strerror(errno));
+
+		// A daemon that was killed leaves it's socket behind.
+		::unlink(path.c_str());
+		if (::bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(sock, SOMAXCONN) != 0)
+			throw SocketException("Cannot listen on %s: %s", path, strerror(errno));
+	}
+	catch (const SocketException &e)
+	{
+		tfm::printf("%s\n", e.what());
+		if (sock >= 0)
+			::close(sock);
+		return EXIT_FAILURE;
+	}
+
+	if (::pipe2(stoppipe, O_CLOEXEC | O_NONBLOCK) != 0)
+	{
+		tfm::printf("Cannot create a pipe: %s\n", strerror(errno));
+		::close(sock);
+		return EXIT_FAILURE;
+	}
+	struct sigaction sa = { };
+	sa.sa_handler = StopDaemon;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+
+	// The first backend has to work, the rest will then.
+	IOBackend *io;
+	try
+	{
+		io = CreateIOBackend(config->iobackend);
+	}
+	catch (const IOException &e)
+	{
+		tfm::printf("%s\n", e.what());
+		::close(sock);
+		return EXIT_FAILURE;
+	}
+
+	dispatch = new MPMCQueue<DaemonJob>(DispatchCapacity);
+	std::vector<std::thread> workers;
+	workers.emplace_back(RunUploads, io);
+	for (int i = 1; i < GetWorkerCount(); ++i)
+		workers.emplace_back(RunUploads, CreateIOBackend(config->iobackend));
+
+	tfm::printf("Listening on %s\n", path);
+	fflush(stdout);
+
+	for (;;)
+	{
+		pollfd fds[2] = { { sock, POLLIN, 0 }, { stoppipe[0], POLLIN, 0 } };
+		if (::poll(fds, 2, -1) < 0)
+			continue;
+		if (fds[1].revents)
+			break;
+
+		int client = ::accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+		if (client < 0)
+		{
+			if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+				tfm::printf("Cannot accept on %s: %s\n", path, strerror(errno));
+			continue;
+		}
+
+		std::lock_guard<std::mutex> guard(clientlock);
+		++clients;
+		clientsocks.insert(client);
+		std::thread(ServeClient, client).detach();
+	}
+
+	// Stop taking new clients and let the ones we have finish. Clients
+	// waiting on their client for more files are woken up as though it
+	// hung up, the files they already passed are still uploaded.
+	::close(sock);
+	::unlink(path.c_str());
+	{
+		std::unique_lock<std::mutex> guard(clientlock);
+		for (int client : clientsocks)
+			::shutdown(client, SHUT_RD);
+		clientcv.wait(guard, []() { return clients == 0; });
+	}
+
+	dispatch->Close();
+	for (auto &worker : workers)
+		worker.join();
+	delete dispatch;
+	dispatch = nullptr;
+	return EXIT_SUCCESS;
+}
+
+// Function: RunClient
+//
+// Arguments:
+//  path  - the daemon's socket.
+//  files - files to upload.
+//
+// Description:
+// Opens the files and passes them to the daemon to upload, then prints
+// the links it sent back. Returns EXIT_FAILURE if any of them failed.
+int RunClient(const std::string &path, const std::vector<std::string> &files)
+{
+	int ret = EXIT_SUCCESS;
+	int sock = -1;
+	std::vector<const std::string*> sent;
+	try
+	{
+		sockaddr_un addr;
+		MakeAddress(path, addr);
+		sock = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (sock < 0 || ::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+			throw SocketException("Cannot connect to the daemon at %s: %s", path, strerror(errno));
+
+		for (auto const &file : files)
+		{
+			int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+			{
+				tfm::printf("Failed to upload %s: Cannot open %s: %s\n", file, file, strerror(errno));
+				ret = EXIT_FAILURE;
+				continue;
+			}
+
+			size_t slash = file.find_last_of('/');
+			try
+			{
+				SendMessage(sock, "F" + file.substr(slash == std::string::npos ? 0 : slash + 1), fd);
+			}
+			catch (...)
+			{
+				::close(fd);
+				throw;
+			}
+			// The daemon has it's own copy now.
+			::close(fd);
+			sent.push_back(&file);
+		}
+		SendMessage(sock, "E");
+
+		std::string msg;
+		int fd;
+		while (ReceiveMessage(sock, msg, fd))
+		{
+			if (fd >= 0)
+				::close(fd);
+			if (msg == "E")
+				break;
+
+			char *end;
+			size_t index = strtoul(msg.c_str() + 1, &end, 10);
+			if ((msg[0] != '+' && msg[0] != '-') || *end != ' ' || index >= sent.size())
+				throw SocketException("Unknown message on the daemon socket");
+
+			if (msg[0] == '+')
+				tfm::printf("%s: %s\n", *sent[index], end + 1);
+			else
+			{
+				tfm::printf("Failed to upload %s: %s\n", *sent[index], end + 1);
+				ret = EXIT_FAILURE;
+			}
+		}
+		if (msg != "E")
+			throw SocketException("The daemon went away");
+	}
+	catch (const SocketException &e)
+	{
+		tfm::printf("%s\n", e.what());
+		ret = EXIT_FAILURE;
+	}
+
+	if (sock >= 0)
+		::close(sock);
+	return ret;
+}
@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+// O_DIRECT is a Linux extension.
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE 1
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include "FileReader.h"
+#include "Autotuner.h"
+#include "Config.h"
+#include "Exceptions.h"
+#include "MemoryBudget.h"
+
+// How much of the file is read at a time, this must be a multiple of
+// the block size for O_DIRECT reads.
+static const size_t ChunkSize = 64 * 1024;
+// Buffer alignment O_DIRECT needs.
+static const size_t Alignment = 4096;
+
+// Constructor: FileReader
+//
+// Arguments:
+//  fd     - file to read (not owned).
+//  size   - size of the file.
+//  io     - IO backend used when not reading ahead on a thread.
+//  shared - fd shares it's file flags with someone else's descriptor.
+//
+// Description:
+// Sets up the read buffers (waiting for the memory budget to have
+// room for them), advises the kernel of our access pattern and
+// starts the readahead thread if it's enabled. With iofixed the
+// buffers are the ones the IO backend keeps registered. O_DIRECT
+// isn't used on shared descriptors, setting it would change the
+// owner's descriptor too.
+FileReader::FileReader(int fd, off_t size, IOBackend *io, bool shared) : fd(fd), size(size), io(io), threaded(false), dropcache(config->dropcache),
+	fixed(false), chunksize(config->autotune ? autotuner.GetChunkSize() : ChunkSize), cur(-1), nextoffset(0), stop(false), error(0)
+{
+	memorybudget.Acquire(sizeof(this->slots) / sizeof(this->slots[0]) * this->chunksize);
+
+	// When the backend batches it's reads with our sends we don't need a
+	// thread, the kernel reads the next chunk while the current one goes out.
+	if (this->size > 0)
+	{
+		if (config->readahead < 0)
+			this->threaded = !io->BatchesSends();
+		else
+			this->threaded = config->readahead;
+	}
+
+	char *fixedbufs[2];
+	if (this->size > 0 && !this->threaded && config->iofixed)
+		this->fixed = io->GetFixedBuffers(fixedbufs, 2, this->chunksize) && io->SetFixedFile(0, this->fd);
+
+	this->slots[0].data = this->slots[1].data = nullptr;
+	for (int i = 0; i < 2; ++i)
+	{
+		void *ptr = this->fixed ? fixedbufs[i] : nullptr;
+		if (!ptr && posix_memalign(&ptr, Alignment, this->chunksize) != 0)
+		{
+			free(this->slots[0].data);
+			memorybudget.Release(sizeof(this->slots) / sizeof(this->slots[0]) * this->chunksize);
+			throw std::bad_alloc();
+		}
+		this->slots[i] = Slot{static_cast<char*>(ptr), 0, 0, false};
+	}
+
+	if (this->size == 0)
+		return;
+
+	// Doubles the kernel's readahead window for this file.
+	posix_fadvise(this->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+#ifdef O_DIRECT
+	if (config->directio && !shared)
+	{
+		int flags = fcntl(this->fd, F_GETFL);
+		if (flags >= 0 && fcntl(this->fd, F_SETFL, flags | O_DIRECT) == 0)
+		{
+			// Some filesystems accept the flag but then fail every read,
+			// if so just go through the page cache.
+			if (pread(this->fd, this->slots[0].data, Alignment, 0) < 0 && errno == EINVAL)
+				fcntl(this->fd, F_SETFL, flags);
+		}
+	}
+#endif
+
+	if (this->threaded)
+		this->thread = std::thread(&FileReader::ReadAhead, this);
+}
+
+// Destructor: FileReader
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Stops the readahead thread and frees the buffers
+// back to the memory budget.
+FileReader::~FileReader()
+{
+	if (this->thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->mtx);
+			this->stop = true;
+		}
+		this->cv.notify_all();
+		this->thread.join();
+	}
+
+	// The registered buffers stay with the backend for the next file,
+	// but it mustn't keep this one open.
+	if (this->fixed)
+		this->io->SetFixedFile(0, -1);
+	else
+	{
+		for (auto &slot : this->slots)
+			free(slot.data);
+	}
+	memorybudget.Release(sizeof(this->slots) / sizeof(this->slots[0]) * this->chunksize);
+}
+
+// Function: FillSlot
+//
+// Arguments:
+//  idx    - slot to read into.
+//  offset - offset of the chunk in the file.
+//
+// Description:
+// Reads a whole chunk (or up to the end of the file) into a slot with
+// ordinary syscalls, storing -errno as the length on failure.
+void FileReader::FillSlot(int idx, off_t offset)
+{
+	Slot &slot = this->slots[idx];
+	size_t got = 0;
+
+	while (got < this->chunksize)
+	{
+		ssize_t ret = ::pread(this->fd, slot.data + got, this->chunksize - got, offset + got);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+		{
+			slot.len = -errno;
+			return;
+		}
+		if (ret == 0)
+			break;
+		got += ret;
+	}
+
+	slot.len = got;
+}
+
+// Function: ReadAhead
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Body of the readahead thread, fills each slot as soon
+// as Next() is finished with it.
+void FileReader::ReadAhead()
+{
+	for (off_t offset = 0; offset < this->size; offset += this->chunksize)
+	{
+		int idx = (offset / this->chunksize) % 2;
+		{
+			std::unique_lock<std::mutex> lock(this->mtx);
+			this->cv.wait(lock, [&]() { return this->stop || !this->slots[idx].filled; });
+			if (this->stop)
+				return;
+		}
+
+		this->FillSlot(idx, offset);
+
+		bool failed;
+		{
+			std::lock_guard<std::mutex> lock(this->mtx);
+			this->slots[idx].offset = offset;
+			this->slots[idx].filled = true;
+			failed = this->slots[idx].len <= 0;
+		}
+		this->cv.notify_all();
+
+		// Next() reports the error.
+		if (failed)
+			return;
+	}
+}
+
+// Function: MakeRead
+//
+// Arguments:
+//  idx    - slot to read into.
+//  offset - offset of the chunk in the file.
+//
+// Description:
+// Builds a read request for the IO backend.
+IORequest FileReader::MakeRead(int idx, off_t offset)
+{
+	IORequest req = IORequest::Read(this->fd, this->slots[idx].data, this->chunksize, offset);
+	if (this->fixed)
+	{
+		req.fd = 0;
+		req.fixedfile = true;
+		req.bufindex = idx;
+	}
+	return req;
+}
+
+// Function: Next
+//
+// Arguments:
+//  data - set to the chunk's data.
+//  len  - set to the chunk's length.
+//
+// Description:
+// Releases the previous chunk and returns the next one, waiting for it
+// to be read if it isn't already. Returns false at the end of the file
+// and throws an IOException if the file couldn't be read.
+bool FileReader::Next(char **data, size_t *len)
+{
+	if (this->nextoffset >= this->size)
+		return false;
+
+	int idx = this->cur < 0 ? 0 : this->cur ^ 1;
+
+	if (this->threaded)
+	{
+		std::unique_lock<std::mutex> lock(this->mtx);
+		if (this->cur >= 0)
+		{
+			this->slots[this->cur].filled = false;
+			this->cv.notify_all();
+		}
+		this->cv.wait(lock, [&]() { return this->slots[idx].filled; });
+	}
+	else
+	{
+		// Nobody batched the read for us, do it now.
+		if (!this->slots[idx].filled)
+		{
+			IORequest req = this->MakeRead(idx, this->nextoffset);
+			this->io->Submit(&req, 1);
+			this->Completed(req);
+		}
+		if (this->cur >= 0)
+			this->slots[this->cur].filled = false;
+	}
+
+	Slot &slot = this->slots[idx];
+	if (slot.len < 0)
+		throw IOException("Cannot read file: %s", strerror(-slot.len));
+	if (slot.len == 0)
+		throw IOException("File was truncated while reading");
+
+	this->cur = idx;
+	this->nextoffset += slot.len;
+	*data = slot.data;
+	*len = slot.len;
+	return true;
+}
+
+// Function: Done
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Drops the chunk returned by Next() from the page cache,
+// it won't be needed again.
+void FileReader::Done()
+{
+	if (this->dropcache && this->cur >= 0)
+		posix_fadvise(this->fd, this->slots[this->cur].offset, this->slots[this->cur].len, POSIX_FADV_DONTNEED);
+}
+
+// Function: GetPendingRead
+//
+// Arguments:
+//  req - request to fill in.
+//
+// Description:
+// Builds the read request for the chunk after the current one so it can be
+// submitted in the same batch as other IO. Returns false if there is nothing
+// to read or the readahead thread is taking care of it.
+bool FileReader::GetPendingRead(IORequest &req)
+{
+	int idx = this->cur < 0 ? 0 : this->cur ^ 1;
+	if (this->threaded || this->nextoffset >= this->size || this->slots[idx].filled)
+		return false;
+
+	req = this->MakeRead(idx, this->nextoffset);
+	return true;
+}
+
+// Function: Completed
+//
+// Arguments:
+//  req - a completed request from GetPendingRead()
+//
+// Description:
+// Stores the result of the read in it's slot for Next() to return.
+void FileReader::Completed(const IORequest &req)
+{
+	int idx = req.buf == this->slots[0].data ? 0 : 1;
+	Slot &slot = this->slots[idx];
+
+	slot.offset = req.offset;
+	slot.len = req.result;
+	slot.filled = true;
+
+	// Short reads only happen at the end of the file (or with O_DIRECT
+	// on the final block), anything else we finish off ourselves.
+	if (req.result > 0 && static_cast<size_t>(req.result) < this->chunksize && req.offset + req.result < this->size)
+		this->FillSlot(idx, req.offset);
+}
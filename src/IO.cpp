@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "IO.h"
+#include "Exceptions.h"
+#include "sysconf.h"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+#endif
+
+// Send without raising SIGPIPE if the server hangs up on us.
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+// Function: Submit
+//
+// Arguments:
+//  reqs  - array of requests to perform.
+//  count - number of requests in the array.
+//
+// Description:
+// Performs every request one after another with ordinary syscalls.
+void BlockingIO::Submit(IORequest *reqs, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		IORequest &req = reqs[i];
+		ssize_t ret;
+
+		do
+		{
+			if (req.type == IORequest::READ)
+				ret = ::pread(req.fd, req.buf, req.len, req.offset);
+			else
+				ret = ::send(req.fd, req.buf, req.len, MSG_NOSIGNAL);
+		} while (ret < 0 && errno == EINTR);
+
+		req.result = ret < 0 ? -errno : ret;
+	}
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+// Class: UringIO
+//
+// Description:
+// Submits batches of requests through a Linux io_uring. The ring is
+// set up with raw syscalls so we don't depend on liburing.
+class UringIO : public IOBackend
+{
+	int ringfd;
+	unsigned entries;
+
+	// Mapped ring memory.
+	void *sqptr, *cqptr;
+	size_t sqsize, cqsize;
+	struct io_uring_sqe *sqes;
+	size_t sqessize;
+
+	// Pointers into the submission ring.
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	// Pointers into the completion ring.
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_cqe *cqes;
+
+	// Registered file table and buffers, see IOBackend::GetFixedBuffers().
+	std::vector<int> files;
+	std::vector<char*> buffers;
+	size_t bufferlen;
+	bool fixedfiles, fixedbuffers;
+
+	void FreeFixedBuffers();
+
+	static inline int Setup(unsigned entries, struct io_uring_params *p)
+	{
+		return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+	}
+
+	static inline int Enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+	{
+		return static_cast<int>(::syscall(__NR_io_uring_enter, fd, submit, complete, flags, nullptr, 0));
+	}
+
+	static inline int Register(int fd, unsigned opcode, const void *arg, unsigned nargs)
+	{
+		return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nargs));
+	}
+
+	static bool Supports(int fd, const std::vector<int> &ops);
+
+public:
+	UringIO(unsigned entries);
+	~UringIO();
+
+	void Submit(IORequest *reqs, size_t count) override;
+	bool GetFixedBuffers(char **bufs, size_t count, size_t len) override;
+	bool SetFixedFile(unsigned index, int fd) override;
+	const char *GetName() const override { return "io_uring"; }
+	bool BatchesSends() const override { return true; }
+};
+
+// Constructor: UringIO
+//
+// Arguments:
+//  entries - size of the submission queue.
+//
+// Description:
+// Creates the ring and maps it into our address space. Throws an
+// IOException if the kernel doesn't support (or doesn't permit) io_uring.
+UringIO::UringIO(unsigned entries) : ringfd(-1), entries(0), sqptr(MAP_FAILED), cqptr(MAP_FAILED), sqsize(0), cqsize(0),
+	sqes(static_cast<struct io_uring_sqe*>(MAP_FAILED)), sqessize(0), bufferlen(0), fixedfiles(false), fixedbuffers(false)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	this->ringfd = Setup(entries, &p);
+	if (this->ringfd < 0)
+		throw IOException("io_uring_setup failed: %s", strerror(errno));
+
+	// 5.1 to 5.5 kernels set up a ring but fail every read and send on it.
+	if (!Supports(this->ringfd, { IORING_OP_READ, IORING_OP_SEND }))
+	{
+		::close(this->ringfd);
+		throw IOException("io_uring on this kernel doesn't support reads and sends");
+	}
+
+	this->entries = p.sq_entries;
+	this->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	this->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	// Newer kernels let both rings share a single mapping.
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single)
+		this->sqsize = this->cqsize = std::max(this->sqsize, this->cqsize);
+
+	this->sqptr = ::mmap(nullptr, this->sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringfd, IORING_OFF_SQ_RING);
+	if (this->sqptr == MAP_FAILED)
+	{
+		int err = errno;
+		::close(this->ringfd);
+		throw IOException("Failed to map io_uring submission queue: %s", strerror(err));
+	}
+
+	if (single)
+		this->cqptr = this->sqptr;
+	else
+	{
+		this->cqptr = ::mmap(nullptr, this->cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringfd, IORING_OFF_CQ_RING);
+		if (this->cqptr == MAP_FAILED)
+		{
+			int err = errno;
+			::munmap(this->sqptr, this->sqsize);
+			::close(this->ringfd);
+			throw IOException("Failed to map io_uring completion queue: %s", strerror(err));
+		}
+	}
+
+	this->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqeptr = ::mmap(nullptr, this->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringfd, IORING_OFF_SQES);
+	if (sqeptr == MAP_FAILED)
+	{
+		int err = errno;
+		if (this->cqptr != this->sqptr)
+			::munmap(this->cqptr, this->cqsize);
+		::munmap(this->sqptr, this->sqsize);
+		::close(this->ringfd);
+		throw IOException("Failed to map io_uring submission entries: %s", strerror(err));
+	}
+	this->sqes = static_cast<struct io_uring_sqe*>(sqeptr);
+
+	char *sq = static_cast<char*>(this->sqptr), *cq = static_cast<char*>(this->cqptr);
+	this->sqhead  = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+	this->sqtail  = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	this->sqmask  = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	this->sqarray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	this->cqhead  = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	this->cqtail  = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	this->cqmask  = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	this->cqes    = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+}
+
+// Function: Supports
+//
+// Arguments:
+//  fd  - the ring.
+//  ops - IORING_OP_* opcodes we need.
+//
+// Description:
+// Asks the kernel which opcodes the ring supports. Kernels too old to
+// answer (before 5.6) don't support IORING_OP_READ or IORING_OP_SEND
+// either, so that's a no.
+bool UringIO::Supports(int fd, const std::vector<int> &ops)
+{
+	const unsigned count = 256;
+	std::vector<char> mem(sizeof(struct io_uring_probe) + count * sizeof(struct io_uring_probe_op), 0);
+	struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe*>(mem.data());
+	if (Register(fd, IORING_REGISTER_PROBE, probe, count) < 0)
+		return false;
+
+	for (int op : ops)
+		if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+			return false;
+	return true;
+}
+
+// Destructor: UringIO
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Unmaps the rings and closes the ring file descriptor.
+UringIO::~UringIO()
+{
+	this->FreeFixedBuffers();
+	::munmap(this->sqes, this->sqessize);
+	if (this->cqptr != this->sqptr)
+		::munmap(this->cqptr, this->cqsize);
+	::munmap(this->sqptr, this->sqsize);
+	::close(this->ringfd);
+}
+
+// Function: Submit
+//
+// Arguments:
+//  reqs  - array of requests to perform.
+//  count - number of requests in the array.
+//
+// Description:
+// Places as many requests as fit into the submission queue and enters
+// the kernel once to both submit them and wait for their completion.
+// Batches larger than the ring are split into ring sized pieces.
+void UringIO::Submit(IORequest *reqs, size_t count)
+{
+	while (count > 0)
+	{
+		unsigned batch = static_cast<unsigned>(std::min<size_t>(count, this->entries));
+		unsigned tail = *this->sqtail, mask = *this->sqmask;
+
+		for (unsigned i = 0; i < batch; ++i)
+		{
+			IORequest &req = reqs[i];
+			unsigned idx = (tail + i) & mask;
+			struct io_uring_sqe *sqe = &this->sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+
+			sqe->fd        = req.fd;
+			sqe->addr      = reinterpret_cast<uint64_t>(req.buf);
+			sqe->len       = static_cast<uint32_t>(req.len);
+			sqe->user_data = i;
+
+			if (req.fixedfile && this->fixedfiles)
+				sqe->flags |= IOSQE_FIXED_FILE;
+			else if (req.fixedfile)
+				sqe->fd = this->files[req.fd];
+
+			if (req.type == IORequest::READ)
+			{
+				sqe->off = req.offset;
+				if (req.bufindex >= 0 && this->fixedbuffers)
+				{
+					sqe->opcode = IORING_OP_READ_FIXED;
+					sqe->buf_index = static_cast<uint16_t>(req.bufindex);
+				}
+				else
+					sqe->opcode = IORING_OP_READ;
+			}
+			else
+			{
+				sqe->opcode = IORING_OP_SEND;
+				sqe->msg_flags = MSG_NOSIGNAL;
+			}
+
+			this->sqarray[idx] = idx;
+		}
+
+		// Publish the new tail so the kernel sees our entries.
+		__atomic_store_n(this->sqtail, tail + batch, __ATOMIC_RELEASE);
+
+		unsigned tosubmit = batch, completed = 0;
+		while (completed < batch)
+		{
+			int ret = Enter(this->ringfd, tosubmit, batch - completed, IORING_ENTER_GETEVENTS);
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				throw IOException("io_uring_enter failed: %s", strerror(errno));
+			}
+			tosubmit -= std::min<unsigned>(tosubmit, static_cast<unsigned>(ret));
+
+			// Reap whatever completed.
+			unsigned head = *this->cqhead;
+			unsigned cqtail = __atomic_load_n(this->cqtail, __ATOMIC_ACQUIRE);
+			for (; head != cqtail; ++head, ++completed)
+			{
+				struct io_uring_cqe *cqe = &this->cqes[head & *this->cqmask];
+				reqs[cqe->user_data].result = cqe->res;
+			}
+			__atomic_store_n(this->cqhead, head, __ATOMIC_RELEASE);
+		}
+
+		reqs += batch;
+		count -= batch;
+	}
+}
+
+// Function: GetFixedBuffers
+//
+// Arguments:
+//  bufs  - set to the buffers.
+//  count - how many buffers are needed.
+//  len   - how big each of them has to be.
+//
+// Description:
+// Returns the ring's registered buffers, registering them the first
+// time and again only when more or bigger ones are needed. They're
+// aligned for O_DIRECT. Returns false if the kernel refused, which
+// commonly happens when RLIMIT_MEMLOCK is too small.
+bool UringIO::GetFixedBuffers(char **bufs, size_t count, size_t len)
+{
+	if (!this->fixedbuffers || count > this->buffers.size() || len > this->bufferlen)
+	{
+		count = std::max(count, this->buffers.size());
+		len = std::max(len, this->bufferlen);
+		this->FreeFixedBuffers();
+
+		std::vector<struct iovec> iov;
+		for (size_t i = 0; i < count; ++i)
+		{
+			void *ptr = nullptr;
+			if (posix_memalign(&ptr, 4096, len) != 0)
+			{
+				this->FreeFixedBuffers();
+				return false;
+			}
+			this->buffers.push_back(static_cast<char*>(ptr));
+			iov.push_back({ ptr, len });
+		}
+
+		this->fixedbuffers = Register(this->ringfd, IORING_REGISTER_BUFFERS, iov.data(), iov.size()) == 0;
+		if (!this->fixedbuffers)
+		{
+			this->FreeFixedBuffers();
+			return false;
+		}
+		this->bufferlen = len;
+	}
+
+	std::copy(this->buffers.begin(), this->buffers.begin() + count, bufs);
+	return true;
+}
+
+// Function: FreeFixedBuffers
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Unregisters and frees the registered buffers.
+void UringIO::FreeFixedBuffers()
+{
+	if (this->fixedbuffers)
+		Register(this->ringfd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+	this->fixedbuffers = false;
+
+	for (char *buf : this->buffers)
+		free(buf);
+	this->buffers.clear();
+	this->bufferlen = 0;
+}
+
+// Function: SetFixedFile
+//
+// Arguments:
+//  index - entry in the registered file table.
+//  fd    - descriptor to put there, -1 to clear it.
+//
+// Description:
+// Registers the file table the first time (or when it needs to grow)
+// and after that only updates the one entry. The ring holds a
+// reference to every file in the table, clear entries once they're
+// done with. Even if the kernel refused, Submit() maps indexes back
+// to descriptors.
+bool UringIO::SetFixedFile(unsigned index, int fd)
+{
+	bool grow = index >= this->files.size();
+	if (grow)
+		this->files.resize(index + 1, -1);
+	this->files[index] = fd;
+	if (!this->fixedfiles && fd < 0)
+		return false;
+
+	if (this->fixedfiles && !grow)
+	{
+		struct io_uring_files_update update;
+		memset(&update, 0, sizeof(update));
+		update.offset = index;
+		update.fds = reinterpret_cast<uint64_t>(&this->files[index]);
+		if (Register(this->ringfd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1)
+			return true;
+	}
+
+	if (this->fixedfiles)
+		Register(this->ringfd, IORING_UNREGISTER_FILES, nullptr, 0);
+	this->fixedfiles = Register(this->ringfd, IORING_REGISTER_FILES, this->files.data(), this->files.size()) == 0;
+	return this->fixedfiles;
+}
+#endif
+
+// Function: CreateIOBackend
+//
+// Arguments:
+//  name - "blocking", "io_uring" or "auto".
+//
+// Description:
+// Creates the requested IO backend. "auto" (and "io_uring" on systems
+// that can't create a ring) falls back to the blocking backend.
+IOBackend *CreateIOBackend(const std::string &name)
+{
+	if (name == "blocking")
+		return new BlockingIO();
+
+	if (name != "auto" && name != "io_uring")
+		throw IOException("Unknown IO backend '%s'", name);
+
+#ifdef HAVE_LINUX_IO_URING_H
+	try
+	{
+		return new UringIO(64);
+	}
+	catch (const IOException &e)
+	{
+		if (name == "io_uring")
+			tfm::printf("%s, falling back to blocking IO\n", e.what());
+	}
+#else
+	if (name == "io_uring")
+		tfm::printf("io_uring is not supported on this system, falling back to blocking IO\n");
+#endif
+
+	return new BlockingIO();
+}
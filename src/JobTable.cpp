@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <algorithm>
+#include <cstring>
+#include "JobTable.h"
+
+// Function: HashPath
+//
+// Arguments:
+//  path - path to hash.
+//  len  - length of the path.
+//
+// Description:
+// 32 bit FNV-1a hash of the path.
+static uint32_t HashPath(const char *path, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; ++i)
+	{
+		hash ^= static_cast<unsigned char>(path[i]);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Function: Rehash
+//
+// Arguments:
+//  count - number of buckets (a power of 2)
+//
+// Description:
+// Rebuilds the intern table with a new number of buckets.
+void JobTable::Rehash(size_t count)
+{
+	this->buckets.assign(count, 0);
+	size_t mask = count - 1;
+	for (size_t job = 0; job < this->paths.size(); ++job)
+	{
+		size_t idx = this->hashes[job] & mask;
+		while (this->buckets[idx])
+			idx = (idx + 1) & mask;
+		this->buckets[idx] = job + 1;
+	}
+}
+
+// Function: Add
+//
+// Arguments:
+//  path - path of the file to upload.
+//  len  - length of the path.
+//
+// Description:
+// Adds a job for the file unless there already is one,
+// returns the index of the file's job.
+size_t JobTable::Add(const char *path, size_t len)
+{
+	// Keep the table at most half full.
+	if ((this->paths.size() + 1) * 2 > this->buckets.size())
+		this->Rehash(this->buckets.empty() ? 1024 : this->buckets.size() * 2);
+
+	uint32_t hash = HashPath(path, len);
+	size_t mask = this->buckets.size() - 1;
+	size_t idx = hash & mask;
+
+	for (; this->buckets[idx]; idx = (idx + 1) & mask)
+	{
+		size_t job = this->buckets[idx] - 1;
+		if (this->hashes[job] == hash && this->lengths[job] == len && memcmp(this->paths[job], path, len) == 0)
+			return job;
+	}
+
+	size_t job = this->paths.size();
+	this->paths.push_back(this->arena.Strdup(path, len));
+	this->lengths.push_back(len);
+	this->hashes.push_back(hash);
+	this->states.push_back(PENDING);
+	this->buckets[idx] = job + 1;
+
+	return job;
+}
+
+// Function: Clear
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Removes every job, keeping the memory for reuse.
+void JobTable::Clear()
+{
+	this->paths.clear();
+	this->lengths.clear();
+	this->hashes.clear();
+	this->states.clear();
+	std::fill(this->buckets.begin(), this->buckets.end(), 0);
+	this->arena.Reset();
+}
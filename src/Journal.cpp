@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <unordered_set>
+#include "Journal.h"
+#include "Exceptions.h"
+
+// Global: journal
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// The journal given with --journal, uploads aren't
+// recorded anywhere when it's null.
+Journal *journal = nullptr;
+
+// Every record starts with it's payload's length, a checksum of the
+// type and payload and the type. The payload is the path, a null and
+// the link (empty for queued files).
+static const size_t RecordHeader = 9;
+
+// Function: Checksum
+//
+// Arguments:
+//  type    - the record's type.
+//  payload - the record's payload.
+//  len     - length of the payload.
+//
+// Description:
+// 32 bit FNV-1a hash of the record, which is enough
+// to tell a record apart from a torn write.
+static uint32_t Checksum(uint8_t type, const char *payload, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	hash = (hash ^ type) * 16777619u;
+	for (size_t i = 0; i < len; ++i)
+	{
+		hash ^= static_cast<unsigned char>(payload[i]);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Constructor: Journal
+//
+// Arguments:
+//  file - where the journal is kept, made if it doesn't exist.
+//
+// Description:
+// Opens the journal and replays whatever an earlier run recorded
+// in it. Throws an IOException if it can't be opened or read.
+Journal::Journal(const std::string &file) : file(file), appended(0), durable(0), syncing(false), error(0)
+{
+	this->fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (this->fd < 0)
+		throw IOException("Cannot open journal %s: %s", file, strerror(errno));
+
+	try
+	{
+		this->Replay();
+	}
+	catch (...)
+	{
+		::close(this->fd);
+		throw;
+	}
+}
+
+Journal::~Journal()
+{
+	::close(this->fd);
+}
+
+// Function: Replay
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Reads the records back in. A run that was killed can leave half a
+// record at the end, that and anything after it is cut off so new
+// records don't end up behind it.
+void Journal::Replay()
+{
+	std::vector<char> data;
+	char buf[64 * 1024];
+	for (;;)
+	{
+		ssize_t len = ::pread(this->fd, buf, sizeof(buf), data.size());
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			throw IOException("Cannot read journal %s: %s", this->file, strerror(errno));
+		if (len == 0)
+			break;
+		data.insert(data.end(), buf, buf + len);
+	}
+
+	std::unordered_set<std::string> seen;
+	size_t pos = 0;
+	while (data.size() - pos >= RecordHeader)
+	{
+		uint32_t len, check;
+		memcpy(&len, &data[pos], sizeof(len));
+		memcpy(&check, &data[pos + 4], sizeof(check));
+		uint8_t type = data[pos + 8];
+		const char *payload = &data[pos + RecordHeader];
+		if (data.size() - pos - RecordHeader < len || Checksum(type, payload, len) != check)
+			break;
+
+		const char *sep = static_cast<const char*>(memchr(payload, 0, len));
+		if (!sep)
+			break;
+		std::string path(payload, sep);
+		if (type == DONE)
+			this->done[path] = std::string(sep + 1, payload + len);
+		else if (type == QUEUED && seen.insert(path).second)
+			this->queued.push_back(std::move(path));
+		pos += RecordHeader + len;
+	}
+
+	if (pos != data.size() && ::ftruncate(this->fd, pos) != 0)
+		throw IOException("Cannot truncate journal %s: %s", this->file, strerror(errno));
+}
+
+// Function: Append
+//
+// Arguments:
+//  type - what happened.
+//  path - the file it happened to.
+//  link - where it was uploaded to, for acknowledged files.
+//
+// Description:
+// Adds a record to the journal and returns it's number, which has to
+// be given to Commit() before the record can be relied on.
+uint64_t Journal::Append(Type type, std::string_view path, std::string_view link)
+{
+	// The payload goes straight into the pending records and the
+	// header is filled in once it can be checksummed there.
+	std::lock_guard<std::mutex> guard(this->lock);
+	size_t start = this->pending.size();
+	this->pending.resize(start + RecordHeader);
+	this->pending.insert(this->pending.end(), path.begin(), path.end());
+	this->pending.push_back('\0');
+	this->pending.insert(this->pending.end(), link.begin(), link.end());
+
+	char *header = &this->pending[start];
+	uint32_t len = this->pending.size() - start - RecordHeader, check = Checksum(type, header + RecordHeader, len);
+	memcpy(header, &len, sizeof(len));
+	memcpy(header + 4, &check, sizeof(check));
+	header[8] = type;
+	return ++this->appended;
+}
+
+// Function: Commit
+//
+// Arguments:
+//  record - number of the record that has to be durable.
+//
+// Description:
+// Returns once the record (and every one before it) is on disk. If
+// nobody else is writing the journal this thread writes everything
+// appended so far and fsyncs it, otherwise it waits for them, so
+// concurrent commits share one fsync. Throws an IOException if the
+// journal can't be written.
+void Journal::Commit(uint64_t record)
+{
+	std::unique_lock<std::mutex> guard(this->lock);
+	while (this->durable < record)
+	{
+		// What's on disk after a failed write is anyone's guess.
+		if (this->error)
+			throw IOException("Cannot write journal %s: %s", this->file, strerror(this->error));
+		if (this->syncing)
+		{
+			this->cv.wait(guard);
+			continue;
+		}
+
+		this->syncing = true;
+		std::vector<char> batch;
+		batch.swap(this->pending);
+		uint64_t last = this->appended;
+		guard.unlock();
+
+		int err = 0;
+		for (size_t written = 0; written < batch.size() && !err; )
+		{
+			ssize_t len = ::write(this->fd, batch.data() + written, batch.size() - written);
+			if (len < 0 && errno != EINTR)
+				err = errno;
+			else if (len > 0)
+				written += len;
+		}
+		if (!err && ::fdatasync(this->fd) != 0)
+			err = errno;
+
+		guard.lock();
+		this->syncing = false;
+		this->error = err;
+		if (!err)
+			this->durable = last;
+		this->cv.notify_all();
+	}
+}
+
+// Function: Acknowledged
+//
+// Arguments:
+//  path - the file.
+//
+// Description:
+// Returns the link of a file an earlier run uploaded,
+// or null if it wasn't acknowledged.
+const std::string *Journal::Acknowledged(std::string_view path) const
+{
+	auto it = this->done.find(path);
+	return it == this->done.end() ? nullptr : &it->second;
+}
+
+// Function: Unfinished
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Returns the files an earlier run queued but never got
+// acknowledged, in the order they were queued.
+std::vector<std::string> Journal::Unfinished() const
+{
+	std::vector<std::string> files;
+	for (auto const &path : this->queued)
+	{
+		if (!this->done.count(path))
+			files.push_back(path);
+	}
+	return files;
+}
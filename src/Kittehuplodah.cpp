@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <sys/stat.h>
+#include <csignal>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "Kittehuplodah.h"
+#include "Autotuner.h"
+#include "Exceptions.h"
+#include "IO.h"
+#include "Journal.h"
+#include "MemoryBudget.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Scheduler.h"
+#include "Socket.h"
+#include "Upload.h"
+#include "S3.h"
+#include "SingleFlight.h"
+
+// Global: config
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Global pointer of the Config class (see Config.h)
+// that allows all classes and applications to access
+// the config values parsed by this class.
+Config *config;
+
+// Function: InitUploader
+//
+// Arguments:
+//  conf - the config to upload with, it isn't owned and
+//         has to outlive every upload.
+//
+// Description:
+// Sets up the process for uploading, call this once before UploadMany()
+// and ShutdownUploader() after the last upload.
+void InitUploader(Config *conf)
+{
+	config = conf;
+	memorybudget.SetLimit(config->maxmemory);
+
+	// A connection kept for the next upload may have been closed
+	// by the server, that's an error from write() not a signal.
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!config->metricsfile.empty())
+		metrics.Start(config->metricsfile, config->metricsinterval);
+	if (config->autotune)
+		autotuner.Start(config->jobs, config->maxjobs);
+}
+
+// Function: ShutdownUploader
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Finishes up after the last upload, writing the metrics one
+// last time and the trace if they're being written.
+void ShutdownUploader()
+{
+	autotuner.Stop();
+	metrics.Stop();
+	WriteTrace();
+}
+
+// Function: GetWorkerCount
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Returns how many upload workers to start: the jobs count, or when
+// autotuning the most it can tune up to (the autotuner keeps the ones
+// it doesn't want waiting).
+int GetWorkerCount()
+{
+	return config->autotune ? std::max(config->maxjobs, config->jobs) : config->jobs;
+}
+
+// Struct: Batch
+//
+// Description:
+// What the workers of one UploadMany() call share.
+struct Batch
+{
+	const std::vector<UploadSource> &sources;
+	const UploadCallback &callback;
+	Scheduler &scheduler;
+	// Callbacks are made one at a time.
+	std::mutex lock;
+};
+
+// Function: GetSourceSize
+//
+// Arguments:
+//  source - what's being uploaded.
+//
+// Description:
+// Stats the source for scheduling, returns -1 if it can't be.
+static off_t GetSourceSize(const UploadSource &source)
+{
+	struct stat st;
+	switch (source.type)
+	{
+		case UploadSource::PATH:
+			return ::stat(source.name.data(), &st) == 0 ? st.st_size : -1;
+		case UploadSource::FD:
+			return ::fstat(source.fd, &st) == 0 ? st.st_size : -1;
+		default:
+			return source.len;
+	}
+}
+
+// Uploads in flight, for coalescing identical ones.
+static SingleFlight flights;
+
+// Function: UploadOne
+//
+// Arguments:
+//  io     - IO backend to upload with.
+//  conn   - connection kept between uploads (see Upload::Run).
+//  source - what to upload.
+//  error  - set to why it failed, if it did.
+//
+// Description:
+// Uploads a single source with whichever kind of uploader is
+// configured, counts it in the metrics and returns it's link. With
+// coalesce on, a source whose contents are already being uploaded
+// waits for that upload and gets the same link.
+std::string UploadOne(IOBackend *io, SecureConnectionSocket *&conn, const UploadSource &source, std::exception_ptr &error)
+{
+	std::string link;
+	try
+	{
+		// Only the upload actually talking to the server holds a slot,
+		// not ones waiting on an identical upload to finish.
+		auto run = [&]()
+		{
+			AutotuneSlot slot(config->autotune);
+			if (config->type == "s3")
+			{
+				S3Upload upload(source);
+				return upload.Run(io, conn);
+			}
+			Upload upload(source);
+			return upload.Run(io, conn);
+		};
+
+		// The same contents being uploaded at once are only uploaded once.
+		if (config->coalesce)
+		{
+			bool shared;
+			link = flights.Do(ContentKey(source), run, &shared);
+			if (shared)
+				metrics.coalesced.fetch_add(1, std::memory_order_relaxed);
+		}
+		else
+			link = run();
+
+		// It's only acknowledged once it's in the journal, which is
+		// committed outside any lock so uploads finishing together
+		// share an fsync.
+		if (journal && source.type == UploadSource::PATH)
+			journal->Commit(journal->Append(Journal::DONE, source.name, link));
+	}
+	catch (const std::exception &)
+	{
+		error = std::current_exception();
+	}
+
+	if (error)
+		metrics.CountFailure(error);
+	else
+		metrics.uploads.fetch_add(1, std::memory_order_relaxed);
+	return link;
+}
+
+// Function: RunWorker
+//
+// Arguments:
+//  io    - IO backend to upload with.
+//  batch - the batch being uploaded.
+//
+// Description:
+// Uploads the sources the scheduler hands out over a single
+// connection that is kept open between them.
+static void RunWorker(IOBackend *io, Batch &batch)
+{
+	SecureConnectionSocket *conn = nullptr;
+	const uint32_t *job, *end;
+	while (batch.scheduler.Next(&job, &end))
+	{
+		for (; job != end; ++job)
+		{
+			std::exception_ptr error;
+			std::string link = UploadOne(io, conn, batch.sources[*job], error);
+
+			std::lock_guard<std::mutex> guard(batch.lock);
+			batch.callback(*job, link, error);
+		}
+	}
+
+	delete conn;
+}
+
+// Function: UploadMany
+//
+// Arguments:
+//  sources  - what to upload.
+//  callback - called with the result of each upload.
+//
+// Description:
+// Uploads everything on GetWorkerCount() workers, each with it's own IO
+// backend and connection, in the order the scheduler picks (see
+// Scheduler.cpp). Returns once every source's callback was made.
+// Throws an IOException if the configured IO backend doesn't exist,
+// and whatever starting a worker or the callback threw, but only once
+// the workers that did start are finished with the batch.
+void UploadMany(const std::vector<UploadSource> &sources, const UploadCallback &callback)
+{
+	IOBackend *io = CreateIOBackend(config->iobackend);
+
+	// Everything is stat'd up front so the schedule can use the sizes.
+	std::vector<off_t> sizes(sources.size());
+	for (size_t i = 0; i < sources.size(); ++i)
+		sizes[i] = GetSourceSize(sources[i]);
+
+	Scheduler scheduler(sizes);
+	scheduler.Plan();
+	Batch batch{ sources, callback, scheduler, { } };
+
+	std::vector<std::thread> workers;
+	try
+	{
+		for (size_t i = 1; i < std::min<size_t>(GetWorkerCount(), sources.size()); ++i)
+		{
+			workers.emplace_back([&]()
+			{
+				// The first backend worked, so will these.
+				IOBackend *wio = CreateIOBackend(config->iobackend);
+				RunWorker(wio, batch);
+				delete wio;
+			});
+		}
+
+		// This thread is a worker too.
+		RunWorker(io, batch);
+	}
+	catch (...)
+	{
+		for (auto &worker : workers)
+			worker.join();
+		delete io;
+		throw;
+	}
+
+	for (auto &worker : workers)
+		worker.join();
+	delete io;
+}
+
+// Function: UploadMany
+//
+// Arguments:
+//  sources - what to upload.
+//
+// Description:
+// Starts uploading everything in the background and returns a future
+// for each source's link, which throws whatever the upload failed with.
+// Buffers, names and descriptors have to stay valid until their futures
+// are ready.
+std::vector<std::future<std::string>> UploadMany(const std::vector<UploadSource> &sources)
+{
+	auto promises = std::make_shared<std::vector<std::promise<std::string>>>(sources.size());
+	std::vector<std::future<std::string>> futures;
+	futures.reserve(sources.size());
+	for (auto &promise : *promises)
+		futures.push_back(promise.get_future());
+
+	std::thread([promises, sources]()
+	{
+		// Which promises were kept, the rest get whatever stopped the batch.
+		std::vector<bool> kept(sources.size());
+		try
+		{
+			UploadMany(sources, [&](size_t index, const std::string &link, std::exception_ptr error)
+			{
+				if (error)
+					(*promises)[index].set_exception(error);
+				else
+					(*promises)[index].set_value(link);
+				kept[index] = true;
+			});
+		}
+		catch (...)
+		{
+			// Nothing can escape this thread without taking the process with it.
+			for (size_t i = 0; i < promises->size(); ++i)
+			{
+				if (!kept[i])
+					(*promises)[i].set_exception(std::current_exception());
+			}
+		}
+	}).detach();
+
+	return futures;
+}
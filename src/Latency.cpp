@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <algorithm>
+#include "Latency.h"
+
+// Constructor: LatencyTracker
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Starts out without any samples.
+LatencyTracker::LatencyTracker() : count(0), next(0)
+{
+}
+
+// Function: Add
+//
+// Arguments:
+//  usec - latency in microseconds.
+//
+// Description:
+// Records a sample, replacing the oldest one once the window is full.
+void LatencyTracker::Add(long usec)
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+	this->samples[this->next] = usec;
+	this->next = (this->next + 1) % Window;
+	if (this->count < Window)
+		this->count++;
+}
+
+// Function: Percentile
+//
+// Arguments:
+//  percent - which percentile (0 to 100)
+//
+// Description:
+// Returns the percentile of the recent samples in microseconds,
+// or -1 if there haven't been enough samples yet.
+long LatencyTracker::Percentile(int percent)
+{
+	long sorted[Window];
+	size_t count;
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		count = this->count;
+		std::copy(this->samples, this->samples + count, sorted);
+	}
+
+	if (count < MinSamples)
+		return -1;
+
+	size_t nth = std::min(count - 1, count * std::max(std::min(percent, 100), 0) / 100);
+	std::nth_element(sorted, sorted + nth, sorted + count);
+	return sorted[nth];
+}
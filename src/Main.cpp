@@ -22,23 +22,164 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <algorithm>
 #include <unistd.h>
 #include "CommandLine.h"
 #include "Config.h"
-#include "Util.h"
 #include "Exceptions.h"
-#include "Socket.h"
+#include "Kittehuplodah.h"
+#include "Snapshot.h"
+#include "Cipher.h"
+#include "Daemon.h"
+#include "Trace.h"
+#include "JobTable.h"
+#include "Journal.h"
+#include "Manifest.h"
+#include "Util.h"
+
+// How many files from a manifest are held in memory at once.
+static const size_t ManifestBatch = 64 * 1024;
+
+// Function: RunJobs
+//
+// Arguments:
+//  jobs - files to upload.
+//
+// Description:
+// Uploads every pending job in the table (see UploadMany) and prints
+// the links, returns EXIT_FAILURE if any of them failed. With a journal
+// the files it has links for aren't uploaded again and the rest are
+// recorded as queued before any of them are uploaded. The sources and
+// the journal only see views of the paths interned in the table.
+static int RunJobs(JobTable &jobs)
+{
+	std::vector<UploadSource> sources;
+	std::vector<size_t> indexes;
+	uint64_t queued = 0;
+	for (size_t job = 0; job < jobs.Size(); ++job)
+	{
+		if (jobs.GetState(job) != JobTable::PENDING)
+			continue;
+
+		std::string_view path(jobs.GetPath(job), jobs.GetPathLength(job));
+		if (journal)
+		{
+			if (const std::string *link = journal->Acknowledged(path))
+			{
+				tfm::printf("%s: %s\n", path, *link);
+				jobs.SetState(job, JobTable::DONE);
+				continue;
+			}
+			queued = journal->Append(Journal::QUEUED, path);
+		}
+
+		sources.push_back(UploadSource::FromPath(path));
+		indexes.push_back(job);
+	}
+
+	// The whole batch is queued with one fsync.
+	if (queued)
+		journal->Commit(queued);
+
+	int ret = EXIT_SUCCESS;
+	UploadMany(sources, [&](size_t index, const std::string &link, std::exception_ptr error)
+	{
+		const char *file = jobs.GetPath(indexes[index]);
+		try
+		{
+			if (error)
+				std::rethrow_exception(error);
+			tfm::printf("%s: %s\n", file, link);
+			jobs.SetState(indexes[index], JobTable::DONE);
+			return;
+		}
+		catch (const SocketException &e)
+		{
+			tfm::printf("There was a problem trying to connect to %s: \n%s\n", config->uploadurl, e.what());
+		}
+		catch (const std::exception &e)
+		{
+			tfm::printf("Failed to upload %s: %s\n", file, e.what());
+		}
+
+		jobs.SetState(indexes[index], JobTable::FAILED);
+		ret = EXIT_FAILURE;
+	});
 
-// Global: config
+	return ret;
+}
+
+// Function: BenchCiphers
 //
 // Arguments:
-//  N/A
+//  <None>
 //
 // Description:
-// Global pointer of the Config class (see Config.h)
-// that allows all classes and applications to access
-// the config values parsed by this class.
-Config *config;
+// Prints how fast each cipher is on this machine and caches
+// the fastest for when the config says cipher=bench.
+static int BenchCiphers()
+{
+	CPUFeatures features = DetectCPUFeatures();
+	tfm::printf("CPU features: %s\n", features.ToString());
+
+	CipherBenchmark bench = BenchmarkCiphers();
+	tfm::printf("AES-128-GCM:       %8.1f MB/s\n", bench.aesgcm);
+	tfm::printf("ChaCha20-Poly1305: %8.1f MB/s\n", bench.chacha20);
+
+	CipherPreference fastest = bench.Fastest();
+	tfm::printf("Fastest is %s%s\n", CipherName(fastest), fastest == features.Suggested() ? "" : " (not what the CPU's features suggested)");
+	SaveCipherPreference(fastest);
+	return EXIT_SUCCESS;
+}
+
+// Function: UploadFiles
+//
+// Arguments:
+//  files - files given on the command line.
+//  args  - the command line options.
+//
+// Description:
+// Uploads the files on the command line first, then the manifest's
+// a batch at a time, returns EXIT_FAILURE if any of them failed.
+static int UploadFiles(std::vector<std::string> &files, std::map<std::string, std::string> &args)
+{
+	int ret = EXIT_SUCCESS;
+	try
+	{
+		if (!args["journal"].empty())
+		{
+			journal = new Journal(args["journal"]);
+			// Without anything else to do pick up where the last run stopped.
+			if (files.empty() && args["from-file"].empty())
+				files = journal->Unfinished();
+		}
+
+		JobTable jobs;
+		for (auto const &file : files)
+			jobs.Add(file.c_str(), file.size());
+		ret = RunJobs(jobs);
+
+		if (!args["from-file"].empty())
+		{
+			Manifest manifest(args["from-file"]);
+			for (;;)
+			{
+				jobs.Clear();
+				if (!manifest.Fill(jobs, ManifestBatch))
+					break;
+				if (RunJobs(jobs) != EXIT_SUCCESS)
+					ret = EXIT_FAILURE;
+			}
+		}
+	}
+	catch (const IOException &e)
+	{
+		tfm::printf("%s\n", e.what());
+		ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
 
 // Function: main
 //
@@ -54,46 +195,99 @@ Config *config;
 int main(int argc, char **argv)
 {
 	// Start with parsing the command line.
-	auto args = ProcessArgs(argc, argv);
+	std::vector<std::string> files;
+	auto args = ProcessArgs(argc, argv, files);
+
+	if (!args["bench-ciphers"].empty())
+		return BenchCiphers();
+
+	// A client only passes the files along, the daemon has the config.
+	if (!args["connect"].empty())
+		return RunClient(args["connect"], files);
+
+	// Use the snapshot of the config if there's an up to date one.
+	Snapshot *snapshot = nullptr;
+	if (!args["snapshot"].empty())
+		snapshot = new Snapshot(args["snapshot"], args["config"]);
 
 	// Parse the config and set it's global.
 	try
 	{
-		Config conf(args["config"]);
-		config = &conf;
+		config = snapshot ? snapshot->LoadConfig() : nullptr;
+		if (!config)
+			config = new Config(args["config"]);
 	}
 	catch (const ConfigException &e)
 	{
 		tfm::printf("There was a problem reading the config file %s:\n%s\n", args["config"], e.what());
+		delete snapshot;
 		return EXIT_FAILURE;
 	}
 
-	tfm::printf("Using uploader %s to connect to %s\n", config->uploader, config->uploadurl);
+	if (snapshot)
+	{
+		snapshot->Record(config);
+		snapshot->Prime();
+	}
 
-	auto url = DecodeURL(config->uploadurl);
-	if (url["protocol"] == "https")
+	// Command line options override the config.
+	if (!args["io"].empty())
+		config->iobackend = args["io"];
+	if (!args["jobs"].empty())
+		config->jobs = std::max(atoi(args["jobs"].c_str()), 1);
+	if (!args["autotune"].empty())
+		config->autotune = true;
+	if (!args["max-memory"].empty())
 	{
-		// Connect to https server.
-		try
+		config->maxmemory = ParseSize(args["max-memory"].c_str());
+		if (config->maxmemory < 0)
 		{
-			SecureConnectionSocket sock(url["hostname"], "443");
-			// Okay! we're ready to start sending data :D
-
-
+			tfm::printf("--max-memory must be a size in bytes (optionally K, M or G), not '%s'\n", args["max-memory"]);
+			delete snapshot;
+			delete config;
+			return EXIT_FAILURE;
+		}
+	}
+	// Checked before anything's started that would need shutting down.
+	if (!config->url.IsScheme("https"))
+	{
+		tfm::printf("Sorry, %s is an unsupported protocol right now.\n", config->url.scheme);
+		delete snapshot;
+		delete config;
+		return EXIT_FAILURE;
+	}
 
+	if (!args["trace"].empty())
+		StartTrace(args["trace"]);
+	InitUploader(config);
 
+	tfm::printf("Using uploader %s to connect to %s\n", config->uploader, config->uploadurl);
 
+	int ret = EXIT_SUCCESS;
+	if (!args["daemon"].empty())
+		ret = RunDaemon(args["daemon"]);
+	else
+		ret = UploadFiles(files, args);
 
+	ShutdownUploader();
+	delete journal;
 
-		} catch (const SocketException &e)
+	// Save the addresses and session we ended up with for next time.
+	if (snapshot)
+	{
+		try
 		{
-			tfm::printf("There was a problem trying to connect to %s: \n%s\n", config->uploadurl, e.what());
-			return EXIT_FAILURE;
+			snapshot->Save();
 		}
+		catch (const ConfigException &e)
+		{
+			tfm::printf("%s\n", e.what());
+		}
+		delete snapshot;
 	}
-	else
-		tfm::printf("Sorry, %s is an unsupported protocol right now.\n", url["protocol"]);
 
-	// Exit the application successfully.
-	return EXIT_SUCCESS;
+	delete config;
+
+	// Exit the application.
+	return ret;
 }
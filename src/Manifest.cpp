@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include "Manifest.h"
+#include "Exceptions.h"
+
+// Size of the read buffer, the longest path in the manifest must fit.
+static const size_t BufferSize = 64 * 1024;
+
+// Constructor: Manifest
+//
+// Arguments:
+//  file - manifest to read, "-" for standard input.
+//
+// Description:
+// Opens the manifest.
+Manifest::Manifest(const std::string &file) : file(file), fd(-1), buffer(BufferSize), start(0), end(0), eof(false), separator('\n'), detected(false)
+{
+	this->fd = file == "-" ? STDIN_FILENO : ::open(file.c_str(), O_RDONLY);
+	if (this->fd < 0)
+		throw IOException("Cannot open manifest %s: %s", file, strerror(errno));
+
+	posix_fadvise(this->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+// Destructor: Manifest
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Closes the manifest.
+Manifest::~Manifest()
+{
+	if (this->fd != STDIN_FILENO)
+		::close(this->fd);
+}
+
+// Function: ReadMore
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Moves the unparsed data to the front of the buffer and fills
+// the rest from the manifest, returns false at the end of it.
+bool Manifest::ReadMore()
+{
+	if (this->eof)
+		return false;
+
+	memmove(this->buffer.data(), this->buffer.data() + this->start, this->end - this->start);
+	this->end -= this->start;
+	this->start = 0;
+
+	if (this->end == this->buffer.size())
+		throw IOException("Manifest %s has a path longer than %d bytes", this->file, this->buffer.size());
+
+	ssize_t len;
+	do
+		len = ::read(this->fd, this->buffer.data() + this->end, this->buffer.size() - this->end);
+	while (len < 0 && errno == EINTR);
+
+	if (len < 0)
+		throw IOException("Cannot read manifest %s: %s", this->file, strerror(errno));
+
+	if (len == 0)
+	{
+		this->eof = true;
+		return false;
+	}
+
+	// The first block with a separator in it tells us which one it is.
+	// Pipes can hand us a path a bit at a time, so a block without
+	// either doesn't decide anything.
+	if (!this->detected)
+	{
+		if (memchr(this->buffer.data(), 0, this->end + len))
+		{
+			this->separator = '\0';
+			this->detected = true;
+		}
+		else if (memchr(this->buffer.data(), '\n', this->end + len))
+			this->detected = true;
+	}
+
+	this->end += len;
+	return true;
+}
+
+// Function: Fill
+//
+// Arguments:
+//  jobs - table to add the files to.
+//  max  - most jobs the table should hold.
+//
+// Description:
+// Adds files from the manifest to the table until it holds max jobs or the
+// manifest runs out. Returns false if the manifest had nothing left to add.
+bool Manifest::Fill(JobTable &jobs, size_t max)
+{
+	bool added = false;
+
+	while (jobs.Size() < max)
+	{
+		const char *base = this->buffer.data();
+		const char *sep = !this->detected ? nullptr :
+			static_cast<const char*>(memchr(base + this->start, this->separator, this->end - this->start));
+		size_t pathend;
+
+		if (this->start < this->end && sep)
+			pathend = sep - base;
+		else if (this->ReadMore())
+			continue;
+		else if (this->start < this->end)
+			pathend = this->end; // The last path doesn't need a separator.
+		else
+			break;
+
+		size_t len = pathend - this->start;
+		// Tolerate manifests with DOS line endings.
+		if (this->separator == '\n' && len > 0 && base[this->start + len - 1] == '\r')
+			--len;
+
+		if (len > 0)
+		{
+			jobs.Add(base + this->start, len);
+			added = true;
+		}
+
+		this->start = std::min(pathend + 1, this->end);
+	}
+
+	return added;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "MemoryBudget.h"
+
+// Global: memorybudget
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// The budget every upload buffer in the process draws from,
+// it's limit is set from the maxmemory config option.
+MemoryBudget memorybudget;
+
+// Constructor: MemoryBudget
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Starts out unlimited.
+MemoryBudget::MemoryBudget() : limit(0), used(0)
+{
+}
+
+// Function: SetLimit
+//
+// Arguments:
+//  limit - most bytes that can be held at once, 0 for no limit.
+//
+// Description:
+// Changes the limit, waking anyone the new one has room for.
+void MemoryBudget::SetLimit(size_t limit)
+{
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->limit = limit;
+	}
+	this->cv.notify_all();
+}
+
+// Function: Acquire
+//
+// Arguments:
+//  bytes - size of the buffer about to be allocated.
+//
+// Description:
+// Takes the bytes from the budget, waiting for them to be released
+// if there isn't enough left. A request larger than the whole budget
+// is let through once nothing else is held so it can't wait forever.
+void MemoryBudget::Acquire(size_t bytes)
+{
+	std::unique_lock<std::mutex> guard(this->lock);
+	this->cv.wait(guard, [&]()
+	{
+		return !this->limit || !this->used || this->used + bytes <= this->limit;
+	});
+	this->used += bytes;
+}
+
+// Function: TryAcquire
+//
+// Arguments:
+//  bytes - size of the buffer about to be allocated.
+//
+// Description:
+// Acquire() for callers that can't block (see EventLoop::AcquireMemory)
+// returns false instead of waiting when there isn't enough left.
+bool MemoryBudget::TryAcquire(size_t bytes)
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+	if (this->limit && this->used && this->used + bytes > this->limit)
+		return false;
+	this->used += bytes;
+	return true;
+}
+
+// Function: Release
+//
+// Arguments:
+//  bytes - size of the buffer that was freed.
+//
+// Description:
+// Gives the bytes back to the budget.
+void MemoryBudget::Release(size_t bytes)
+{
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->used -= bytes;
+	}
+	this->cv.notify_all();
+}
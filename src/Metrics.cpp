@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <typeinfo>
+#include "Metrics.h"
+#include "Exceptions.h"
+#include "tinyformat.h"
+
+// Global: metrics
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Everything the process counts, see Metrics.h.
+Metrics metrics;
+
+// Bucket boundaries (in seconds) of the exported histograms, and the
+// percentiles exported alongside them straight from the HDR histogram.
+static const double ExportBuckets[] = { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300 };
+static const double ExportQuantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// Names failures are exported under, in the order of Metrics::Failure.
+static const char *FailureNames[] = { "SocketException", "IOException", "UploadException", "ConfigException", "other" };
+
+// Constructor: Histogram
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Starts out empty.
+Histogram::Histogram() : count(0), sum(0)
+{
+	for (auto &c : this->counts)
+		c.store(0, std::memory_order_relaxed);
+}
+
+// Function: BucketIndex
+//
+// Arguments:
+//  usec - the value.
+//
+// Description:
+// Returns the bucket the value is counted in, the last one
+// for anything too big for the histogram.
+size_t Histogram::BucketIndex(uint64_t usec)
+{
+	if (usec < SubBuckets)
+		return usec;
+
+	// Keep the top SubBits bits of the value.
+	int shift = (63 - __builtin_clzll(usec)) - (SubBits - 1);
+	size_t index = SubBuckets + (shift - 1) * HalfBuckets + ((usec >> shift) - HalfBuckets);
+	return std::min(index, Buckets - 1);
+}
+
+// Function: BucketEnd
+//
+// Arguments:
+//  index - the bucket.
+//
+// Description:
+// Returns the smallest value that's past the bucket.
+uint64_t Histogram::BucketEnd(size_t index)
+{
+	if (index < SubBuckets)
+		return index + 1;
+
+	int shift = (index - SubBuckets) / HalfBuckets + 1;
+	uint64_t sub = (index - SubBuckets) % HalfBuckets + HalfBuckets;
+	return (sub + 1) << shift;
+}
+
+// Function: Record
+//
+// Arguments:
+//  usec - how long something took.
+//
+// Description:
+// Counts the value, safe to call from any thread.
+void Histogram::Record(uint64_t usec)
+{
+	this->counts[BucketIndex(usec)].fetch_add(1, std::memory_order_relaxed);
+	this->count.fetch_add(1, std::memory_order_relaxed);
+	this->sum.fetch_add(usec, std::memory_order_relaxed);
+}
+
+// Function: CountBelow
+//
+// Arguments:
+//  usec - the limit.
+//
+// Description:
+// Returns how many values were at most the limit, to within a bucket.
+uint64_t Histogram::CountBelow(uint64_t usec) const
+{
+	uint64_t below = 0;
+	for (size_t i = 0; i < Buckets && BucketEnd(i) <= usec + 1; ++i)
+		below += this->counts[i].load(std::memory_order_relaxed);
+	return below;
+}
+
+// Function: Percentile
+//
+// Arguments:
+//  percent - which percentile, 0 to 1.
+//
+// Description:
+// Returns the highest value that's in the same bucket as the
+// percentile, or 0 if nothing was recorded.
+uint64_t Histogram::Percentile(double percent) const
+{
+	uint64_t total = this->GetCount();
+	if (total == 0)
+		return 0;
+
+	uint64_t wanted = std::max<uint64_t>(percent * total + 0.5, 1), seen = 0;
+	for (size_t i = 0; i < Buckets; ++i)
+	{
+		seen += this->counts[i].load(std::memory_order_relaxed);
+		if (seen >= wanted)
+			return BucketEnd(i) - 1;
+	}
+	return BucketEnd(Buckets - 1) - 1;
+}
+
+// Constructor: Metrics
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Everything starts at zero and nothing is written until Start().
+Metrics::Metrics() : bytessent(0), uploads(0), fullhandshakes(0), resumedhandshakes(0), retries(0), hedges(0), coalesced(0),
+	interval(0), stopping(false)
+{
+	for (auto &f : this->failures)
+		f.store(0, std::memory_order_relaxed);
+}
+
+// Destructor: Metrics
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Stops the writer if Stop() wasn't called.
+Metrics::~Metrics()
+{
+	this->Stop();
+}
+
+// Function: CountFailure
+//
+// Arguments:
+//  error - what the upload failed with.
+//
+// Description:
+// Counts a failed upload under the class of it's exception.
+void Metrics::CountFailure(std::exception_ptr error)
+{
+	Failure failure = OTHER;
+	try
+	{
+		std::rethrow_exception(error);
+	}
+	catch (const SocketException &)
+	{
+		failure = SOCKET;
+	}
+	catch (const IOException &)
+	{
+		failure = IO;
+	}
+	catch (const UploadException &)
+	{
+		failure = UPLOAD;
+	}
+	catch (const ConfigException &)
+	{
+		failure = CONFIG;
+	}
+	catch (...)
+	{
+	}
+
+	this->failures[failure].fetch_add(1, std::memory_order_relaxed);
+}
+
+// Function: CountHandshake
+//
+// Arguments:
+//  start   - when the handshake started.
+//  resumed - whether a session was resumed.
+//
+// Description:
+// Counts a finished TLS handshake.
+void Metrics::CountHandshake(std::chrono::steady_clock::time_point start, bool resumed)
+{
+	this->handshake.Record(SinceMicroseconds(start));
+	(resumed ? this->resumedhandshakes : this->fullhandshakes).fetch_add(1, std::memory_order_relaxed);
+}
+
+// Function: Format
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Returns every metric in Prometheus' text exposition format.
+std::string Metrics::Format()
+{
+	auto get = [](const std::atomic<uint64_t> &value) { return value.load(std::memory_order_relaxed); };
+
+	std::string out;
+	out += "# HELP kittehuplodah_bytes_sent_total Bytes of requests sent, before encryption.\n";
+	out += "# TYPE kittehuplodah_bytes_sent_total counter\n";
+	out += tfm::format("kittehuplodah_bytes_sent_total %d\n", get(this->bytessent));
+
+	out += "# HELP kittehuplodah_uploads_total Finished uploads by result, failures by exception class.\n";
+	out += "# TYPE kittehuplodah_uploads_total counter\n";
+	out += tfm::format("kittehuplodah_uploads_total{result=\"ok\"} %d\n", get(this->uploads));
+	for (int i = 0; i < FAILURES; ++i)
+		out += tfm::format("kittehuplodah_uploads_total{result=\"failed\",error=\"%s\"} %d\n", FailureNames[i], get(this->failures[i]));
+
+	out += "# HELP kittehuplodah_handshakes_total TLS handshakes by whether a session was resumed.\n";
+	out += "# TYPE kittehuplodah_handshakes_total counter\n";
+	out += tfm::format("kittehuplodah_handshakes_total{type=\"full\"} %d\n", get(this->fullhandshakes));
+	out += tfm::format("kittehuplodah_handshakes_total{type=\"resumed\"} %d\n", get(this->resumedhandshakes));
+
+	out += "# HELP kittehuplodah_retries_total Uploads retried over a new connection after the kept one was closed.\n";
+	out += "# TYPE kittehuplodah_retries_total counter\n";
+	out += tfm::format("kittehuplodah_retries_total %d\n", get(this->retries));
+
+	out += "# HELP kittehuplodah_hedges_total Uploads sent again over a second connection.\n";
+	out += "# TYPE kittehuplodah_hedges_total counter\n";
+	out += tfm::format("kittehuplodah_hedges_total %d\n", get(this->hedges));
+
+	out += "# HELP kittehuplodah_coalesced_total Uploads that got the link of an identical upload in flight instead of being sent.\n";
+	out += "# TYPE kittehuplodah_coalesced_total counter\n";
+	out += tfm::format("kittehuplodah_coalesced_total %d\n", get(this->coalesced));
+
+	const std::pair<const char*, const Histogram*> phases[] = { { "handshake", &this->handshake }, { "ttfb", &this->ttfb }, { "total", &this->total } };
+
+	out += "# HELP kittehuplodah_latency_seconds Latency of TLS handshakes, time to first response byte and whole uploads.\n";
+	out += "# TYPE kittehuplodah_latency_seconds histogram\n";
+	for (auto const &phase : phases)
+	{
+		// Read the count first so the buckets are never behind it.
+		uint64_t count = phase.second->GetCount();
+		for (double le : ExportBuckets)
+			out += tfm::format("kittehuplodah_latency_seconds_bucket{phase=\"%s\",le=\"%g\"} %d\n", phase.first, le,
+				std::min(phase.second->CountBelow(le * 1000000), count));
+		out += tfm::format("kittehuplodah_latency_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %d\n", phase.first, count);
+		out += tfm::format("kittehuplodah_latency_seconds_sum{phase=\"%s\"} %.6f\n", phase.first, phase.second->GetSum() / 1e6);
+		out += tfm::format("kittehuplodah_latency_seconds_count{phase=\"%s\"} %d\n", phase.first, count);
+	}
+
+	out += "# HELP kittehuplodah_latency_quantile_seconds Percentiles of the latencies since the uploader started.\n";
+	out += "# TYPE kittehuplodah_latency_quantile_seconds gauge\n";
+	for (auto const &phase : phases)
+		for (double q : ExportQuantiles)
+			out += tfm::format("kittehuplodah_latency_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %.6f\n", phase.first, q,
+				phase.second->Percentile(q) / 1e6);
+
+	return out;
+}
+
+// Function: Write
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Writes the metrics to a temporary file next to the metrics file and
+// renames it over it, so the collector never reads half a file.
+void Metrics::Write()
+{
+	std::string text = this->Format();
+	std::string tmp = this->file + ".tmp";
+
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (!f)
+		throw IOException("Cannot write metrics to %s: %s", tmp, strerror(errno));
+
+	bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), this->file.c_str()) != 0)
+	{
+		int err = errno;
+		remove(tmp.c_str());
+		throw IOException("Cannot write metrics to %s: %s", this->file, strerror(err));
+	}
+}
+
+// Function: Start
+//
+// Arguments:
+//  file     - where to write the metrics, which should end
+//             in .prom for node_exporter to pick it up.
+//  interval - seconds between writes.
+//
+// Description:
+// Starts writing the metrics periodically on a thread of it's own.
+void Metrics::Start(const std::string &file, long interval)
+{
+	this->Stop();
+	this->file = file;
+	this->interval = std::chrono::seconds(std::max(interval, 1L));
+	this->stopping = false;
+
+	this->writer = std::thread([this]()
+	{
+		bool failing = false;
+		std::unique_lock<std::mutex> guard(this->lock);
+		while (!this->cv.wait_for(guard, this->interval, [this]() { return this->stopping; }))
+		{
+			guard.unlock();
+			try
+			{
+				this->Write();
+				failing = false;
+			}
+			catch (const IOException &e)
+			{
+				// Only complain when it starts failing, not every interval.
+				if (!failing)
+					tfm::printf("%s\n", e.what());
+				failing = true;
+			}
+			guard.lock();
+		}
+	});
+}
+
+// Function: Stop
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Stops the writer and writes the metrics one last time,
+// so short runs are recorded too. Does nothing if it wasn't started.
+void Metrics::Stop()
+{
+	if (!this->writer.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->stopping = true;
+	}
+	this->cv.notify_all();
+	this->writer.join();
+
+	try
+	{
+		this->Write();
+	}
+	catch (const IOException &e)
+	{
+		tfm::printf("%s\n", e.what());
+	}
+}
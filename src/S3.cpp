@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include "S3.h"
+#include "Autotuner.h"
+#include "Config.h"
+#include "Exceptions.h"
+#include "MemoryBudget.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Util.h"
+#include "sysconf.h"
+
+// How much of the body is signed at a time. Every chunk but
+// the last has to be at least 8 KiB.
+static const size_t SignedChunkSize = 64 * 1024;
+
+static const char StreamingPayload[] = "STREAMING-AWS4-HMAC-SHA256-PAYLOAD";
+// SHA-256 of nothing, which the signature of every chunk includes.
+static const char EmptyHash[] = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+
+// Function: SHA256Hex
+//
+// Arguments:
+//  data - what to hash.
+//  len  - how much of it there is.
+//
+// Description:
+// Returns the SHA-256 of the data in hex.
+static std::string SHA256Hex(const void *data, size_t len)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen;
+	if (EVP_Digest(data, len, md, &mdlen, EVP_sha256(), nullptr) != 1)
+		throw UploadException("Cannot hash the request");
+	return ToHex(md, mdlen);
+}
+
+// Function: HMACSHA256
+//
+// Arguments:
+//  key    - the key.
+//  keylen - length of the key.
+//  msg    - what to sign.
+//  out    - 32 bytes where the MAC goes.
+//
+// Description:
+// The HMAC-SHA256 that every step of a signature is made with.
+static void HMACSHA256(const void *key, size_t keylen, const std::string &msg, unsigned char *out)
+{
+	unsigned int len;
+	if (!HMAC(EVP_sha256(), key, keylen, reinterpret_cast<const unsigned char*>(msg.data()), msg.size(), out, &len))
+		throw UploadException("Cannot sign the request");
+}
+
+// Function: URIEncode
+//
+// Arguments:
+//  str   - what to encode.
+//  slash - whether slashes are left alone (for paths).
+//
+// Description:
+// Percent encodes everything but the unreserved characters, the
+// way SigV4 wants paths and query strings to be canonicalized.
+static std::string URIEncode(const std::string &str, bool slash)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	std::string out;
+	for (unsigned char c : str)
+	{
+		if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (slash && c == '/'))
+			out += c;
+		else
+		{
+			out += '%';
+			out += digits[c >> 4];
+			out += digits[c & 0xf];
+		}
+	}
+	return out;
+}
+
+// Function: ChunkedLength
+//
+// Arguments:
+//  len - length of the body.
+//
+// Description:
+// Returns how long the body is once it's been split into signed chunks
+// (see SendChunked), which is what the Content-Length has to be.
+static off_t ChunkedLength(off_t len)
+{
+	auto chunk = [](off_t n)
+	{
+		// hex size + ";chunk-signature=" + signature + CRLF + data + CRLF
+		return off_t(tfm::format("%x", n).size() + 17 + 64 + 2 + n + 2);
+	};
+
+	off_t full = len / SignedChunkSize, rest = len % SignedChunkSize;
+	return full * chunk(SignedChunkSize) + (rest ? chunk(rest) : 0) + chunk(0);
+}
+
+// Function: FindXML
+//
+// Arguments:
+//  body - XML response.
+//  tag  - element to look for.
+//
+// Description:
+// Returns the text of the first element with the tag,
+// or an empty string if there isn't one.
+static std::string FindXML(const std::string &body, const std::string &tag)
+{
+	size_t start = body.find("<" + tag + ">");
+	if (start == std::string::npos)
+		return "";
+	start += tag.size() + 2;
+	size_t end = body.find("</" + tag + ">", start);
+	if (end == std::string::npos)
+		return "";
+	return body.substr(start, end - start);
+}
+
+// Constructor: S3Upload
+//
+// Arguments:
+//  source - what to upload.
+//
+// Description:
+// Opens the source (see Upload) and works out where the object goes,
+// which is the uploader's prefix followed by the name.
+S3Upload::S3Upload(const UploadSource &source) : Upload(source)
+{
+	std::string base(config->url.path);
+	while (!base.empty() && base.back() == '/')
+		base.pop_back();
+	this->path = base + "/" + URIEncode(config->bucket, false) + "/" + URIEncode(config->prefix + this->name, true);
+}
+
+// Function: S3Signing
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Signs for now, deriving the key for today from the secret key.
+S3Signing::S3Signing()
+{
+	time_t now = time(nullptr);
+	struct tm tm;
+	gmtime_r(&now, &tm);
+	char date[32];
+	strftime(date, sizeof(date), "%Y%m%dT%H%M%SZ", &tm);
+	this->amzdate = date;
+	std::string day = this->amzdate.substr(0, 8);
+	this->scope = day + "/" + config->region + "/s3/aws4_request";
+
+	std::string secret = "AWS4" + config->secretkey;
+	HMACSHA256(secret.data(), secret.size(), day, this->key);
+	HMACSHA256(this->key, sizeof(this->key), config->region, this->key);
+	HMACSHA256(this->key, sizeof(this->key), "s3", this->key);
+	HMACSHA256(this->key, sizeof(this->key), "aws4_request", this->key);
+}
+
+// Function: Sign
+//
+// Arguments:
+//  signing     - what to sign with.
+//  method      - request method.
+//  query       - canonical query string (sorted and encoded).
+//  headers     - headers to sign (lower case names), the date and
+//                authorization headers are added to them.
+//  payloadhash - SHA-256 of the body, or the streaming marker.
+//
+// Description:
+// Signs the request with SigV4 and returns the signature, which is
+// also the seed of a streamed body's chunk signatures.
+std::string S3Upload::Sign(const S3Signing &signing, const char *method, const std::string &query,
+	std::vector<std::pair<std::string, std::string>> &headers, const std::string &payloadhash)
+{
+	headers.emplace_back("host", std::string(config->url.authority));
+	headers.emplace_back("x-amz-content-sha256", payloadhash);
+	headers.emplace_back("x-amz-date", signing.amzdate);
+	std::sort(headers.begin(), headers.end());
+
+	std::string canonical = std::string(method) + "\n" + this->path + "\n" + query + "\n", signedheaders;
+	for (auto const &h : headers)
+	{
+		canonical += h.first + ":" + h.second + "\n";
+		signedheaders += (signedheaders.empty() ? "" : ";") + h.first;
+	}
+	canonical += "\n" + signedheaders + "\n" + payloadhash;
+
+	std::string tosign = "AWS4-HMAC-SHA256\n" + signing.amzdate + "\n" + signing.scope + "\n" + SHA256Hex(canonical.data(), canonical.size());
+	unsigned char mac[32];
+	HMACSHA256(signing.key, sizeof(signing.key), tosign, mac);
+	std::string signature = ToHex(mac, sizeof(mac));
+
+	headers.emplace_back("authorization", "AWS4-HMAC-SHA256 Credential=" + config->accesskey + "/" + signing.scope +
+		", SignedHeaders=" + signedheaders + ", Signature=" + signature);
+	return signature;
+}
+
+// Function: Exchange
+//
+// Arguments:
+//  conn     - connection to use, made if it's null and deleted (and
+//             set to null) if it can't be used again.
+//  io       - IO backend for a new connection, or null to block.
+//  send     - sends the request.
+//  response - set to the response.
+//
+// Description:
+// Sends a request and reads the response, retrying once over a new
+// connection if a kept one turns out to have been closed (see Upload::Run).
+void S3Upload::Exchange(SecureConnectionSocket *&conn, IOBackend *io, const std::function<void(SecureConnectionSocket&)> &send,
+	ArenaString &response)
+{
+	const URL &url = config->url;
+	for (bool retry = true; ; retry = false)
+	{
+		bool reused = conn != nullptr;
+		try
+		{
+			if (!conn)
+			{
+				conn = new SecureConnectionSocket(std::string(url.host), std::string(url.GetPort()));
+				conn->SetIOBackend(io);
+				conn->Connect();
+			}
+
+			send(*conn);
+			conn->Flush();
+			if (!ReadResponse(*conn, response, std::chrono::steady_clock::now()))
+			{
+				delete conn;
+				conn = nullptr;
+			}
+			return;
+		}
+		catch (const SocketException &)
+		{
+			delete conn;
+			conn = nullptr;
+			if (reused && retry && response.empty())
+			{
+				metrics.retries.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+			throw;
+		}
+		catch (...)
+		{
+			delete conn;
+			conn = nullptr;
+			throw;
+		}
+	}
+}
+
+// Function: Request
+//
+// Arguments:
+//  conn     - connection to use (see Exchange).
+//  io       - IO backend for a new connection, or null to block.
+//  method   - request method.
+//  query    - canonical query string.
+//  body     - the request's body.
+//
+// Description:
+// Makes one of the small requests around a multipart upload and
+// returns the response body, throws if it wasn't successful.
+std::string S3Upload::Request(SecureConnectionSocket *&conn, IOBackend *io, const char *method, const std::string &query,
+	const std::string &body)
+{
+	std::vector<std::pair<std::string, std::string>> headers;
+	headers.emplace_back("content-length", std::to_string(body.size()));
+	this->Sign(S3Signing(), method, query, headers, SHA256Hex(body.data(), body.size()));
+
+	std::string request = tfm::format("%s %s%s%s HTTP/1.1\r\n", method, this->path, query.empty() ? "" : "?", query);
+	for (auto const &h : headers)
+		request += h.first + ": " + h.second + "\r\n";
+	request += "User-Agent: kittehuplodah/" VERSION "\r\nConnection: keep-alive\r\n\r\n" + body;
+
+	// Runs on the helper threads too, which can't use the upload's arena.
+	Arena arena;
+	ArenaString response(arena), reply(arena);
+	this->Exchange(conn, io, [&](SecureConnectionSocket &sock) { sock.Write(request.data(), request.size()); }, response);
+
+	int status = ParseResponse(response, reply);
+	if (status < 0)
+		throw UploadException("Malformed response from %s", config->url.host);
+	if (status == 429 || status == 503)
+		autotuner.Congested();
+	// Completing an upload can fail after the 200 has been sent.
+	if (status < 200 || status > 299 || reply.find("<Error>") != ArenaString::npos)
+		throw UploadException("%s responded with status %d: %s", config->url.host, status, reply);
+	return std::string(reply.data(), reply.size());
+}
+
+// Function: SendChunked
+//
+// Arguments:
+//  sock    - connection to send over.
+//  signing - what the request's headers were signed with.
+//  seed    - signature of the request's headers.
+//  offset  - where in the source the body starts.
+//  len     - length of the body.
+//
+// Description:
+// Sends part of the source as an aws-chunked body, where every chunk
+// is signed with the previous chunk's signature as it's sent.
+void S3Upload::SendChunked(SecureConnectionSocket &sock, const S3Signing &signing, const std::string &seed, off_t offset, off_t len)
+{
+	std::string prefix = "AWS4-HMAC-SHA256-PAYLOAD\n" + signing.amzdate + "\n" + signing.scope + "\n";
+	std::string previous = seed;
+	unsigned char mac[32];
+
+	// Parts go up at the same time, so each reads into it's own buffer.
+	size_t reserved = this->data ? 0 : SignedChunkSize;
+	memorybudget.Acquire(reserved);
+	MemoryReservation reservation(reserved);
+	std::vector<char> buffer(reserved);
+
+	for (off_t done = 0; ; )
+	{
+		size_t n = std::min<off_t>(SignedChunkSize, len - done);
+		const char *chunk = this->data ? this->data + offset + done : buffer.data();
+		if (!this->data)
+		{
+			TraceSpan span("read", sock.GetID(), n);
+			for (size_t got = 0; got < n; )
+			{
+				ssize_t ret = ::pread(this->fd, buffer.data() + got, n - got, offset + done + got);
+				if (ret < 0 && errno == EINTR)
+					continue;
+				if (ret < 0)
+					throw IOException("Cannot read %s: %s", this->file, strerror(errno));
+				if (ret == 0)
+					throw IOException("%s was truncated while reading", this->file);
+				got += ret;
+			}
+		}
+
+		{
+			TraceSpan span("sign", sock.GetID(), n);
+			HMACSHA256(signing.key, sizeof(signing.key), prefix + previous + "\n" + EmptyHash + "\n" + SHA256Hex(chunk, n), mac);
+			previous = ToHex(mac, sizeof(mac));
+		}
+
+		TraceSpan span("write", sock.GetID(), n);
+		std::string head = tfm::format("%x;chunk-signature=%s\r\n", n, previous);
+		sock.Write(head.data(), head.size());
+		if (n == 0)
+		{
+			sock.Write("\r\n", 2);
+			break;
+		}
+		sock.Write(chunk, n);
+		sock.Write("\r\n", 2);
+		sock.Flush();
+		done += n;
+	}
+}
+
+// Function: PutObject
+//
+// Arguments:
+//  conn   - connection to use (see Exchange).
+//  io     - IO backend for a new connection, or null to block.
+//  query  - canonical query string, which says which part it is
+//           for a multipart upload.
+//  offset - where in the source the object (or part) starts.
+//  len    - it's length.
+//
+// Description:
+// PUTs the object or a part of it with a streamed signature
+// and returns it's ETag.
+std::string S3Upload::PutObject(SecureConnectionSocket *&conn, IOBackend *io, const std::string &query, off_t offset, off_t len)
+{
+	std::vector<std::pair<std::string, std::string>> headers;
+	headers.emplace_back("content-encoding", "aws-chunked");
+	headers.emplace_back("content-length", std::to_string(ChunkedLength(len)));
+	headers.emplace_back("x-amz-decoded-content-length", std::to_string(len));
+	S3Signing signing;
+	std::string seed = this->Sign(signing, "PUT", query, headers, StreamingPayload);
+
+	std::string request = tfm::format("PUT %s%s%s HTTP/1.1\r\n", this->path, query.empty() ? "" : "?", query);
+	for (auto const &h : headers)
+		request += h.first + ": " + h.second + "\r\n";
+	request += "User-Agent: kittehuplodah/" VERSION "\r\nConnection: keep-alive\r\n\r\n";
+
+	Arena arena;
+	ArenaString response(arena), body(arena);
+	this->Exchange(conn, io, [&](SecureConnectionSocket &sock)
+	{
+		sock.Write(request.data(), request.size());
+		this->SendChunked(sock, signing, seed, offset, len);
+	}, response);
+
+	int status = ParseResponse(response, body);
+	if (status == 429 || status == 503)
+		autotuner.Congested();
+	if (status < 200 || status > 299)
+		throw UploadException("%s responded with status %d: %s", config->url.host, status, body);
+
+	size_t etag = FindHeader(response, response.find("\r\n\r\n"), "etag:");
+	if (etag == ArenaString::npos)
+		return "";
+	size_t end = response.find("\r\n", etag);
+	while (etag < end && response[etag] == ' ')
+		++etag;
+	return std::string(response, etag, end - etag);
+}
+
+// Function: RunMultipart
+//
+// Arguments:
+//  io   - IO backend to use on this thread.
+//  conn - connection kept between uploads.
+//
+// Description:
+// Starts a multipart upload, sends the parts over up to the uploader's
+// connections count of connections at once (this thread and conn being
+// one of them) and completes it. If any part fails the upload is aborted
+// so the store doesn't keep the parts that made it.
+std::string S3Upload::RunMultipart(IOBackend *io, SecureConnectionSocket *&conn)
+{
+	std::string uploadid = FindXML(this->Request(conn, io, "POST", "uploads=", ""), "UploadId");
+	if (uploadid.empty())
+		throw UploadException("%s did not start a multipart upload", config->url.host);
+	std::string id = "uploadId=" + URIEncode(uploadid, false);
+
+	size_t parts = (this->size + config->partsize - 1) / config->partsize;
+	std::vector<std::string> etags(parts);
+	std::atomic<size_t> next(0);
+	std::atomic<bool> failed(false);
+	std::exception_ptr error;
+	std::mutex lock;
+
+	auto worker = [&](SecureConnectionSocket *&c, IOBackend *wio)
+	{
+		for (size_t i; !failed && (i = next.fetch_add(1)) < parts; )
+		{
+			try
+			{
+				off_t offset = off_t(i) * config->partsize;
+				etags[i] = this->PutObject(c, wio, "partNumber=" + std::to_string(i + 1) + "&" + id, offset,
+					std::min<off_t>(config->partsize, this->size - offset));
+			}
+			catch (const std::exception &)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (!error)
+					error = std::current_exception();
+				failed = true;
+			}
+		}
+	};
+
+	// The other connections block, only this thread has an IO backend.
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < std::min<size_t>(config->connections, parts); ++i)
+	{
+		threads.emplace_back([&]()
+		{
+			SecureConnectionSocket *c = nullptr;
+			worker(c, nullptr);
+			delete c;
+		});
+	}
+	worker(conn, io);
+	for (auto &t : threads)
+		t.join();
+
+	if (error)
+	{
+		try
+		{
+			this->Request(conn, io, "DELETE", id, "");
+		}
+		catch (const BasicException &)
+		{
+			// The store will expire the parts eventually.
+		}
+		std::rethrow_exception(error);
+	}
+
+	std::string complete = "<CompleteMultipartUpload>";
+	for (size_t i = 0; i < parts; ++i)
+		complete += tfm::format("<Part><PartNumber>%d</PartNumber><ETag>%s</ETag></Part>", i + 1, etags[i]);
+	complete += "</CompleteMultipartUpload>";
+
+	this->Request(conn, io, "POST", id, complete);
+	return uploadid;
+}
+
+// Function: Run
+//
+// Arguments:
+//  io   - IO backend used on this thread.
+//  conn - connection to the store kept between uploads (see Upload::Run).
+//
+// Description:
+// Uploads the source as an object, in parts if it's bigger than the
+// uploader's partsize, and returns the object's link.
+std::string S3Upload::Run(IOBackend *io, SecureConnectionSocket *&conn)
+{
+	auto begin = std::chrono::steady_clock::now();
+	TraceSpan span("upload", -1, this->size);
+
+	if (this->size <= config->partsize)
+		this->PutObject(conn, io, "", 0, this->size);
+	else
+		this->RunMultipart(io, conn);
+	metrics.total.Record(SinceMicroseconds(begin));
+
+	std::string object = URIEncode(config->prefix + this->name, true);
+	if (!config->publicurl.empty())
+		return config->publicurl + (config->publicurl.back() == '/' ? "" : "/") + object;
+	return tfm::format("%s://%s%s", config->url.scheme, config->url.authority, this->path);
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <algorithm>
+#include "Scheduler.h"
+#include "Config.h"
+
+// What every request costs on top of the file itself, in bytes. Roughly
+// what can be sent in the round trips a request and it's response take.
+static const off_t RequestCost = 64 * 1024;
+
+// Constructor: Scheduler
+//
+// Arguments:
+//  sizes - size of each job's file, -1 if it isn't known.
+//
+// Description:
+// Nothing is handed out until the jobs are planned.
+Scheduler::Scheduler(const std::vector<off_t> &sizes) : sizes(sizes), next(0)
+{
+}
+
+// Function: GetCost
+//
+// Arguments:
+//  job - index of the job.
+//
+// Description:
+// Estimates how long uploading the file takes in bytes sent.
+off_t Scheduler::GetCost(size_t job) const
+{
+	return std::max<off_t>(this->sizes[job], 0) + RequestCost;
+}
+
+// Function: Plan
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Orders the jobs longest processing time first. Files smaller than
+// the smallfile config option are packed into units costing about as
+// much as the threshold so a unit of them is never what holds the batch
+// up. Files of unknown size are left for the upload to report and
+// count as empty.
+void Scheduler::Plan()
+{
+	this->order.resize(this->sizes.size());
+	for (size_t job = 0; job < this->order.size(); ++job)
+		this->order[job] = job;
+	this->units.clear();
+	this->next = 0;
+
+	std::stable_sort(this->order.begin(), this->order.end(), [this](uint32_t a, uint32_t b)
+	{
+		return this->GetCost(a) > this->GetCost(b);
+	});
+
+	// Large files get a unit each, the (sorted) small files after
+	// them are packed up to the cost of the threshold.
+	off_t threshold = std::max<off_t>(config->smallfile, 0);
+	off_t packed = 0;
+	for (size_t i = 0; i < this->order.size(); ++i)
+	{
+		off_t cost = this->GetCost(this->order[i]);
+		if (cost - RequestCost < threshold && packed > 0 && packed + cost <= threshold + RequestCost)
+		{
+			packed += cost;
+			continue;
+		}
+		this->units.push_back(i);
+		packed = cost - RequestCost < threshold ? cost : 0;
+	}
+	this->units.push_back(this->order.size());
+}
+
+// Function: Next
+//
+// Arguments:
+//  begin - set to the first job of the unit.
+//  end   - set to one past the last job of the unit.
+//
+// Description:
+// Takes the next unit of work, returns false once they've all been
+// handed out. Safe to call from any number of threads.
+bool Scheduler::Next(const uint32_t **begin, const uint32_t **end)
+{
+	size_t unit = this->next++;
+	if (unit + 1 >= this->units.size())
+		return false;
+
+	*begin = this->order.data() + this->units[unit];
+	*end = this->order.data() + this->units[unit + 1];
+	return true;
+}
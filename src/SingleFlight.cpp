@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include "SingleFlight.h"
+#include "Config.h"
+#include "Exceptions.h"
+#include "MemoryBudget.h"
+#include "Util.h"
+
+// How much of a file is hashed at a time.
+static const size_t HashChunkSize = 256 * 1024;
+
+// Function: Do
+//
+// Arguments:
+//  key    - what identifies the upload.
+//  fn     - does the upload and returns it's link.
+//  shared - set to whether the result came from someone else's upload.
+//
+// Description:
+// Runs fn unless an upload with the same key is already in flight, in
+// which case it waits for that one. Returns the link, or throws what
+// the upload threw.
+std::string SingleFlight::Do(const std::string &key, const std::function<std::string()> &fn, bool *shared)
+{
+	std::unique_lock<std::mutex> guard(this->lock);
+	auto it = this->flights.find(key);
+	if (it != this->flights.end())
+	{
+		std::shared_future<std::string> flight = it->second;
+		guard.unlock();
+		if (shared)
+			*shared = true;
+		return flight.get();
+	}
+
+	std::promise<std::string> promise;
+	this->flights.emplace(key, promise.get_future().share());
+	guard.unlock();
+
+	if (shared)
+		*shared = false;
+	try
+	{
+		std::string link = fn();
+		promise.set_value(link);
+		guard.lock();
+		this->flights.erase(key);
+		return link;
+	}
+	catch (...)
+	{
+		promise.set_exception(std::current_exception());
+		guard.lock();
+		this->flights.erase(key);
+		throw;
+	}
+}
+
+// Function: ContentKey
+//
+// Arguments:
+//  source - what's being uploaded.
+//
+// Description:
+// Returns the key identical uploads share: the uploader's name and the
+// SHA-256 of the contents, read with pread so a descriptor's offset is
+// left alone. Throws an UploadException if the source can't be read.
+std::string ContentKey(const UploadSource &source)
+{
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) != 1)
+	{
+		EVP_MD_CTX_free(ctx);
+		throw UploadException("Cannot hash %s", source.name);
+	}
+
+	int fd = source.type == UploadSource::PATH ? ::open(source.name.data(), O_RDONLY | O_CLOEXEC) : source.fd;
+	std::string error;
+	if (source.type == UploadSource::BUFFER)
+	{
+		if (EVP_DigestUpdate(ctx, source.data, source.len) != 1)
+			error = tfm::format("Cannot hash %s", source.name);
+	}
+	else if (fd < 0)
+		error = tfm::format("Cannot open %s: %s", source.name, strerror(errno));
+	else
+	{
+		memorybudget.Acquire(HashChunkSize);
+		MemoryReservation reservation(HashChunkSize);
+		std::vector<char> buf(HashChunkSize);
+		for (off_t offset = 0; error.empty(); )
+		{
+			ssize_t len = ::pread(fd, buf.data(), buf.size(), offset);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0)
+				error = tfm::format("Cannot read %s: %s", source.name, strerror(errno));
+			else if (len == 0)
+				break;
+			else if (EVP_DigestUpdate(ctx, buf.data(), len) != 1)
+				error = tfm::format("Cannot hash %s", source.name);
+			offset += len > 0 ? len : 0;
+		}
+	}
+
+	if (source.type == UploadSource::PATH && fd >= 0)
+		::close(fd);
+
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen = 0;
+	if (error.empty() && EVP_DigestFinal_ex(ctx, md, &mdlen) != 1)
+		error = tfm::format("Cannot hash %s", source.name);
+	EVP_MD_CTX_free(ctx);
+	if (!error.empty())
+		throw UploadException(error);
+
+	return config->uploader + ":" + ToHex(md, mdlen);
+}
@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <type_traits>
+#include "Snapshot.h"
+#include "Exceptions.h"
+#include "Socket.h"
+
+static const char Magic[8] = { 'K', 'I', 'T', 'S', 'N', 'A', 'P', 0 };
+static const uint32_t Version = 1;
+
+// Struct: SnapshotHeader
+//
+// Description:
+// Start of a snapshot file, the offsets are from the start of the file.
+// The config values are stored one after another as
+//  <name length (1 byte)> <name> <value length (4 bytes)> <value>
+// where numbers are stored as 8 byte integers, followed by an
+// array of sockaddr_t and a DER encoded TLS session.
+struct SnapshotHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t headersize;
+	uint64_t size;
+
+	// Identifies the config file the snapshot was made from.
+	uint64_t confdev, confino, confsize;
+	int64_t confmtime;
+
+	// When the addresses stop being valid.
+	int64_t expires;
+
+	uint32_t fieldsoffset, fieldslen;
+	uint32_t addrsoffset, naddrs;
+	uint32_t sessionoffset, sessionlen;
+};
+
+// Function: GetConfigStat
+//
+// Arguments:
+//  file - the config file.
+//  hdr  - header to fill in.
+//
+// Description:
+// Fills in the header fields identifying the config file,
+// returns false if the file can't be stat'd.
+static bool GetConfigStat(const std::string &file, SnapshotHeader &hdr)
+{
+	struct stat st;
+	if (stat(file.c_str(), &st) != 0)
+		return false;
+
+	hdr.confdev = st.st_dev;
+	hdr.confino = st.st_ino;
+	hdr.confsize = st.st_size;
+	hdr.confmtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+	return true;
+}
+
+// Constructor: Snapshot
+//
+// Arguments:
+//  file       - location of the snapshot.
+//  configfile - config file the snapshot is for.
+//
+// Description:
+// Maps the snapshot into memory and checks whether it's still
+// valid. A missing or stale snapshot isn't an error, it just
+// isn't used and gets replaced by Save()
+Snapshot::Snapshot(const std::string &file, const std::string &configfile) : file(file), configfile(configfile), data(nullptr), size(0),
+	current(false), unexpired(false)
+{
+	int fd = ::open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(SnapshotHeader))
+	{
+		void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ptr != MAP_FAILED)
+		{
+			this->data = static_cast<const char*>(ptr);
+			this->size = st.st_size;
+		}
+	}
+	::close(fd);
+
+	if (this->data && !this->Check())
+	{
+		munmap(const_cast<char*>(this->data), this->size);
+		this->data = nullptr;
+	}
+}
+
+// Destructor: Snapshot
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Unmaps the snapshot.
+Snapshot::~Snapshot()
+{
+	if (this->data)
+		munmap(const_cast<char*>(this->data), this->size);
+}
+
+// Function: Check
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Makes sure the mapped snapshot is well formed and works out
+// whether it's config and addresses can still be used.
+bool Snapshot::Check()
+{
+	SnapshotHeader hdr;
+	memcpy(&hdr, this->data, sizeof(hdr));
+
+	if (memcmp(hdr.magic, Magic, sizeof(Magic)) != 0 || hdr.version != Version || hdr.headersize != sizeof(hdr) || hdr.size != this->size)
+		return false;
+
+	auto inside = [&](uint64_t offset, uint64_t len) { return offset <= this->size && len <= this->size - offset; };
+	if (!inside(hdr.fieldsoffset, hdr.fieldslen) || !inside(hdr.addrsoffset, static_cast<uint64_t>(hdr.naddrs) * sizeof(sockaddr_t)) ||
+		!inside(hdr.sessionoffset, hdr.sessionlen))
+		return false;
+
+	SnapshotHeader conf;
+	if (!GetConfigStat(this->configfile, conf))
+		return false;
+
+	this->current = conf.confdev == hdr.confdev && conf.confino == hdr.confino && conf.confsize == hdr.confsize && conf.confmtime == hdr.confmtime;
+	this->unexpired = this->current && hdr.expires > time(nullptr);
+	return this->current;
+}
+
+// Function: LoadConfig
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Builds the config from the snapshot, returns nullptr if the
+// snapshot is stale (or there isn't one) and the config file
+// needs to be parsed instead.
+Config *Snapshot::LoadConfig()
+{
+	if (!this->current)
+		return nullptr;
+
+	SnapshotHeader hdr;
+	memcpy(&hdr, this->data, sizeof(hdr));
+
+	const char *p = this->data + hdr.fieldsoffset, *end = p + hdr.fieldslen;
+	bool ok = true;
+
+	Config *conf = new Config(this->configfile, Config::Unparsed());
+	conf->Fields([&](const char *name, auto &value)
+	{
+		size_t namelen = strlen(name);
+		uint32_t len;
+		if (!ok || static_cast<size_t>(end - p) < 1 + namelen + sizeof(len) || static_cast<uint8_t>(*p) != namelen ||
+			memcmp(p + 1, name, namelen) != 0)
+		{
+			ok = false;
+			return;
+		}
+		p += 1 + namelen;
+		memcpy(&len, p, sizeof(len));
+		p += sizeof(len);
+		if (static_cast<size_t>(end - p) < len)
+		{
+			ok = false;
+			return;
+		}
+
+		typedef typename std::decay<decltype(value)>::type T;
+		if constexpr (std::is_same<T, std::string>::value)
+			value.assign(p, len);
+		else
+		{
+			int64_t num;
+			if (len != sizeof(num))
+			{
+				ok = false;
+				return;
+			}
+			memcpy(&num, p, sizeof(num));
+			value = static_cast<T>(num);
+		}
+		p += len;
+	});
+
+	if (ok && p == end)
+	{
+		try
+		{
+			conf->Validate();
+			return conf;
+		}
+		catch (const ConfigException &)
+		{
+		}
+	}
+
+	delete conf;
+	this->current = this->unexpired = false;
+	return nullptr;
+}
+
+// Function: Record
+//
+// Arguments:
+//  conf - the config to save in the snapshot.
+//
+// Description:
+// Serializes the config values for Save(). This has to be called
+// before anything (eg. the command line) overrides config values.
+void Snapshot::Record(Config *conf)
+{
+	this->fields.clear();
+	conf->Fields([&](const char *name, auto &value)
+	{
+		uint8_t namelen = strlen(name);
+		this->fields.push_back(static_cast<char>(namelen));
+		this->fields.insert(this->fields.end(), name, name + namelen);
+
+		typedef typename std::decay<decltype(value)>::type T;
+		const char *ptr;
+		uint32_t len;
+		int64_t num = 0;
+		if constexpr (std::is_same<T, std::string>::value)
+		{
+			ptr = value.data();
+			len = value.size();
+		}
+		else
+		{
+			num = value;
+			ptr = reinterpret_cast<const char*>(&num);
+			len = sizeof(num);
+		}
+
+		const char *lenptr = reinterpret_cast<const char*>(&len);
+		this->fields.insert(this->fields.end(), lenptr, lenptr + sizeof(len));
+		this->fields.insert(this->fields.end(), ptr, ptr + len);
+	});
+
+	this->host = std::string(conf->url.host);
+	this->port = std::string(conf->url.GetPort());
+}
+
+// Function: Prime
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Puts the addresses and TLS session from the snapshot into the
+// socket caches so the first connection neither resolves the
+// uploader nor does a full handshake. Call Record() first.
+void Snapshot::Prime()
+{
+	if (!this->unexpired)
+		return;
+
+	SnapshotHeader hdr;
+	memcpy(&hdr, this->data, sizeof(hdr));
+
+	if (hdr.naddrs > 0)
+	{
+		std::vector<sockaddr_t> addrs(hdr.naddrs);
+		memcpy(addrs.data(), this->data + hdr.addrsoffset, hdr.naddrs * sizeof(sockaddr_t));
+		CacheAddresses(this->host, this->port, addrs.data(), addrs.size(), hdr.expires);
+	}
+
+	if (hdr.sessionlen > 0)
+	{
+		const unsigned char *der = reinterpret_cast<const unsigned char*>(this->data + hdr.sessionoffset);
+		SSL_SESSION *session = d2i_SSL_SESSION(nullptr, &der, hdr.sessionlen);
+		if (session)
+		{
+			CacheSession(this->host, this->port, session);
+			SSL_SESSION_free(session);
+		}
+	}
+}
+
+// Function: Save
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Writes the recorded config, along with whatever addresses and TLS
+// session are cached now, to the snapshot. Nothing is written if the
+// snapshot already holds the same thing. The file is replaced
+// atomically so a concurrent run never maps half a snapshot.
+void Snapshot::Save()
+{
+	SnapshotHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	if (!GetConfigStat(this->configfile, hdr))
+		return;
+
+	Arena arena;
+	ArenaVector<sockaddr_t> addrs(arena);
+	time_t expires = 0;
+	GetCachedAddresses(this->host, this->port, addrs, &expires);
+
+	std::vector<unsigned char> session;
+	SSL_SESSION *sess = GetCachedSession(this->host, this->port);
+	if (sess)
+	{
+		int len = i2d_SSL_SESSION(sess, nullptr);
+		if (len > 0)
+		{
+			session.resize(len);
+			unsigned char *ptr = session.data();
+			i2d_SSL_SESSION(sess, &ptr);
+		}
+		SSL_SESSION_free(sess);
+	}
+
+	memcpy(hdr.magic, Magic, sizeof(Magic));
+	hdr.version = Version;
+	hdr.headersize = sizeof(hdr);
+	hdr.expires = expires;
+	hdr.fieldsoffset = sizeof(hdr);
+	hdr.fieldslen = this->fields.size();
+	hdr.addrsoffset = hdr.fieldsoffset + hdr.fieldslen;
+	hdr.naddrs = addrs.size();
+	hdr.sessionoffset = hdr.addrsoffset + hdr.naddrs * sizeof(sockaddr_t);
+	hdr.sessionlen = session.size();
+	hdr.size = hdr.sessionoffset + hdr.sessionlen;
+
+	std::vector<char> buf(hdr.size);
+	memcpy(buf.data(), &hdr, sizeof(hdr));
+	memcpy(buf.data() + hdr.fieldsoffset, this->fields.data(), hdr.fieldslen);
+	if (!addrs.empty())
+		memcpy(buf.data() + hdr.addrsoffset, addrs.data(), hdr.naddrs * sizeof(sockaddr_t));
+	if (!session.empty())
+		memcpy(buf.data() + hdr.sessionoffset, session.data(), hdr.sessionlen);
+
+	if (this->data && this->size == buf.size() && memcmp(this->data, buf.data(), buf.size()) == 0)
+		return;
+
+	// It holds a TLS session, so keep it private.
+	std::string tmp = tfm::format("%s.%d", this->file, getpid());
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		throw ConfigException("Cannot write snapshot %s: %s", tmp, strerror(errno));
+
+	ssize_t written = ::write(fd, buf.data(), buf.size());
+	int err = errno;
+	::close(fd);
+
+	if (written != static_cast<ssize_t>(buf.size()) || ::rename(tmp.c_str(), this->file.c_str()) != 0)
+	{
+		if (written == static_cast<ssize_t>(buf.size()))
+			err = errno;
+		::unlink(tmp.c_str());
+		throw ConfigException("Cannot write snapshot %s: %s", this->file, strerror(err));
+	}
+}
@@ -20,14 +20,44 @@
  * THE SOFTWARE.
  */
 #include "Socket.h"
+#include "Config.h"
 #include "Exceptions.h"
 #include "Util.h"
+#include "TLS.h"
+#include "Metrics.h"
+#include "Trace.h"
 
 // For getaddrinfo
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <ctime>
+#include <map>
+#include <mutex>
+
+// Struct: HostCache
+//
+// Description:
+// Resolved addresses and the last TLS session for a host and
+// port, shared by every connection in the process.
+struct HostCache
+{
+	std::vector<sockaddr_t> addrs;
+	time_t expires = 0;
+	SSL_SESSION *session = nullptr;
+};
+static std::map<std::string, HostCache> hostcache;
+static std::mutex hostcachemtx;
+
+// How long resolved addresses are cached for when there is no config.
+static const time_t DefaultCacheTTL = 300;
 
 // Function: GetAddress
 //
@@ -119,18 +149,119 @@ sockaddr_t GetSockAddr(int type, const std::string &address, int port)
 	return ret;
 }
 
+// Function: GetSockLen
+//
+// Arguments:
+//  s - sockaddr_t structure
+//
+// Description:
+// Gets the length of the address in the structure for connect() and friends.
+socklen_t GetSockLen(const sockaddr_t &s)
+{
+	return s.sa.sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+// Function: CacheAddresses
+//
+// Arguments:
+//  host    - hostname the addresses belong to.
+//  port    - port used (as string)
+//  addrs   - resolved addresses.
+//  count   - number of addresses.
+//  expires - time the addresses stop being valid.
+//
+// Description:
+// Stores addresses for ResolveDNS to use instead of resolving
+// the hostname again.
+void CacheAddresses(const std::string &host, const std::string &port, const sockaddr_t *addrs, size_t count, time_t expires)
+{
+	std::lock_guard<std::mutex> lock(hostcachemtx);
+	HostCache &entry = hostcache[host + ":" + port];
+	entry.addrs.assign(addrs, addrs + count);
+	entry.expires = expires;
+}
+
+// Function: GetCachedAddresses
+//
+// Arguments:
+//  host    - hostname to look up.
+//  port    - port used (as string)
+//  addrs   - the cached addresses are appended to this.
+//  expires - if not null, set to when the addresses expire.
+//
+// Description:
+// Returns true if there are unexpired cached addresses for the host.
+bool GetCachedAddresses(const std::string &host, const std::string &port, ArenaVector<sockaddr_t> &addrs, time_t *expires)
+{
+	std::lock_guard<std::mutex> lock(hostcachemtx);
+	auto it = hostcache.find(host + ":" + port);
+	if (it == hostcache.end() || it->second.addrs.empty() || it->second.expires <= time(nullptr))
+		return false;
+
+	addrs.insert(addrs.end(), it->second.addrs.begin(), it->second.addrs.end());
+	if (expires)
+		*expires = it->second.expires;
+	return true;
+}
+
+// Function: CacheSession
+//
+// Arguments:
+//  host    - hostname the session belongs to.
+//  port    - port used (as string)
+//  session - the TLS session, the cache takes a reference of it's own.
+//
+// Description:
+// Stores a TLS session so the next connection to the host can resume
+// it instead of doing a full handshake.
+void CacheSession(const std::string &host, const std::string &port, SSL_SESSION *session)
+{
+	std::lock_guard<std::mutex> lock(hostcachemtx);
+	HostCache &entry = hostcache[host + ":" + port];
+	if (session)
+		SSL_SESSION_up_ref(session);
+	SSL_SESSION_free(entry.session);
+	entry.session = session;
+}
+
+// Function: GetCachedSession
+//
+// Arguments:
+//  host - hostname to look up.
+//  port - port used (as string)
+//
+// Description:
+// Returns a new reference to the cached TLS session for the host,
+// or nullptr. Free it with SSL_SESSION_free.
+SSL_SESSION *GetCachedSession(const std::string &host, const std::string &port)
+{
+	std::lock_guard<std::mutex> lock(hostcachemtx);
+	auto it = hostcache.find(host + ":" + port);
+	if (it == hostcache.end() || !it->second.session)
+		return nullptr;
+
+	SSL_SESSION_up_ref(it->second.session);
+	return it->second.session;
+}
+
 // Function: ResolveDNS
 //
 // Arguments:
+//  arena   - Arena the results are allocated in.
 //  address - Address to resolve.
 //  port    - port used (as string)
 //
 // Description:
 // Gets a list of IP address structures for the DNS address.
-std::vector<sockaddr_t*> ResolveDNS(const std::string &address, const std::string &port)
+// Results are cached for the config's cachettl.
+ArenaVector<sockaddr_t> ResolveDNS(Arena &arena, const std::string &address, const std::string &port)
 {
-	std::vector<sockaddr_t*> addr;
+	ArenaVector<sockaddr_t> addr(arena);
 	struct addrinfo hints, *result;
+	TraceSpan span("resolve");
+
+	if (GetCachedAddresses(address, port, addr))
+		return addr;
 
 	memset(&hints, 0, sizeof(struct addrinfo));
 	hints.ai_family   = AF_UNSPEC; // allow v4 or v6
@@ -147,52 +278,71 @@ std::vector<sockaddr_t*> ResolveDNS(const std::string &address, const std::strin
 
 	for (struct addrinfo *rp = result; rp != nullptr; rp = rp->ai_next)
 	{
-		sockaddr_t *a = new sockaddr_t;
-		memcpy(&a->sa, rp->ai_addr, sizeof(struct sockaddr));
-		// Push into array with copy of the pointer since we're stack allocated.
+		sockaddr_t a;
+		memset(&a, 0, sizeof(a));
+		memcpy(&a.sa, rp->ai_addr, std::min<size_t>(rp->ai_addrlen, sizeof(a)));
 		addr.push_back(a);
 	}
 
 	freeaddrinfo(result);
 
+	CacheAddresses(address, port, addr.data(), addr.size(), time(nullptr) + (config ? config->cachettl : DefaultCacheTTL));
+
 	return addr;
 }
 
+// Function: GetSSLErrors
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Empties OpenSSL's error queue into a string for exceptions.
+std::string GetSSLErrors()
+{
+	BIO *bio = BIO_new(BIO_s_mem());
+	ERR_print_errors(bio);
+	char *buf = nullptr;
+	size_t len = BIO_get_mem_data(bio, &buf);
+	std::string str(buf ? buf : "", len);
+	BIO_free(bio);
+	return str;
+}
+
+// Function: GetTLSError
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Describes why the connection failed, a rejected certificate
+// tells a lot more than the error queue's "certificate verify failed".
+std::string SecureConnectionSocket::GetTLSError()
+{
+	long result = this->ssl ? SSL_get_verify_result(this->ssl) : X509_V_OK;
+	if (result != X509_V_OK)
+	{
+		ERR_clear_error();
+		return tfm::format("certificate of %s rejected: %s", this->address, X509_verify_cert_error_string(result));
+	}
+	return GetSSLErrors();
+}
+
+// Numbers connections for traces.
+static std::atomic<uint64_t> NextConnectionID(0);
+
 // Constructor: SecureConnectionSocket
 //
 // Arguments:
 //  address - Address to resolve.
 //  port    - port used (as string)
+//  arena   - Arena for temporary allocations (optional)
 //
 // Description:
 // Opens an SSL socket to the specified address and port
-SecureConnectionSocket::SecureConnectionSocket(const std::string &address, const std::string &port) : fd(0), address(address), port(port), ctx(nullptr), ssl(nullptr)
+SecureConnectionSocket::SecureConnectionSocket(const std::string &address, const std::string &port, Arena *arena) : fd(-1), address(address), port(port),
+	addrindex(0), id(NextConnectionID++), arena(arena), ctx(GetTLSContext()), ssl(nullptr), io(nullptr), wbio(nullptr)
 {
-	// Initialize OpenSSL
-    OpenSSL_add_all_algorithms();                      /* Load cryptos, et.al. */
-    SSL_load_error_strings();                          /* Bring in and register error messages */
-    const SSL_METHOD *method = SSLv23_client_method(); /* Create new client-method instance */
-    this->ctx = SSL_CTX_new(method);                   /* Create new context */
-    if (ctx == nullptr)
-    {
-		// Use a lambda expression because OpenSSL is dumb.
-        std::string error = []() -> std::string
-		{
-			BIO *bio = BIO_new (BIO_s_mem ());
-			ERR_print_errors (bio);
-			char *buf = NULL;
-			size_t len = BIO_get_mem_data (bio, &buf);
-			char *ret = (char *)calloc (1, 1 + len);
-			if (ret) memcpy (ret, buf, len);
-			BIO_free (bio);
-			std::string str = ret;
-			free(ret);
-			return str;
-		}();
-
-        throw SocketException("OpenSSL Error: %s", error);
-    }
-
 }
 
 // Destructor: SecureConnectionSocket
@@ -204,33 +354,105 @@ SecureConnectionSocket::SecureConnectionSocket(const std::string &address, const
 // Closes SSL contexts, free's memory, and closes socket.
 SecureConnectionSocket::~SecureConnectionSocket()
 {
-	SSL_free(this->ssl);
+	// Keep the session around if it can be resumed by the next connection.
+	if (this->ssl)
+	{
+		// Without a proper shutdown OpenSSL won't resume the session.
+		bool clean = SSL_is_init_finished(this->ssl) && SSL_shutdown(this->ssl) >= 0;
+		if (clean && this->wbio)
+		{
+			this->DrainWriteBIO();
+			try
+			{
+				this->Flush();
+			}
+			catch (const SocketException &)
+			{
+			}
+		}
+
+		SSL_SESSION *session = SSL_get1_session(this->ssl);
+		if (session && SSL_SESSION_is_resumable(session))
+			CacheSession(this->address, this->port, session);
+		SSL_SESSION_free(session);
+
+		// Only a connection that finished cleanly leaves
+		// the SSL object in a state worth reusing.
+		if (clean)
+			RecycleSSL(this->ssl);
+		else
+			SSL_free(this->ssl);
+	}
+
 	::close(this->fd);
-	SSL_CTX_free(this->ctx);
 }
 
-// Function: Connect
+// Function: StartTLS
 //
 // Arguments:
 //  <None>
 //
 // Description:
+// Sets up the SSL object for the connected socket, ready for the
+// handshake. The certificate has to be for the host we connected to,
+// and the last session with the host is resumed if we have one.
+void SecureConnectionSocket::StartTLS()
+{
+	this->ssl = AcquireSSL(this->ctx);
+	// Associate the fd with a SSL context.
+	SSL_set_fd(this->ssl, this->fd);
+
+	// Recycled objects still carry the last connection's host.
+	X509_VERIFY_PARAM *param = SSL_get0_param(this->ssl);
+	if (X509_VERIFY_PARAM_set1_ip_asc(param, this->address.c_str()) == 1)
+		SSL_set1_host(this->ssl, nullptr);
+	else
+	{
+		X509_VERIFY_PARAM_set1_ip(param, nullptr, 0);
+		SSL_set1_host(this->ssl, this->address.c_str());
+		// Virtual hosts need SNI to present the right certificate.
+		SSL_set_tlsext_host_name(this->ssl, this->address.c_str());
+	}
+
+	// Try resuming the last session with the host to skip a full handshake.
+	SSL_SESSION *session = GetCachedSession(this->address, this->port);
+	if (session)
+	{
+		SSL_set_session(this->ssl, session);
+		SSL_SESSION_free(session);
+	}
+}
+
+// Function: Connect
+//
+// Arguments:
+//  first - index of the resolved address to try first, the
+//          others are tried after it in order.
+//
+// Description:
 // Actually opens a connection to the address specified in the
 // constructor
-void SecureConnectionSocket::Connect()
+void SecureConnectionSocket::Connect(size_t first)
 {
 	// Resolve our DNS address first.
-	auto addresses = ResolveDNS(this->address, this->port);
+	Arena local;
+	auto addresses = ResolveDNS(this->arena ? *this->arena : local, this->address, this->port);
 
-	for (auto cur : addresses)
 	{
-		this->fd = ::socket(cur->sa.sa_family, SOCK_STREAM, 0);
-		if (::connect(this->fd, &cur->sa, sizeof(struct sockaddr)) != 0)
+		TraceSpan span("connect", this->id);
+		for (size_t i = 0; i < addresses.size(); ++i)
 		{
-			// Failed to connect.
-			::close(this->fd);
-			this->fd = -1;
-			continue;
+			this->addrindex = (first + i) % addresses.size();
+			auto const &cur = addresses[this->addrindex];
+			this->fd = ::socket(cur.sa.sa_family, SOCK_STREAM, 0);
+			if (::connect(this->fd, &cur.sa, GetSockLen(cur)) != 0)
+			{
+				// Failed to connect.
+				::close(this->fd);
+				this->fd = -1;
+				continue;
+			}
+			break;
 		}
 	}
 
@@ -238,38 +460,112 @@ void SecureConnectionSocket::Connect()
 	if (this->fd == -1)
 		throw SocketException("Failed to connect to a host");
 
-	// Free our memory.
-	for (auto addr : addresses)
-		delete addr;
-
 	// Now do SSL stuff.
-	this->ssl = SSL_new(ctx);
-	// Associate the fd with a SSL context.
-	SSL_set_fd(this->ssl, this->fd);
+	auto start = std::chrono::steady_clock::now();
+	TraceSpan tlsspan("handshake", this->id);
+	this->StartTLS();
 
-	if (SSL_connect(ssl) < 0)
-	{
-		// Use a lambda expression because OpenSSL is dumb.
-		std::string error = []() -> std::string
-		{
-			BIO *bio = BIO_new (BIO_s_mem ());
-			ERR_print_errors (bio);
-			char *buf = NULL;
-			size_t len = BIO_get_mem_data (bio, &buf);
-			char *ret = (char *)calloc (1, 1 + len);
-			if (ret) memcpy (ret, buf, len);
-			BIO_free (bio);
-			std::string str = ret;
-			free(ret);
-			return str;
-		}();
-
-		throw SocketException("OpenSSL Error: %s", error);
-	}
+	if (SSL_connect(ssl) <= 0)
+		throw SocketException("OpenSSL Error: %s", this->GetTLSError());
+	metrics.CountHandshake(start, SSL_session_reused(this->ssl));
+
+	// If we were given a batching backend before connecting, switch over now.
+	if (this->io)
+		this->SetIOBackend(this->io);
 
 	// Everything is all good! We're good to go :3
 }
 
+// Function: SetIOBackend
+//
+// Arguments:
+//  io - the IO backend to send with.
+//
+// Description:
+// When the backend batches sends, OpenSSL's write side is swapped for
+// a memory BIO once the handshake is done so that ciphertext can be
+// submitted through the backend together with file reads. Reads and
+// the handshake itself still go through the socket directly.
+void SecureConnectionSocket::SetIOBackend(IOBackend *io)
+{
+	this->io = io;
+	if (!this->ssl || this->wbio || !io || !io->BatchesSends())
+		return;
+
+	this->wbio = BIO_new(BIO_s_mem());
+	// SSL owns the BIO from here on.
+	SSL_set0_wbio(this->ssl, this->wbio);
+}
+
+// Function: DrainWriteBIO
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Moves ciphertext produced by OpenSSL into our pending buffer.
+void SecureConnectionSocket::DrainWriteBIO()
+{
+	size_t avail = BIO_ctrl_pending(this->wbio);
+	if (avail == 0)
+		return;
+
+	size_t off = this->pending.size();
+	this->pending.resize(off + avail);
+	int len = BIO_read(this->wbio, this->pending.data() + off, static_cast<int>(avail));
+	this->pending.resize(off + (len > 0 ? len : 0));
+}
+
+// Function: GetPendingSend
+//
+// Arguments:
+//  req - request to fill in.
+//
+// Description:
+// Builds a send request for ciphertext waiting to go out, returns
+// false if there is nothing to send. Pass the completed request
+// back to Sent() afterwards.
+bool SecureConnectionSocket::GetPendingSend(IORequest &req)
+{
+	if (this->pending.empty())
+		return false;
+
+	req = IORequest::Send(this->fd, this->pending.data(), this->pending.size());
+	return true;
+}
+
+// Function: Sent
+//
+// Arguments:
+//  req - a completed request from GetPendingSend()
+//
+// Description:
+// Discards the ciphertext the kernel accepted, or throws if the send failed.
+void SecureConnectionSocket::Sent(const IORequest &req)
+{
+	if (req.result < 0)
+		throw SocketException("Failed to send to %s: %s", this->address, strerror(-req.result));
+
+	this->pending.erase(this->pending.begin(), this->pending.begin() + req.result);
+}
+
+// Function: Flush
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Sends all pending ciphertext through the IO backend.
+void SecureConnectionSocket::Flush()
+{
+	IORequest req;
+	while (this->GetPendingSend(req))
+	{
+		this->io->Submit(&req, 1);
+		this->Sent(req);
+	}
+}
+
 // Function: Write
 //
 // Arguments:
@@ -280,7 +576,17 @@ void SecureConnectionSocket::Connect()
 // Writes data to the SSL socket, returns bytes written.
 size_t SecureConnectionSocket::Write(const void *data, size_t len)
 {
-	return SSL_write(this->ssl, data, len);
+	int ret = SSL_write(this->ssl, data, len);
+	if (ret <= 0)
+		throw SocketException("Failed to write to %s: SSL error %d", this->address, SSL_get_error(this->ssl, ret));
+	metrics.bytessent.fetch_add(ret, std::memory_order_relaxed);
+
+	// With a batching backend the data is only encrypted here, it's sent
+	// by whoever submits GetPendingSend() (or by Flush())
+	if (this->wbio)
+		this->DrainWriteBIO();
+
+	return ret;
 }
 
 // Function: Read
@@ -294,6 +600,91 @@ size_t SecureConnectionSocket::Write(const void *data, size_t len)
 void SecureConnectionSocket::Read(void *data, size_t *len)
 {
 	assert(len);
+	// Anything still buffered has to go out before we wait for a reply.
+	if (this->wbio)
+		this->Flush();
+
 	size_t buflen = *len;
-	*len = SSL_read(this->ssl, data, buflen);
+	int ret = SSL_read(this->ssl, data, buflen);
+	*len = ret > 0 ? ret : 0;
+
+	// Reading may have produced alerts or key updates which need sending.
+	if (this->wbio)
+	{
+		this->DrainWriteBIO();
+		this->Flush();
+	}
+}
+
+// Function: Readable
+//
+// Arguments:
+//  closed - set to whether it's readable because the connection was
+//           closed or failed rather than there being data, can be null.
+//
+// Description:
+// Returns true if Read() would return straight away, because there's
+// data to read or the connection was closed. Records which aren't data
+// (eg. TLS 1.3 session tickets) are processed without counting.
+bool SecureConnectionSocket::Readable(bool *closed)
+{
+	if (closed)
+		*closed = false;
+	if (SSL_pending(this->ssl) > 0)
+		return true;
+
+	int flags = fcntl(this->fd, F_GETFL);
+	fcntl(this->fd, F_SETFL, flags | O_NONBLOCK);
+	char c;
+	int ret = SSL_peek(this->ssl, &c, 1);
+	int err = ret > 0 ? SSL_ERROR_NONE : SSL_get_error(this->ssl, ret);
+	fcntl(this->fd, F_SETFL, flags);
+
+	if (this->wbio)
+		this->DrainWriteBIO();
+
+	if (closed)
+		*closed = err != SSL_ERROR_NONE && err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE;
+	return err != SSL_ERROR_WANT_READ;
+}
+
+// Function: WaitReadable
+//
+// Arguments:
+//  socks   - connections to wait on.
+//  count   - number of connections.
+//  timeout - how long to wait in milliseconds, -1 to wait forever.
+//  closed  - set to whether the one returned was closed or failed
+//            rather than having data, can be null.
+//
+// Description:
+// Waits for one of the connections to become readable (see Readable())
+// and returns it's index, or -1 if the timeout passed (or waiting
+// failed) first.
+int WaitReadable(SecureConnectionSocket *const *socks, size_t count, int timeout, bool *closed)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+	std::vector<pollfd> fds(count);
+	for (;;)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (socks[i]->Readable(closed))
+				return i;
+			fds[i].fd = socks[i]->GetFD();
+			fds[i].events = POLLIN;
+		}
+
+		int wait = -1;
+		if (timeout >= 0)
+		{
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+			if (left.count() <= 0)
+				return -1;
+			wait = left.count();
+		}
+
+		if (::poll(fds.data(), count, wait) < 0 && errno != EINTR)
+			return -1;
+	}
 }
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "TLS.h"
+#include "Cipher.h"
+#include "Config.h"
+#include "Exceptions.h"
+#include "Socket.h"
+
+// Cipher suites in the order they're offered, for TLS 1.3 and TLS 1.2,
+// with the AEAD that's fastest on this CPU first (see PreferredCipher).
+// AES-CBC comes last for TLS 1.2 servers that offer nothing better.
+static const char *AESSuites = "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256";
+static const char *ChaChaSuites = "TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384";
+static const char *AESCiphers = "ECDHE+AESGCM:ECDHE+CHACHA20:DHE+AESGCM:DHE+CHACHA20:ECDHE+AES:DHE+AES:!aNULL:!MD5";
+static const char *ChaChaCiphers = "ECDHE+CHACHA20:ECDHE+AESGCM:DHE+CHACHA20:DHE+AESGCM:ECDHE+AES:DHE+AES:!aNULL:!MD5";
+
+// How many idle SSL objects are kept per context.
+static const size_t MaxPooledSSL = 64;
+
+// Struct: TLSContext
+//
+// Description:
+// An SSL_CTX shared by every connection to an uploader
+// and the SSL objects it's connections left behind.
+struct TLSContext
+{
+	SSL_CTX *ctx = nullptr;
+	std::vector<SSL*> pool;
+};
+
+// Contexts by uploader and trust stores by the CA file and
+// directory they were loaded from, neither is ever freed.
+static std::map<std::string, TLSContext> contexts;
+static std::map<std::string, X509_STORE*> stores;
+static std::mutex tlsmtx;
+static std::once_flag tlsinit;
+
+// Function: GetTrustStore
+//
+// Arguments:
+//  cafile - file of CA certificates, empty for the system's.
+//  capath - directory of CA certificates, empty for the system's.
+//
+// Description:
+// Loads the CA certificates the first time they're asked for and
+// returns the same store after that, since parsing a CA bundle costs
+// far more than a handshake. Must be called with tlsmtx held.
+static X509_STORE *GetTrustStore(const std::string &cafile, const std::string &capath)
+{
+	std::string key = cafile + '\0' + capath;
+	auto it = stores.find(key);
+	if (it != stores.end())
+		return it->second;
+
+	X509_STORE *store = X509_STORE_new();
+	if (!store)
+		throw SocketException("OpenSSL Error: %s", GetSSLErrors());
+
+	int ret;
+	if (cafile.empty() && capath.empty())
+		ret = X509_STORE_set_default_paths(store);
+	else
+		ret = X509_STORE_load_locations(store, cafile.empty() ? nullptr : cafile.c_str(), capath.empty() ? nullptr : capath.c_str());
+	if (ret != 1)
+	{
+		X509_STORE_free(store);
+		throw SocketException("Cannot load CA certificates from %s: %s", cafile.empty() ? capath : cafile, GetSSLErrors());
+	}
+
+	stores[key] = store;
+	return store;
+}
+
+// Function: GetTLSContext
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Returns the SSL_CTX for the configured uploader, initializing OpenSSL
+// and creating the context the first time. The context verifies the
+// server's certificate against the uploader's CA certificates (cafile
+// and capath, or the system's) unless it's verify option is off.
+SSL_CTX *GetTLSContext()
+{
+	std::call_once(tlsinit, []()
+	{
+		OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, nullptr);
+	});
+
+	std::string uploader = config ? config->uploader : "";
+	std::lock_guard<std::mutex> lock(tlsmtx);
+	TLSContext &tc = contexts[uploader];
+	if (tc.ctx)
+		return tc.ctx;
+
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	if (!ctx)
+		throw SocketException("OpenSSL Error: %s", GetSSLErrors());
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	// Plenty of servers just close the connection after responding,
+	// that shouldn't stop us from resuming the session.
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+	// Servers mostly pick the cipher themselves, but plenty of them go with
+	// the client's first choice when it's between AES-GCM and ChaCha20.
+	bool aes = PreferredCipher() == CipherPreference::AESGCM;
+	if (SSL_CTX_set_ciphersuites(ctx, aes ? AESSuites : ChaChaSuites) != 1 ||
+		SSL_CTX_set_cipher_list(ctx, aes ? AESCiphers : ChaChaCiphers) != 1)
+	{
+		SSL_CTX_free(ctx);
+		throw SocketException("OpenSSL Error: %s", GetSSLErrors());
+	}
+
+	if (!config || config->verify)
+	{
+		try
+		{
+			X509_STORE *store = GetTrustStore(config ? config->cafile : "", config ? config->capath : "");
+			X509_STORE_up_ref(store);
+			SSL_CTX_set_cert_store(ctx, store);
+		}
+		catch (const SocketException &)
+		{
+			SSL_CTX_free(ctx);
+			throw;
+		}
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+	}
+
+	tc.ctx = ctx;
+	return ctx;
+}
+
+// Function: AcquireSSL
+//
+// Arguments:
+//  ctx - context the connection is made with.
+//
+// Description:
+// Returns an SSL object for a new connection, one a previous connection
+// left behind if there is one. Set it up for the host with SetupSSL().
+SSL *AcquireSSL(SSL_CTX *ctx)
+{
+	{
+		std::lock_guard<std::mutex> lock(tlsmtx);
+		for (auto &it : contexts)
+		{
+			if (it.second.ctx != ctx || it.second.pool.empty())
+				continue;
+			SSL *ssl = it.second.pool.back();
+			it.second.pool.pop_back();
+			return ssl;
+		}
+	}
+
+	SSL *ssl = SSL_new(ctx);
+	if (!ssl)
+		throw SocketException("OpenSSL Error: %s", GetSSLErrors());
+	return ssl;
+}
+
+// Function: RecycleSSL
+//
+// Arguments:
+//  ssl - SSL object of a connection that was shut down cleanly.
+//
+// Description:
+// Resets the SSL object with SSL_clear() and keeps it for the next
+// connection, which saves setting up a new one from the context.
+void RecycleSSL(SSL *ssl)
+{
+	if (SSL_clear(ssl) == 1)
+	{
+		SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
+		std::lock_guard<std::mutex> lock(tlsmtx);
+		for (auto &it : contexts)
+		{
+			if (it.second.ctx != ctx || it.second.pool.size() >= MaxPooledSSL)
+				continue;
+			it.second.pool.push_back(ssl);
+			return;
+		}
+	}
+
+	SSL_free(ssl);
+}
@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <sched.h>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include "ThreadPool.h"
+
+// The pool (and which of it's workers) the current thread is, if any.
+static thread_local ThreadPool *currentpool = nullptr;
+static thread_local size_t currentworker = 0;
+
+// Function: ReadQuota
+//
+// Arguments:
+//  quota  - file with the quota, or the quota and period (cgroup v2).
+//  period - file with the period, empty for cgroup v2.
+//
+// Description:
+// Returns how many CPUs worth of time the cgroup gets,
+// or 0 if there's no limit (or no such cgroup).
+static double ReadQuota(const char *quota, const char *period)
+{
+	std::ifstream in(quota);
+	std::string max;
+	double q, p = 0;
+	if (!(in >> max) || max == "max" || max == "-1")
+		return 0;
+	q = std::stod(max);
+
+	if (*period)
+	{
+		std::ifstream pin(period);
+		pin >> p;
+	}
+	else
+		in >> p;
+	return q > 0 && p > 0 ? q / p : 0;
+}
+
+// Function: CPUQuota
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Returns how many CPUs the process can actually keep busy: the ones
+// it's allowed to run on, fewer if it's cgroup (eg. a container's CPU
+// limit) only gets enough time for fewer. hardware_concurrency() counts
+// every CPU on the host, which oversubscribes containers.
+size_t CPUQuota()
+{
+	size_t cpus = std::thread::hardware_concurrency();
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		cpus = CPU_COUNT(&set);
+
+	double quota = ReadQuota("/sys/fs/cgroup/cpu.max", "");
+	if (quota <= 0)
+		quota = ReadQuota("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+	if (quota <= 0)
+		quota = ReadQuota("/sys/fs/cgroup/cpu,cpuacct/cpu.cfs_quota_us", "/sys/fs/cgroup/cpu,cpuacct/cpu.cfs_period_us");
+	if (quota > 0 && std::ceil(quota) < cpus)
+		cpus = std::ceil(quota);
+
+	return cpus ? cpus : 1;
+}
+
+// Function: GetThreadPool
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Returns the process' pool, started the first time it's needed with
+// a worker for every CPU in the quota but one, since whoever's waiting
+// on the work helps with it.
+ThreadPool &GetThreadPool()
+{
+	static ThreadPool pool(CPUQuota() - 1);
+	return pool;
+}
+
+// Constructor: ThreadPool
+//
+// Arguments:
+//  size - how many worker threads to start.
+//
+// Description:
+// Starts the workers.
+ThreadPool::ThreadPool(size_t size) : next(0), queued(0), stopping(false)
+{
+	for (size_t i = 0; i < size; ++i)
+		this->workers.emplace_back(new Worker);
+	for (size_t i = 0; i < size; ++i)
+		this->threads.emplace_back(&ThreadPool::RunWorker, this, i);
+}
+
+// Destructor: ThreadPool
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Lets the workers finish what's queued and stops them.
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(this->sleeplock);
+		this->stopping = true;
+	}
+	this->sleepcv.notify_all();
+	for (auto &thread : this->threads)
+		thread.join();
+}
+
+// Function: Submit
+//
+// Arguments:
+//  task - what to run.
+//
+// Description:
+// Queues a task. From a worker it goes on that worker's own deque,
+// from anywhere else the workers take turns getting them. Without any
+// workers it's run right away.
+void ThreadPool::Submit(std::function<void()> task)
+{
+	if (this->workers.empty())
+	{
+		task();
+		return;
+	}
+
+	// Counted first so it can't be taken before it's been counted, and
+	// under the lock so a worker about to sleep can't miss it.
+	{
+		std::lock_guard<std::mutex> guard(this->sleeplock);
+		this->queued.fetch_add(1);
+	}
+
+	size_t index = currentpool == this ? currentworker : this->next.fetch_add(1, std::memory_order_relaxed) % this->workers.size();
+	{
+		Worker &worker = *this->workers[index];
+		std::lock_guard<std::mutex> guard(worker.lock);
+		worker.tasks.push_back(std::move(task));
+	}
+	this->sleepcv.notify_one();
+}
+
+// Function: RunOne
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Runs one queued task: the newest from this worker's own deque, or
+// else the oldest it can steal from another's. Returns false if there
+// wasn't anything to run.
+bool ThreadPool::RunOne()
+{
+	size_t count = this->workers.size();
+	size_t self = currentpool == this ? currentworker : count;
+	std::function<void()> task;
+
+	if (self < count)
+	{
+		Worker &worker = *this->workers[self];
+		std::lock_guard<std::mutex> guard(worker.lock);
+		if (!worker.tasks.empty())
+		{
+			task = std::move(worker.tasks.back());
+			worker.tasks.pop_back();
+		}
+	}
+
+	// Start stealing after ourselves so thieves don't all pile onto the first.
+	for (size_t i = 1; !task && i <= count; ++i)
+	{
+		Worker &victim = *this->workers[(self + i) % count];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (!victim.tasks.empty())
+		{
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+		}
+	}
+
+	if (!task)
+		return false;
+	this->queued.fetch_sub(1);
+	task();
+	return true;
+}
+
+// Function: RunWorker
+//
+// Arguments:
+//  index - which worker this thread is.
+//
+// Description:
+// Runs tasks until the pool is destroyed, sleeping
+// whenever there's nothing queued anywhere.
+void ThreadPool::RunWorker(size_t index)
+{
+	currentpool = this;
+	currentworker = index;
+	for (;;)
+	{
+		if (this->RunOne())
+			continue;
+
+		std::unique_lock<std::mutex> guard(this->sleeplock);
+		this->sleepcv.wait(guard, [this]() { return this->stopping || this->queued.load() > 0; });
+		if (this->stopping && this->queued.load() == 0)
+			return;
+	}
+}
+
+// Function: ParallelFor
+//
+// Arguments:
+//  count - how many times to call fn.
+//  fn    - called with each index from 0 to count - 1.
+//
+// Description:
+// Runs fn for every index on the pool and returns once they're all
+// done, running tasks on this thread while it waits so nothing's left
+// waiting on a busy pool (or deadlocks when called from a worker).
+// Rethrows the first exception any of them threw.
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)> &fn)
+{
+	if (count <= 1 || this->workers.empty())
+	{
+		for (size_t i = 0; i < count; ++i)
+			fn(i);
+		return;
+	}
+
+	std::mutex lock;
+	std::condition_variable cv;
+	size_t left = count;
+	std::exception_ptr error;
+	auto run = [&](size_t i)
+	{
+		std::exception_ptr err;
+		try
+		{
+			fn(i);
+		}
+		catch (...)
+		{
+			err = std::current_exception();
+		}
+
+		// Nothing is touched after the lock's let go, the caller
+		// may have returned by then.
+		std::lock_guard<std::mutex> guard(lock);
+		if (err && !error)
+			error = err;
+		if (--left == 0)
+			cv.notify_all();
+	};
+
+	for (size_t i = 1; i < count; ++i)
+		this->Submit([&run, i]() { run(i); });
+	run(0);
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			if (left == 0)
+				break;
+		}
+		// If there's nothing left to run everything's been taken,
+		// so all that's left is to wait for it.
+		if (!this->RunOne())
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			cv.wait(guard, [&]() { return left == 0; });
+			break;
+		}
+	}
+
+	if (error)
+		std::rethrow_exception(error);
+}
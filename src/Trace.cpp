@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include "Trace.h"
+#include "tinyformat.h"
+
+// Global: tracing
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Whether spans are being recorded, off unless --trace was given.
+std::atomic<bool> tracing(false);
+
+// Struct: TraceEvent
+//
+// Description:
+// A finished span, times are in nanoseconds since tracing started.
+struct TraceEvent
+{
+	const char *name;
+	int64_t start, duration;
+	int64_t conn, bytes;
+};
+
+// Struct: TraceBlock
+//
+// Description:
+// A block of a thread's spans. Only the thread writes to it, count is
+// published after each span so a reader always sees complete ones.
+struct TraceBlock
+{
+	static const size_t Events = 4096;
+	TraceEvent events[Events];
+	std::atomic<size_t> count;
+	std::atomic<TraceBlock*> next;
+
+	TraceBlock() : count(0), next(nullptr) { }
+};
+
+// Struct: TraceBuffer
+//
+// Description:
+// Every span one thread recorded, kept after the thread exits so
+// it can be written out at the end.
+struct TraceBuffer
+{
+	pid_t tid;
+	TraceBlock *head, *tail;
+	TraceBuffer *next;
+};
+
+// Every thread's buffer, pushed on without locking, and each thread's own.
+static std::atomic<TraceBuffer*> buffers(nullptr);
+static thread_local TraceBuffer *localbuffer = nullptr;
+
+static std::chrono::steady_clock::time_point epoch;
+static std::string tracefile;
+
+// Function: StartTrace
+//
+// Arguments:
+//  file - where to write the trace.
+//
+// Description:
+// Starts recording spans, they're written to the file by WriteTrace().
+void StartTrace(const std::string &file)
+{
+	tracefile = file;
+	epoch = std::chrono::steady_clock::now();
+	tracing.store(true);
+}
+
+// Function: GetLocalBuffer
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Returns the calling thread's buffer, making it the first time.
+static TraceBuffer *GetLocalBuffer()
+{
+	if (localbuffer)
+		return localbuffer;
+
+	TraceBuffer *buf = new TraceBuffer;
+	buf->tid = syscall(SYS_gettid);
+	buf->head = buf->tail = new TraceBlock;
+	buf->next = buffers.load(std::memory_order_relaxed);
+	while (!buffers.compare_exchange_weak(buf->next, buf, std::memory_order_release, std::memory_order_relaxed))
+		;
+	return localbuffer = buf;
+}
+
+// Function: RecordSpan
+//
+// Arguments:
+//  name  - what was done.
+//  start - when it started, it ends now.
+//  conn  - the connection it was done on, -1 for none.
+//  bytes - how many bytes it was done to, -1 for none.
+//
+// Description:
+// Appends a span to the calling thread's buffer, use TraceSpan instead.
+void RecordSpan(const char *name, std::chrono::steady_clock::time_point start, int64_t conn, int64_t bytes)
+{
+	auto end = std::chrono::steady_clock::now();
+	TraceBuffer *buf = GetLocalBuffer();
+
+	TraceBlock *block = buf->tail;
+	size_t count = block->count.load(std::memory_order_relaxed);
+	if (count == TraceBlock::Events)
+	{
+		block = new TraceBlock;
+		buf->tail->next.store(block, std::memory_order_release);
+		buf->tail = block;
+		count = 0;
+	}
+
+	TraceEvent &ev = block->events[count];
+	ev.name = name;
+	ev.start = std::chrono::duration_cast<std::chrono::nanoseconds>(start - epoch).count();
+	ev.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	ev.conn = conn;
+	ev.bytes = bytes;
+	block->count.store(count + 1, std::memory_order_release);
+}
+
+// Function: WriteTrace
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Stops tracing and writes every span recorded so far as Chrome's trace
+// event JSON, which chrome://tracing and Perfetto open. Each thread gets
+// a track, and spans carry the connection they were on. Does nothing if
+// tracing wasn't started.
+void WriteTrace()
+{
+	if (!tracing.exchange(false))
+		return;
+
+	std::ofstream f(tracefile);
+	if (!f)
+	{
+		tfm::printf("Cannot write trace to %s: %s\n", tracefile, strerror(errno));
+		return;
+	}
+
+	pid_t pid = getpid();
+	bool first = true;
+	tfm::format(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (TraceBuffer *buf = buffers.load(std::memory_order_acquire); buf; buf = buf->next)
+	{
+		tfm::format(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+			first ? "" : ",", pid, buf->tid, buf->tid);
+		first = false;
+
+		for (TraceBlock *block = buf->head; block; block = block->next.load(std::memory_order_acquire))
+		{
+			size_t count = block->count.load(std::memory_order_acquire);
+			for (size_t i = 0; i < count; ++i)
+			{
+				const TraceEvent &ev = block->events[i];
+				tfm::format(f, ",\n{\"name\":\"%s\",\"cat\":\"upload\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+					ev.name, pid, buf->tid, ev.start / 1000.0, ev.duration / 1000.0);
+				if (ev.conn >= 0)
+					tfm::format(f, "\"conn\":%d%s", ev.conn, ev.bytes >= 0 ? "," : "");
+				if (ev.bytes >= 0)
+					tfm::format(f, "\"bytes\":%d", ev.bytes);
+				f << "}}";
+			}
+		}
+	}
+	f << "\n]}\n";
+
+	f.close();
+	if (!f)
+		tfm::printf("Cannot write trace to %s: %s\n", tracefile, strerror(errno));
+}
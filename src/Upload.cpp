@@ -0,0 +1,863 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <strings.h>
+#include <algorithm>
+#include "Upload.h"
+#include "Autotuner.h"
+#include "Config.h"
+#include "Exceptions.h"
+#include "FileReader.h"
+#include "Socket.h"
+#include "Latency.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "UploadCipher.h"
+#include "MemoryBudget.h"
+#include "sysconf.h"
+
+// How much of a buffer is encrypted and sent at a time.
+static const off_t BufferChunkSize = 64 * 1024;
+
+// How long small uploads take to be answered, used to decide when to hedge them.
+static LatencyTracker HedgeLatency;
+// How long (in milliseconds) a hedged upload waits for either connection
+// to answer before it settles on one of them.
+static const int HedgeWait = 60 * 1000;
+
+// Function: GetBaseName
+//
+// Arguments:
+//  path - path of a file.
+//
+// Description:
+// Returns everything after the last slash of the path.
+static const char *GetBaseName(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+// Function: FindHeader
+//
+// Arguments:
+//  response - the HTTP response.
+//  hdrend   - offset of the blank line ending the headers.
+//  name     - the header's name and colon (eg. "content-length:")
+//
+// Description:
+// Returns the offset of the header's value (the
+// name is case insensitive) or npos if there isn't one.
+size_t FindHeader(const ArenaString &response, size_t hdrend, const char *name)
+{
+	size_t len = strlen(name);
+	for (size_t pos = response.find("\r\n"); pos < hdrend; pos = response.find("\r\n", pos + 2))
+	{
+		if (strncasecmp(response.c_str() + pos + 2, name, len) == 0)
+			return pos + 2 + len;
+	}
+	return ArenaString::npos;
+}
+
+// Function: HeaderHas
+//
+// Arguments:
+//  response - the HTTP response.
+//  hdrend   - offset of the blank line ending the headers.
+//  name     - the header's name and colon.
+//  token    - what to look for in it's value.
+//
+// Description:
+// Returns true if the header's value contains the token, ignoring case.
+static bool HeaderHas(const ArenaString &response, size_t hdrend, const char *name, const char *token)
+{
+	size_t pos = FindHeader(response, hdrend, name);
+	if (pos == ArenaString::npos)
+		return false;
+
+	size_t end = response.find("\r\n", pos);
+	size_t len = strlen(token);
+	for (; pos + len <= end; ++pos)
+	{
+		if (strncasecmp(response.c_str() + pos, token, len) == 0)
+			return true;
+	}
+	return false;
+}
+
+// Function: FindChunkedEnd
+//
+// Arguments:
+//  response - the HTTP response.
+//  pos      - offset of the first chunk.
+//
+// Description:
+// Returns the offset just past the last chunk (and any trailers)
+// or npos if the whole body hasn't been received yet.
+static size_t FindChunkedEnd(const ArenaString &response, size_t pos)
+{
+	for (;;)
+	{
+		size_t lineend = response.find("\r\n", pos);
+		if (lineend == ArenaString::npos)
+			return ArenaString::npos;
+
+		size_t len = strtoul(response.c_str() + pos, nullptr, 16);
+		if (len == 0)
+		{
+			size_t end = response.find("\r\n\r\n", lineend);
+			return end == ArenaString::npos ? end : end + 4;
+		}
+
+		pos = lineend + 2 + len + 2;
+		if (pos > response.size())
+			return ArenaString::npos;
+	}
+}
+
+// Function: ResponseComplete
+//
+// Arguments:
+//  response - what has been read of the response so far.
+//  state    - progress through the response, starts out default.
+//
+// Description:
+// Called after each read, uses the response's Content-Length or chunked
+// encoding to work out where it ends so the connection can be used
+// again afterwards. Returns true once the whole response is read, and
+// state.keepalive tells if the server is keeping the connection open.
+bool ResponseComplete(ArenaString &response, ResponseState &state)
+{
+	if (state.hdrend == ArenaString::npos)
+	{
+		state.hdrend = response.find("\r\n\r\n");
+		if (state.hdrend == ArenaString::npos)
+			return false;
+
+		// HTTP/1.1 connections stay open unless the server says otherwise.
+		if (response.compare(0, 8, "HTTP/1.1") == 0)
+			state.keepalive = !HeaderHas(response, state.hdrend, "connection:", "close");
+		else
+			state.keepalive = HeaderHas(response, state.hdrend, "connection:", "keep-alive");
+
+		int status = response.size() > 9 ? atoi(response.c_str() + 9) : 0;
+		size_t length = FindHeader(response, state.hdrend, "content-length:");
+		state.chunked = HeaderHas(response, state.hdrend, "transfer-encoding:", "chunked");
+		if (status == 204 || status == 304)
+			state.bodyend = state.hdrend + 4;
+		else if (!state.chunked && length != ArenaString::npos)
+			state.bodyend = state.hdrend + 4 + strtoull(response.c_str() + length, nullptr, 10);
+		else if (!state.chunked)
+			state.keepalive = false;
+	}
+
+	if (state.chunked)
+		state.bodyend = FindChunkedEnd(response, state.hdrend + 4);
+
+	if (state.bodyend == ArenaString::npos || response.size() < state.bodyend)
+		return false;
+
+	response.resize(state.bodyend);
+	return true;
+}
+
+// Function: ResponseClosed
+//
+// Arguments:
+//  state - how far the response got when the connection closed.
+//
+// Description:
+// Called when the server closes the connection before ResponseComplete()
+// says the response is done. That's where the body ends only if it has
+// no length and isn't chunked, otherwise it was cut short and this throws
+// a SocketException rather than let part of it (and a truncated link)
+// pass for the whole response.
+void ResponseClosed(const ResponseState &state)
+{
+	if (state.hdrend == ArenaString::npos)
+		throw SocketException("Connection closed before %s responded", config->url.host);
+	if (state.chunked || state.bodyend != ArenaString::npos)
+		throw SocketException("Connection closed before %s finished responding", config->url.host);
+}
+
+// Function: ReadResponse
+//
+// Arguments:
+//  sock     - connection the request was sent over.
+//  response - set to the complete HTTP response.
+//  sent     - when the request finished sending.
+//
+// Description:
+// Reads one response, returns true if the connection can be
+// used again afterwards or false if the server is closing it.
+bool ReadResponse(SecureConnectionSocket &sock, ArenaString &response, std::chrono::steady_clock::time_point sent)
+{
+	TraceSpan span("response", sock.GetID());
+	ResponseState state;
+	char buf[4096];
+	for (;;)
+	{
+		size_t len = sizeof(buf);
+		sock.Read(buf, &len);
+		if (len == 0)
+		{
+			ResponseClosed(state);
+			return false;
+		}
+		if (response.empty())
+			metrics.ttfb.Record(SinceMicroseconds(sent));
+		response.append(buf, len);
+
+		if (ResponseComplete(response, state))
+			return state.keepalive;
+	}
+}
+
+// Function: ParseResponse
+//
+// Arguments:
+//  response - the complete HTTP response.
+//  body     - set to the (de-chunked) response body.
+//
+// Description:
+// Splits the HTTP response up and returns it's status code
+// or -1 if the response was malformed.
+int ParseResponse(const ArenaString &response, ArenaString &body)
+{
+	// Status line looks like "HTTP/1.1 200 OK"
+	if (response.compare(0, 5, "HTTP/") != 0)
+		return -1;
+	size_t sp = response.find(' ');
+	if (sp == ArenaString::npos)
+		return -1;
+	int status = atoi(response.c_str() + sp + 1);
+
+	size_t hdrend = response.find("\r\n\r\n");
+	if (hdrend == ArenaString::npos)
+		return -1;
+
+	if (!HeaderHas(response, hdrend, "transfer-encoding:", "chunked"))
+	{
+		body.assign(response, hdrend + 4, ArenaString::npos);
+		return status;
+	}
+
+	// Put the chunks back together.
+	body.clear();
+	size_t pos = hdrend + 4;
+	while (pos < response.size())
+	{
+		size_t lineend = response.find("\r\n", pos);
+		if (lineend == ArenaString::npos)
+			return -1;
+		size_t len = strtoul(response.c_str() + pos, nullptr, 16);
+		if (len == 0)
+			break;
+		body.append(response, lineend + 2, len);
+		pos = lineend + 2 + len + 2;
+	}
+
+	return status;
+}
+
+// Function: FindURL
+//
+// Arguments:
+//  body - JSON response from the uploader.
+//
+// Description:
+// Pulls the value of the first "url" key out of the response
+// (eg. {"result":{"url":"https:\/\/u.teknik.io\/abcd.png"}})
+// and returns an empty string if there isn't one.
+static std::string FindURL(const ArenaString &body)
+{
+	size_t pos = body.find("\"url\"");
+	if (pos == ArenaString::npos)
+		return "";
+	pos = body.find('"', body.find(':', pos));
+	if (pos == ArenaString::npos)
+		return "";
+
+	std::string url;
+	for (++pos; pos < body.size() && body[pos] != '"'; ++pos)
+	{
+		if (body[pos] == '\\' && pos + 1 < body.size())
+			++pos;
+		url += body[pos];
+	}
+
+	return url;
+}
+
+// Function: GetLink
+//
+// Arguments:
+//  response - the complete HTTP response.
+//  arena    - where the body goes.
+//
+// Description:
+// Returns the link the uploader responded with or throws
+// an UploadException describing why there isn't one.
+std::string GetLink(const ArenaString &response, Arena &arena)
+{
+	const URL &url = config->url;
+
+	ArenaString body(arena);
+	int status = ParseResponse(response, body);
+	if (status < 0)
+		throw UploadException("Malformed response from %s", url.host);
+	if (status == 429 || status == 503)
+		autotuner.Congested();
+	if (status < 200 || status > 299)
+		throw UploadException("%s responded with status %d: %s", url.host, status, body);
+
+	std::string link = FindURL(body);
+	if (link.empty())
+		throw UploadException("%s did not return a link: %s", url.host, body);
+
+	return link;
+}
+
+// Constructor: Upload
+//
+// Arguments:
+//  source - what to upload.
+//
+// Description:
+// Opens the file and gets it's size. Descriptors are reopened (or
+// dup'd) so reading them doesn't change the caller's file flags.
+Upload::Upload(const UploadSource &source) : file(source.name), fd(-1), shared(false), data(nullptr), size(0), cipher(nullptr)
+{
+	if (config->encrypt != "none")
+		this->cipher = new UploadCipher(config->encrypt);
+
+	if (source.type == UploadSource::BUFFER)
+	{
+		this->name = source.name;
+		this->data = static_cast<const char*>(source.data);
+		this->size = source.len;
+		return;
+	}
+
+	if (source.type == UploadSource::PATH)
+	{
+		this->name = GetBaseName(source.name.data());
+		this->fd = ::open(source.name.data(), O_RDONLY);
+	}
+	else
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", source.fd);
+		this->name = source.name;
+		this->fd = ::open(path, O_RDONLY);
+		if (this->fd < 0)
+		{
+			// We may not be allowed to open it ourselves (eg. a file a
+			// daemon client passed us), share the caller's instead.
+			this->fd = ::dup(source.fd);
+			this->shared = true;
+		}
+	}
+
+	if (this->fd < 0)
+	{
+		int err = errno;
+		delete this->cipher;
+		throw UploadException("Cannot open %s: %s", this->file, strerror(err));
+	}
+
+	struct stat st;
+	if (::fstat(this->fd, &st) != 0)
+	{
+		int err = errno;
+		::close(this->fd);
+		delete this->cipher;
+		throw UploadException("Cannot stat %s: %s", this->file, strerror(err));
+	}
+	this->size = st.st_size;
+}
+
+// Destructor: Upload
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Closes the file.
+Upload::~Upload()
+{
+	if (this->fd >= 0)
+		::close(this->fd);
+	delete this->cipher;
+}
+
+// Function: AddKey
+//
+// Arguments:
+//  link - the link the uploader responded with.
+//
+// Description:
+// Puts the key to an encrypted upload in the link's fragment, which
+// browsers never send to the server, as Teknik's own links do.
+std::string Upload::AddKey(const std::string &link)
+{
+	if (!this->cipher)
+		return link;
+	return link + "#" + this->cipher->GetKey();
+}
+
+// Function: BuildRequest
+//
+// Arguments:
+//  header   - set to the HTTP header and the multipart preamble.
+//  epilogue - set to the end of the multipart body.
+//
+// Description:
+// Builds everything sent around the file's contents.
+void Upload::BuildRequest(ArenaString &header, ArenaString &epilogue)
+{
+	const URL &url = config->url;
+
+	char boundary[64], length[32];
+	snprintf(boundary, sizeof(boundary), "------------------------kittehuplodah%lx%x",
+		static_cast<unsigned long>(time(nullptr)), static_cast<unsigned>(getpid()));
+
+	ArenaString preamble(this->arena);
+	if (this->cipher)
+	{
+		// What Teknik needs to be able to serve the file decrypted, the
+		// key itself stays with us.
+		auto field = [&](const char *name, const std::string &value)
+		{
+			preamble.append("--").append(boundary).append("\r\n"
+				"Content-Disposition: form-data; name=\"").append(name).append("\"\r\n\r\n").append(value).append("\r\n");
+		};
+		field("iv", this->cipher->GetIV());
+		field("keySize", std::to_string(UploadCipher::KeySize * 8));
+		field("blockSize", "128");
+	}
+	preamble.append("--").append(boundary).append("\r\n"
+		"Content-Disposition: form-data; name=\"").append(config->field).append("\"; filename=\"").append(this->name).append("\"\r\n"
+		"Content-Type: application/octet-stream\r\n\r\n");
+
+	epilogue.append("\r\n--").append(boundary).append("--\r\n");
+
+	snprintf(length, sizeof(length), "%llu", static_cast<unsigned long long>(preamble.size() + this->size +
+		(this->cipher ? this->cipher->GetOverhead() : 0) + epilogue.size()));
+
+	// A URL without a path is requested as "/" followed by it's query,
+	// which is often the API key so it mustn't be dropped.
+	header.reserve(256 + url.target.size() + url.authority.size() + preamble.size());
+	header.append("POST ");
+	if (url.target.empty() || url.target[0] == '?')
+		header.append("/");
+	header.append(url.target).append(" HTTP/1.1\r\n"
+		"Host: ").append(url.authority).append("\r\n"
+		"User-Agent: kittehuplodah/" VERSION "\r\n"
+		"Accept: */*\r\n"
+		"Connection: keep-alive\r\n"
+		"Content-Type: multipart/form-data; boundary=").append(boundary).append("\r\n"
+		"Content-Length: ").append(length).append("\r\n\r\n");
+	header.append(preamble);
+}
+
+// Function: Send
+//
+// Arguments:
+//  sock     - connection to send the request over.
+//  io       - IO backend used to read the file and send it.
+//  header   - HTTP header and the multipart preamble.
+//  epilogue - end of the multipart body.
+//
+// Description:
+// Streams the request to the uploader. The next chunk of the file
+// is read (see FileReader) while the current one is being sent, with
+// a batching backend the send of one chunk and the read of the next
+// are a single submission.
+void Upload::Send(SecureConnectionSocket &sock, IOBackend *io, const ArenaString &header, const ArenaString &epilogue)
+{
+	sock.Write(header.data(), header.size());
+	if (this->cipher)
+		this->cipher->Restart();
+
+	if (this->data)
+	{
+		// Nothing to read, just send the buffer a chunk at a time.
+		off_t chunksize = config->autotune ? autotuner.GetChunkSize() : BufferChunkSize;
+		for (off_t offset = 0; offset < this->size; offset += chunksize)
+		{
+			size_t len = std::min<off_t>(chunksize, this->size - offset);
+			{
+				TraceSpan span("encrypt", sock.GetID(), len);
+				const char *chunk = this->data + offset;
+				sock.Write(this->cipher ? this->cipher->Encrypt(chunk, len) : chunk, len);
+			}
+			TraceSpan span("write", sock.GetID(), len);
+			sock.Flush();
+		}
+		this->SendEnd(sock, epilogue);
+		return;
+	}
+
+	FileReader reader(this->fd, this->size, io, this->shared);
+	char *data;
+	size_t len;
+	for (;;)
+	{
+		{
+			TraceSpan span("read", sock.GetID());
+			if (!reader.Next(&data, &len))
+				break;
+			span.SetBytes(len);
+		}
+
+		// Encrypt the chunk in the reader's buffer, so the upload never
+		// holds more of the memory budget than the reader took. With a
+		// blocking backend this sends it too.
+		{
+			TraceSpan span("encrypt", sock.GetID(), len);
+			if (this->cipher)
+				this->cipher->EncryptTo(data, len, data);
+			sock.Write(data, len);
+		}
+
+		// Send it along with the read of the next chunk if we can.
+		IORequest batch[2];
+		size_t count = 0;
+		bool sending = sock.GetPendingSend(batch[count]);
+		if (sending)
+			count++;
+		bool reading = reader.GetPendingRead(batch[count]);
+		if (reading)
+			count++;
+
+		if (count > 0)
+		{
+			TraceSpan span("write", sock.GetID(), sending ? batch[0].len : 0);
+			io->Submit(batch, count);
+		}
+		if (sending)
+			sock.Sent(batch[0]);
+		if (reading)
+			reader.Completed(batch[count - 1]);
+
+		reader.Done();
+	}
+
+	this->SendEnd(sock, epilogue);
+}
+
+// Function: SendEnd
+//
+// Arguments:
+//  sock     - connection the request is being sent over.
+//  epilogue - end of the multipart body.
+//
+// Description:
+// Sends what comes after the file's contents: the authentication
+// tag of an upload encrypted with GCM, then the end of the body.
+void Upload::SendEnd(SecureConnectionSocket &sock, const ArenaString &epilogue)
+{
+	unsigned char tag[UploadCipher::TagSize];
+	size_t taglen = this->cipher ? this->cipher->Finish(tag) : 0;
+	if (taglen > 0)
+		sock.Write(tag, taglen);
+	sock.Write(epilogue.data(), epilogue.size());
+}
+
+// Function: Hedge
+//
+// Arguments:
+//  io       - IO backend used to read the file and send it.
+//  conn     - connection the request was just sent over.
+//  header   - HTTP header and the multipart preamble.
+//  epilogue - end of the multipart body.
+//  start    - when the request started being sent.
+//
+// Description:
+// Waits for the response to the request. If it takes longer than 95%
+// of recent small uploads did, the request is sent again over a second
+// connection (to the next of the uploader's addresses if it has more
+// than one). Whichever connection starts responding first becomes conn
+// and the other one is closed, cancelling it's request. A connection
+// that fails (eg. the stuck one being reset) drops out and the other
+// is waited on. If neither answers within HedgeWait the hedge is kept,
+// as conn is the one that was already stuck, and conn is only kept
+// when the hedge failed.
+void Upload::Hedge(IOBackend *io, SecureConnectionSocket *&conn, const ArenaString &header, const ArenaString &epilogue,
+	std::chrono::steady_clock::time_point start)
+{
+	long p95 = HedgeLatency.Percentile(95);
+	if (p95 < 0)
+		return;
+
+	conn->Flush();
+	long waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	int timeout = p95 > waited ? (p95 - waited + 999) / 1000 : 0;
+	if (WaitReadable(&conn, 1, timeout) >= 0)
+		return;
+
+	TraceSpan span("hedge", conn->GetID());
+	SecureConnectionSocket *socks[2] = { conn, nullptr };
+	try
+	{
+		socks[1] = new SecureConnectionSocket(conn->GetAddress(), conn->GetPort());
+		socks[1]->SetIOBackend(io);
+		socks[1]->Connect(conn->GetAddressIndex() + 1);
+		this->Send(*socks[1], io, header, epilogue);
+		socks[1]->Flush();
+		metrics.hedges.fetch_add(1, std::memory_order_relaxed);
+	}
+	catch (const BasicException &)
+	{
+		// Nothing lost, we just keep waiting on the first one.
+		delete socks[1];
+		return;
+	}
+
+	bool failed[2] = { false, false };
+	int winner = -1;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(HedgeWait);
+	while (winner < 0 && !(failed[0] && failed[1]))
+	{
+		long left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		if (left <= 0)
+			break;
+
+		// Only wait on the ones that haven't failed.
+		int first = failed[0] ? 1 : 0;
+		bool closed;
+		int ready = WaitReadable(socks + first, failed[0] || failed[1] ? 1 : 2, left, &closed);
+		if (ready < 0)
+			break;
+		if (closed)
+			failed[first + ready] = true;
+		else
+			winner = first + ready;
+	}
+	if (winner < 0)
+		winner = failed[1] ? 0 : 1;
+
+	delete socks[1 - winner];
+	conn = socks[winner];
+}
+
+// Function: Run
+//
+// Arguments:
+//  io   - IO backend used to read the file and send it.
+//  conn - connection to the uploader kept between uploads, a new
+//         one is made if it's null and it's deleted (and set to
+//         null) when it can't be used again.
+//
+// Description:
+// Uploads the file over the connection and returns the link to it.
+// The connection is kept alive for the next upload unless the server
+// says otherwise, if the server closed it while it was idle the upload
+// is retried once over a new connection. Uploads smaller than the
+// uploader's hedgesize are hedged against stuck connections (see Hedge).
+std::string Upload::Run(IOBackend *io, SecureConnectionSocket *&conn)
+{
+	const URL &url = config->url;
+
+	ArenaString header(this->arena), epilogue(this->arena);
+	this->BuildRequest(header, epilogue);
+
+	// Only small uploads are worth sending twice.
+	bool hedged = this->size < config->hedgesize;
+
+	ArenaString response(this->arena);
+	response.reserve(4096);
+	auto begin = std::chrono::steady_clock::now();
+	TraceSpan span("upload", -1, this->size);
+	for (bool retry = true; ; retry = false)
+	{
+		bool reused = conn != nullptr;
+		try
+		{
+			if (!conn)
+			{
+				// The connection outlives the upload so it can't use our arena.
+				conn = new SecureConnectionSocket(std::string(url.host), std::string(url.GetPort()));
+				conn->SetIOBackend(io);
+				conn->Connect();
+			}
+			span.SetConnection(conn->GetID());
+
+			auto start = std::chrono::steady_clock::now();
+			this->Send(*conn, io, header, epilogue);
+			conn->Flush();
+			auto sent = std::chrono::steady_clock::now();
+			if (hedged)
+				this->Hedge(io, conn, header, epilogue, start);
+
+			bool keepalive = ReadResponse(*conn, response, sent);
+			if (hedged)
+				HedgeLatency.Add(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+			if (!keepalive)
+			{
+				delete conn;
+				conn = nullptr;
+			}
+			break;
+		}
+		catch (const SocketException &)
+		{
+			delete conn;
+			conn = nullptr;
+			if (reused && retry && response.empty())
+			{
+				metrics.retries.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+			throw;
+		}
+		catch (...)
+		{
+			// Half a request went out, nothing else can be sent over it.
+			delete conn;
+			conn = nullptr;
+			throw;
+		}
+	}
+
+	metrics.total.Record(SinceMicroseconds(begin));
+	TraceSpan parse("parse", span.GetConnection());
+	return this->AddKey(GetLink(response, this->arena));
+}
+
+#ifdef HAVE_COROUTINE
+// How much of the file RunAsync() reads at a time.
+static const size_t AsyncChunkSize = 64 * 1024;
+
+// Function: RunAsync
+//
+// Arguments:
+//  loop - event loop to run the upload on.
+//
+// Description:
+// Run() as a task: uploads the file over a new non-blocking
+// connection and returns the link, waiting on the event loop
+// instead of blocking the thread whenever the socket would.
+// The file itself is read with ordinary syscalls.
+Task<std::string> Upload::RunAsync(EventLoop &loop)
+{
+	const URL &url = config->url;
+	auto begin = std::chrono::steady_clock::now();
+
+	ArenaString header(this->arena), epilogue(this->arena);
+	this->BuildRequest(header, epilogue);
+
+	AsyncSocket sock(loop, std::string(url.host), std::string(url.GetPort()));
+	TraceSpan uploadspan("upload", sock.GetID(), this->size);
+	co_await sock.Connect();
+	co_await sock.Write(header.data(), header.size());
+
+	if (this->data && !this->cipher)
+		co_await sock.Write(this->data, this->size);
+	else
+	{
+		// One chunk at a time from the memory budget, waiting
+		// for the socket is what takes the time here.
+		co_await loop.AcquireMemory(AsyncChunkSize);
+		MemoryReservation reservation(AsyncChunkSize);
+		char *chunk = static_cast<char*>(this->arena.Allocate(AsyncChunkSize));
+		for (off_t offset = 0; offset < this->size;)
+		{
+			ssize_t len = std::min<off_t>(AsyncChunkSize, this->size - offset);
+			if (this->data)
+			{
+				TraceSpan span("encrypt", sock.GetID(), len);
+				this->cipher->EncryptTo(this->data + offset, len, chunk);
+			}
+			else
+			{
+				{
+					TraceSpan span("read", sock.GetID(), len);
+					len = ::pread(this->fd, chunk, len, offset);
+				}
+				if (len < 0 && errno == EINTR)
+					continue;
+				if (len < 0)
+					throw IOException("Cannot read %s: %s", this->file, strerror(errno));
+				if (len == 0)
+					throw IOException("%s was truncated while reading", this->file);
+
+				if (this->cipher)
+				{
+					TraceSpan span("encrypt", sock.GetID(), len);
+					this->cipher->EncryptTo(chunk, len, chunk);
+				}
+			}
+
+			{
+				TraceSpan span("write", sock.GetID(), len);
+				co_await sock.Write(chunk, len);
+			}
+			if (!this->data && config->dropcache)
+				posix_fadvise(this->fd, offset, len, POSIX_FADV_DONTNEED);
+			offset += len;
+		}
+	}
+
+	unsigned char tag[UploadCipher::TagSize];
+	size_t taglen = this->cipher ? this->cipher->Finish(tag) : 0;
+	if (taglen > 0)
+		co_await sock.Write(tag, taglen);
+	co_await sock.Write(epilogue.data(), epilogue.size());
+	auto sent = std::chrono::steady_clock::now();
+
+	ArenaString response(this->arena);
+	ResponseState state;
+	char buf[4096];
+	{
+		TraceSpan span("response", sock.GetID());
+		for (;;)
+		{
+			size_t len = co_await sock.Read(buf, sizeof(buf));
+			if (len == 0)
+			{
+				ResponseClosed(state);
+				break;
+			}
+			if (response.empty())
+				metrics.ttfb.Record(SinceMicroseconds(sent));
+			response.append(buf, len);
+
+			if (ResponseComplete(response, state))
+				break;
+		}
+	}
+
+	metrics.total.Record(SinceMicroseconds(begin));
+	TraceSpan parse("parse", sock.GetID());
+	co_return this->AddKey(GetLink(response, this->arena));
+}
+#endif
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2017 Justin Crawford and NamedKitten
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <openssl/rand.h>
+#include <algorithm>
+#include "UploadCipher.h"
+#include "Exceptions.h"
+#include "MemoryBudget.h"
+#include "Socket.h"
+#include "ThreadPool.h"
+#include "Util.h"
+
+// Chunks are only split for CTR if each thread gets at least this much,
+// small enough that the default 64K chunks are split four ways. Below
+// it handing the slices to the pool costs more than encrypting them.
+static const size_t MinSlice = 16 * 1024;
+
+// Constructor: UploadCipher
+//
+// Arguments:
+//  mode - "ctr" or "gcm".
+//
+// Description:
+// Makes up a random key and IV for the upload.
+UploadCipher::UploadCipher(const std::string &mode) : gcm(mode == "gcm"), ctx(nullptr), offset(0), reserved(0)
+{
+	if (RAND_bytes(this->key, sizeof(this->key)) != 1 || RAND_bytes(this->iv, sizeof(this->iv)) != 1)
+		throw UploadException("Cannot make an encryption key: %s", GetSSLErrors());
+
+	if (this->gcm)
+	{
+		this->ctx = EVP_CIPHER_CTX_new();
+		if (!this->ctx)
+			throw UploadException("Cannot set up encryption: %s", GetSSLErrors());
+	}
+	this->Restart();
+}
+
+// Destructor: UploadCipher
+//
+// Arguments:
+//  N/A
+//
+// Description:
+// Wipes the key and gives the buffer back to the memory budget.
+UploadCipher::~UploadCipher()
+{
+	OPENSSL_cleanse(this->key, sizeof(this->key));
+	EVP_CIPHER_CTX_free(this->ctx);
+	memorybudget.Release(this->reserved);
+}
+
+// Function: Restart
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Goes back to the start of the stream for the upload to be sent
+// again, which encrypts to exactly the same ciphertext.
+void UploadCipher::Restart()
+{
+	this->offset = 0;
+	if (!this->gcm)
+		return;
+
+	// GCM wants a 96 bit IV, anything else is hashed down to one.
+	if (EVP_EncryptInit_ex(this->ctx, EVP_aes_256_gcm(), nullptr, nullptr, nullptr) != 1 ||
+		EVP_CIPHER_CTX_ctrl(this->ctx, EVP_CTRL_GCM_SET_IVLEN, 12, nullptr) != 1 ||
+		EVP_EncryptInit_ex(this->ctx, nullptr, nullptr, this->key, this->iv) != 1)
+		throw UploadException("Cannot set up encryption: %s", GetSSLErrors());
+}
+
+// Function: EncryptCTR
+//
+// Arguments:
+//  data - plaintext.
+//  len  - length of the plaintext.
+//  dest - where the ciphertext goes.
+//  at   - offset of the plaintext in the stream.
+//
+// Description:
+// Encrypts part of the stream on it's own, the counter for any
+// offset is just the IV plus the number of blocks before it.
+void UploadCipher::EncryptCTR(const char *data, size_t len, char *dest, off_t at)
+{
+	// 128 bit big endian addition of the block number.
+	unsigned char counter[IVSize];
+	uint64_t add = at / 16;
+	for (int i = IVSize - 1; i >= 0; --i)
+	{
+		uint64_t sum = this->iv[i] + (add & 0xff);
+		counter[i] = sum;
+		add = (add >> 8) + (sum >> 8);
+	}
+
+	EVP_CIPHER_CTX *c = EVP_CIPHER_CTX_new();
+	int outlen;
+	unsigned char skip[16];
+	bool ok = c && EVP_EncryptInit_ex(c, EVP_aes_256_ctr(), nullptr, this->key, counter) == 1 &&
+		// Starting part way into a block, throw away the keystream before it.
+		(at % 16 == 0 || EVP_EncryptUpdate(c, skip, &outlen, skip, at % 16) == 1) &&
+		EVP_EncryptUpdate(c, reinterpret_cast<unsigned char*>(dest), &outlen, reinterpret_cast<const unsigned char*>(data), len) == 1;
+	EVP_CIPHER_CTX_free(c);
+	if (!ok)
+		throw UploadException("Cannot encrypt: %s", GetSSLErrors());
+}
+
+// Function: EncryptTo
+//
+// Arguments:
+//  data - the next chunk of the upload.
+//  len  - length of the chunk.
+//  dest - where the ciphertext goes, which can be data.
+//
+// Description:
+// Encrypts the next chunk of the stream into dest.
+void UploadCipher::EncryptTo(const char *data, size_t len, char *dest)
+{
+	if (this->gcm)
+	{
+		int outlen;
+		if (EVP_EncryptUpdate(this->ctx, reinterpret_cast<unsigned char*>(dest), &outlen, reinterpret_cast<const unsigned char*>(data), len) != 1)
+			throw UploadException("Cannot encrypt: %s", GetSSLErrors());
+	}
+	else
+	{
+		// One slice for each worker and this thread.
+		ThreadPool &pool = GetThreadPool();
+		size_t slices = std::max<size_t>(std::min(pool.GetSize() + 1, len / MinSlice), 1);
+
+		// Slices are whole blocks so only the first can start part way into one.
+		size_t slicelen = (len / slices + 15) & ~size_t(15);
+		off_t at = this->offset;
+		pool.ParallelFor(slices, [&](size_t i)
+		{
+			size_t start = i * slicelen;
+			if (start < len)
+				this->EncryptCTR(data + start, std::min(slicelen, len - start), dest + start, at + start);
+		});
+	}
+
+	this->offset += len;
+}
+
+// Function: Encrypt
+//
+// Arguments:
+//  data - the next chunk of the upload.
+//  len  - length of the chunk.
+//
+// Description:
+// Encrypts the next chunk of the stream and returns the ciphertext,
+// which is the same length and stays valid until the next call. The
+// buffer comes out of the memory budget, so this is only for chunks
+// that can't be encrypted in place (see EncryptTo) by a caller that
+// doesn't hold any of the budget already.
+const char *UploadCipher::Encrypt(const char *data, size_t len)
+{
+	if (len > this->out.size())
+	{
+		memorybudget.Acquire(len - this->reserved);
+		this->reserved = len;
+		this->out.resize(len);
+	}
+
+	this->EncryptTo(data, len, this->out.data());
+	return this->out.data();
+}
+
+// Function: Finish
+//
+// Arguments:
+//  tag - where GCM's tag goes, TagSize bytes.
+//
+// Description:
+// Ends the stream, returns how many bytes of tag have to be sent
+// after the last chunk (none for CTR).
+size_t UploadCipher::Finish(unsigned char *tag)
+{
+	if (!this->gcm)
+		return 0;
+
+	int outlen;
+	if (EVP_EncryptFinal_ex(this->ctx, tag, &outlen) != 1 ||
+		EVP_CIPHER_CTX_ctrl(this->ctx, EVP_CTRL_GCM_GET_TAG, TagSize, tag) != 1)
+		throw UploadException("Cannot encrypt: %s", GetSSLErrors());
+	return TagSize;
+}
+
+// Function: GetKey
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Returns the key in hex, which is all anyone needs to decrypt the upload.
+std::string UploadCipher::GetKey() const
+{
+	return ToHex(this->key, sizeof(this->key));
+}
+
+// Function: GetIV
+//
+// Arguments:
+//  <None>
+//
+// Description:
+// Returns the IV in hex, as much of it as the mode uses.
+std::string UploadCipher::GetIV() const
+{
+	return ToHex(this->iv, this->gcm ? 12 : IVSize);
+}